@@ -1,255 +1,7182 @@
+#include "file_stats.h"
+
 #include <algorithm>
-#include <cctype>
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <chrono>
 #include <clocale>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#if defined(_WIN32)
+#include <cstdio>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define FILE_STATS_KQUEUE 1
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define FILE_STATS_SSE2 1
+#if defined(__GNUC__) || defined(__clang__)
+#define FILE_STATS_AVX2 1     // Compiled via target attribute, enabled by CPU dispatch
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FILE_STATS_NEON 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Optional decompressors, enabled at build time (see README):
+//   -DFILE_STATS_WITH_ZLIB -lz    -DFILE_STATS_WITH_ZSTD -lzstd    -DFILE_STATS_WITH_LZ4 -llz4
+#if defined(FILE_STATS_WITH_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(FILE_STATS_WITH_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(FILE_STATS_WITH_LZ4)
+#include <lz4frame.h>
+#endif
+// io_uring read-ahead for --io=uring (Linux): -DFILE_STATS_WITH_URING -luring
+#if defined(FILE_STATS_WITH_URING) && defined(__linux__)
+#include <liburing.h>
+#endif
+// Tokenizing and counting on a CUDA device for --gpu: -DFILE_STATS_WITH_CUDA, linked with
+// file_stats_cuda.o (built by nvcc) and -lcudart
+#if defined(FILE_STATS_WITH_CUDA)
+#include "file_stats_cuda.h"
+#endif
+
+// How input bytes are brought into memory (--io).
+enum class IoEngine
+{
+    Mmap,   // Map regular files; stream everything else with read() (default)
+    Pread,  // Read-ahead thread filling a ring of buffers with pread()
+    Uring   // Several io_uring reads in flight, consumed in order
+};
+
+// Where the worker threads of a multi-threaded run count words (--table).
+enum class TableBackend
+{
+    Merge,    // One table per thread, merged into one table at the end (default)
+    Sharded   // Tables partitioned by word hash, shared by all threads behind striped locks
+};
+
+// How a coordinator (--workers) combines the workers' word tables into the top-K.
+enum class Reduce
+{
+    Tput,     // Three-round threshold algorithm: exact, ships only the entries that matter (default)
+    Full      // Every worker ships its whole table
+};
+
+// Which pages back large allocations (see large_alloc).
+enum class HugePages
+{
+    Off,          // Plain pages
+    Transparent,  // madvise(MADV_HUGEPAGE); the kernel backs what it can (default)
+    Explicit      // MAP_HUGETLB from the reserved pool, else as Transparent
+};
+
+struct TokenRules;
+
 // Holds CLI configuration parsed from command-line arguments.
 struct Config
 {
-    std::string input_path;   // Path to the input text file to analyze
+    std::string input_path;   // Path to the input text file to analyze ("-" = stdin)
+    std::vector<std::string> inputs; // Every path given on the command line
+    std::string files_from;   // Batch mode: file listing one input path per line
+    bool recursive = false;   // Batch mode: descend into directories
+    bool merge = false;       // Batch mode: also report one merged top-K over all files
     std::string json_path;    // If non-empty, write JSON report to this path
+    bool ndjson = false;      // Write the JSON report as newline-delimited records
     std::size_t topN = 20;    // Number of top frequent words to display/export
     bool case_sensitive = false; // Word frequency counting mode
+    unsigned threads = 1;     // Worker threads for chunked analysis (0 = all cores)
+    bool numa = false;        // --threads: pin workers to CPUs node by node, merge per node
+    bool gpu = false;         // Tokenize and count on a CUDA device (FILE_STATS_WITH_CUDA builds)
+    bool simd = true;         // Use the vectorized scanner (false = scalar reference loop)
+    bool count_only = false;  // Only count lines/words/bytes; no frequency table or top-K
+    bool approx = false;      // Bounded-memory Space-Saving top-K instead of an exact table
+    std::size_t memory_budget = std::size_t(256) << 20; // Approximate mode memory ceiling
+    bool profile = false;     // Report per-stage timings and hardware counters
+    std::string state_path;   // If non-empty, resume from / save incremental state here
+    std::string snapshot_path; // If non-empty, write the full frequency table here
+    bool decompress = true;   // Detect .gz/.zst/.lz4 input by magic bytes and decode it
+    IoEngine io = IoEngine::Mmap;
+    bool utf8 = false;        // Unicode letters/digits are word chars; input decoded as UTF-8
+    TableBackend table = TableBackend::Merge;
+    bool follow = false;      // Tail the input and report the top words of a sliding window
+    unsigned window_seconds = 300;   // --follow: time span of the window
+    std::uint64_t window_bytes = 0;  // --follow: byte span of the window instead (0 = time)
+    unsigned interval_seconds = 10;  // --follow: time between reports
+    unsigned ngram = 0;       // If 2..4, also count runs of this many consecutive words
+    std::string word_chars;   // --word-chars: the word-char set ("+..." extends the default)
+    std::size_t min_len = 0;  // --min-len: shorter words are dropped (0 = no limit)
+    std::size_t max_len = 0;  // --max-len: longer words are dropped (0 = no limit)
+    std::string stopwords_path; // --stopwords: file of words that are never counted
+    std::shared_ptr<const TokenRules> rules; // Built from the four above by make_rules()
+    std::vector<std::string> workers; // --workers: analyze on these worker hosts (host:port)
+    Reduce reduce = Reduce::Tput;     // --workers: how the top-K is reduced
+    std::uint64_t range_size = std::uint64_t(256) << 20; // --workers: split larger files into ranges
+    std::uint64_t expected_unique = 0; // --expected-unique: pre-size the word table for this many words
+    bool estimate_unique = false;      // --expected-unique auto: estimate that from a sample instead
+    HugePages huge_pages = HugePages::Transparent;
 };
 
 // Print short help/usage instructions.
 static void print_help(const char* exe) {
     std::cout   << "File Stats - Text file analysis\n\n"
                 << "Usage:\n"
-                << "  " << exe << " <input.txt> [--top N] [--json out.json] [--case-sensitive] [--help]\n\n"
+                << "  " << exe << " <input.txt | -> [options]\n"
+                << "  " << exe << " <input>... | --recursive <dir>... | --files-from list.txt [--merge] [options]\n\n"
                 << "Options:\n"
+                << "  -                  Read the input from stdin (e.g. zcat log.gz | file_stats -)\n"
+                << "  --recursive, -r    Analyze every regular file under the given directories\n"
+                << "  --files-from LIST  Analyze the paths listed one per line in LIST ('-' = stdin)\n"
+                << "  --merge            With several inputs, also report one merged top-K\n"
                 << "  --top N            Show top N most frequent words (default: 20)\n"
                 << "  --json out.json    Export results to JSON file\n"
+                << "  --ndjson           Write the JSON export as NDJSON: a summary record, then one\n"
+                << "                     record per top word\n"
                 << "  --case-sensitive   Word frequency is case-sensitive (default: false)\n"
-                << "  --help             Show this help and exit\n";
+                << "  --utf8             Treat Unicode letters and digits as word chars (simple case folding)\n"
+                << "  --counts-only      Only count lines/words/bytes (same as --top 0)\n"
+                << "  --word-chars SET   Bytes that form words instead of A-Z a-z 0-9, e.g. 'a-z0-9_'\n"
+                << "                     ('+SET' adds to the default set; '\\' escapes the next char)\n"
+                << "  --min-len N        Skip words shorter than N chars\n"
+                << "  --max-len N        Skip words longer than N chars\n"
+                << "  --stopwords FILE   Skip the words listed in FILE (tokenized like the input)\n"
+                << "  --ngram N          Also report the top N-word phrases (N = 2, 3 or 4)\n"
+                << "  --approx-top K     Approximate top K in bounded memory, with per-word error bounds\n"
+                << "  --memory SIZE      Memory ceiling for --approx-top, e.g. 64M or 2G (default: 256M);\n"
+                << "                     long words take counters away rather than exceed it\n"
+                << "  --threads N        Analyze with N worker threads, or N files at a time in batch\n"
+                << "                     mode (0 = all cores, default: 1)\n"
+                << "  --table KIND       Word table for --threads: merge (per-thread tables merged at\n"
+                << "                     the end, default) or sharded (hash-partitioned shared shards)\n"
+                << "  --numa             With --threads, pin the workers to CPUs node by node and merge\n"
+                << "                     each NUMA node's tables on that node first\n"
+                << "  --gpu              Tokenize and count on a CUDA device; only the top-K candidates\n"
+                << "                     come back (builds with FILE_STATS_WITH_CUDA)\n"
+                << "  --expected-unique N|auto\n"
+                << "                     Pre-size the word table for N distinct words, or for an\n"
+                << "                     estimate from a HyperLogLog pass over samples of the input\n"
+                << "  --huge-pages MODE  Back large tables and buffers with huge pages: transparent\n"
+                << "                     (default), explicit (hugetlb pool first) or off\n"
+                << "  --snapshot FILE    Save the full word table as a binary snapshot (see merge)\n"
+                << "  --state FILE       Incremental mode for append-only files: only bytes appended\n"
+                << "                     since the last run (recorded in FILE) are scanned\n"
+                << "  --io ENGINE        How input is read: mmap (default), pread (read-ahead thread)\n"
+                << "                     or uring (io_uring, Linux builds with FILE_STATS_WITH_URING)\n"
+                << "  --follow           Tail a growing file like tail -f and report the top words of a\n"
+                << "                     sliding window every --interval (stop with Ctrl-C)\n"
+                << "  --window SPAN      --follow: window length, e.g. 90s, 5m or 1h (default: 5m)\n"
+                << "  --window-bytes N   --follow: window over the last N bytes instead, e.g. 64M\n"
+                << "  --interval SPAN    --follow: time between reports (default: 10s)\n"
+                << "  --workers LIST     Analyze on remote workers (comma-separated host:port list, see\n"
+                << "                     the worker subcommand); input paths must be valid on every host\n"
+                << "  --reduce KIND      --workers: tput (exact top-K in three rounds, default) or full\n"
+                << "                     (every worker ships its whole table)\n"
+                << "  --range-size SIZE  --workers: split uncompressed files larger than SIZE into byte\n"
+                << "                     ranges for different workers (default: 256M, minimum: 1M)\n"
+                << "  --no-decompress    Analyze compressed input as raw bytes instead of decoding it\n"
+                << "  --no-simd          Use the portable scalar tokenizer (reference path)\n"
+                << "  --profile          Report per-stage wall/CPU time, RSS and hardware counters\n"
+                << "  --help             Show this help and exit\n\n"
+                << "Subcommands:\n"
+                << "  " << exe << " merge a.snap b.snap... [--top N] [--json out.json [--ndjson]] [--snapshot out.snap]\n"
+                << "                     Combine snapshots into one top-K (and optionally one snapshot)\n"
+                << "  " << exe << " worker --listen [HOST:]PORT [--threads N] [--idle-timeout SPAN]\n"
+                << "                     Serve analysis tasks for a coordinator run (--workers); a bare\n"
+                << "                     PORT binds 127.0.0.1 only. Set FILE_STATS_TOKEN to the same secret\n"
+                << "                     for the workers and the coordinator before listening elsewhere\n"
+                << "  " << exe << " bench [options]   Benchmark each stage on a synthetic corpus (bench --help)\n";
+}
+
+// True if `path` names standard input rather than a file.
+static inline bool is_stdin_path(const std::string& path) {
+    return path == "-";
+}
+
+// Name used for an input in reports.
+static std::string display_name(const std::string& path) {
+    return is_stdin_path(path) ? "<stdin>" : path;
+}
+
+// True if the command line asks for more than one single-file report.
+static bool is_batch(const Config& conf) {
+    return conf.inputs.size() > 1 || conf.recursive || conf.merge || !conf.files_from.empty();
+}
+
+// Parse a byte size such as "4096", "64K", "256M" or "2G". Throws on malformed input
+// and on sizes that do not fit in a size_t.
+static std::size_t parse_size(const std::string& text) {
+    std::size_t used = 0;
+    if (!text.empty() && text[0] == '-') throw std::invalid_argument("Bad size: " + text);
+    unsigned long long v = std::stoull(text, &used);
+    std::string suffix = text.substr(used);
+    unsigned shift = 0;
+    if (suffix == "K" || suffix == "k") shift = 10;
+    else if (suffix == "M" || suffix == "m") shift = 20;
+    else if (suffix == "G" || suffix == "g") shift = 30;
+    else if (!suffix.empty()) throw std::invalid_argument("Bad size: " + text);
+    if (v > (SIZE_MAX >> shift)) throw std::out_of_range("Size too large: " + text);
+    return static_cast<std::size_t>(v << shift);
+}
+
+// Parse a duration in seconds such as "30", "30s", "5m" or "1h". Throws on malformed input.
+static unsigned parse_seconds(const std::string& text) {
+    std::size_t used = 0;
+    unsigned long long v = std::stoull(text, &used);
+    std::string suffix = text.substr(used);
+    if (suffix == "m") v *= 60;
+    else if (suffix == "h") v *= 3600;
+    else if (!suffix.empty() && suffix != "s") throw std::invalid_argument("Bad duration: " + text);
+    return static_cast<unsigned>(std::min<unsigned long long>(v, UINT32_MAX));
 }
 
 // Parse command-line args into Config. Returns false if args are invalid.
-static bool parse_args(int argc, char** argv, Config& conf) {
-    if (argc < 2) return false;              // Require at least an input file
-    conf.input_path = argv[1];
-    for (int i = 2; i < argc; ++i) {
+[[maybe_unused]] static bool parse_args(int argc, char** argv, Config& conf) {
+    int i = 1;
+    try {
+    for (; i < argc; ++i) {
         std::string a =  argv[i];
-        if (a == "--help" || a == "-h") {
+        if (a == "-" || a[0] != '-') {
+            conf.inputs.push_back(a);        // Positional: an input path
+        } else if (a == "--help" || a == "-h") {
             print_help(argv[0]);
             std::exit(0);                    // Early exit after showing help
         } else if (a == "--top" && i + 1 < argc) {
             conf.topN = static_cast<std::size_t>(std::stoul(argv[++i]));
         } else if (a == "--json" && i + 1 < argc) {
             conf.json_path = argv[++i];
+        } else if (a == "--ndjson") {
+            conf.ndjson = true;
         } else if (a == "--case-sensitive") {
             conf.case_sensitive = true;
+        } else if (a == "--utf8") {
+            conf.utf8 = true;
+        } else if (a == "--word-chars" && i + 1 < argc) {
+            conf.word_chars = argv[++i];
+        } else if (a == "--min-len" && i + 1 < argc) {
+            conf.min_len = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (a == "--max-len" && i + 1 < argc) {
+            conf.max_len = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (a == "--stopwords" && i + 1 < argc) {
+            conf.stopwords_path = argv[++i];
+        } else if (a == "--ngram" && i + 1 < argc) {
+            conf.ngram = static_cast<unsigned>(std::stoul(argv[++i]));
+        } else if (a == "--approx-top" && i + 1 < argc) {
+            conf.topN = static_cast<std::size_t>(std::stoul(argv[++i]));
+            conf.approx = true;
+        } else if (a == "--memory" && i + 1 < argc) {
+            conf.memory_budget = parse_size(argv[++i]);
+        } else if (a == "--recursive" || a == "-r") {
+            conf.recursive = true;
+        } else if (a == "--files-from" && i + 1 < argc) {
+            conf.files_from = argv[++i];
+        } else if (a == "--merge") {
+            conf.merge = true;
+        } else if (a == "--counts-only") {
+            conf.count_only = true;
+        } else if (a == "--snapshot" && i + 1 < argc) {
+            conf.snapshot_path = argv[++i];
+        } else if (a == "--state" && i + 1 < argc) {
+            conf.state_path = argv[++i];
+        } else if (a == "--profile") {
+            conf.profile = true;
+        } else if ((a == "--io" && i + 1 < argc) || a.rfind("--io=", 0) == 0) {
+            std::string engine = a == "--io" ? argv[++i] : a.substr(5);
+            if (engine == "mmap") {
+                conf.io = IoEngine::Mmap;
+            } else if (engine == "pread") {
+                conf.io = IoEngine::Pread;
+            } else if (engine == "uring") {
+#if !(defined(FILE_STATS_WITH_URING) && defined(__linux__))
+                std::cerr << "--io=uring needs a Linux build with -DFILE_STATS_WITH_URING -luring\n";
+                return false;
+#endif
+                conf.io = IoEngine::Uring;
+            } else {
+                std::cerr << "Unknown I/O engine: " << engine << " (expected mmap, pread or uring)\n";
+                return false;
+            }
+        } else if (a == "--table" && i + 1 < argc) {
+            std::string kind = argv[++i];
+            if (kind == "merge") {
+                conf.table = TableBackend::Merge;
+            } else if (kind == "sharded") {
+                conf.table = TableBackend::Sharded;
+            } else {
+                std::cerr << "Unknown table backend: " << kind << " (expected merge or sharded)\n";
+                return false;
+            }
+        } else if (a == "--numa") {
+            conf.numa = true;
+        } else if (a == "--gpu") {
+#if !defined(FILE_STATS_WITH_CUDA)
+            std::cerr << "--gpu needs a build with -DFILE_STATS_WITH_CUDA and file_stats_cuda.cu (see README)\n";
+            return false;
+#endif
+            conf.gpu = true;
+        } else if (a == "--expected-unique" && i + 1 < argc) {
+            std::string n = argv[++i];
+            conf.estimate_unique = n == "auto";
+            conf.expected_unique = conf.estimate_unique ? 0 : parse_size(n);
+        } else if ((a == "--huge-pages" && i + 1 < argc) || a.rfind("--huge-pages=", 0) == 0) {
+            std::string mode = a == "--huge-pages" ? argv[++i] : a.substr(13);
+            if (mode == "transparent") {
+                conf.huge_pages = HugePages::Transparent;
+            } else if (mode == "explicit") {
+                conf.huge_pages = HugePages::Explicit;
+            } else if (mode == "off") {
+                conf.huge_pages = HugePages::Off;
+            } else {
+                std::cerr << "Unknown huge page mode: " << mode << " (expected transparent, explicit or off)\n";
+                return false;
+            }
+        } else if (a == "--workers" && i + 1 < argc) {
+            std::string list = argv[++i];
+            for (std::size_t pos = 0; pos <= list.size();) {
+                std::size_t comma = std::min(list.find(',', pos), list.size());
+                if (comma > pos) conf.workers.push_back(list.substr(pos, comma - pos));
+                pos = comma + 1;
+            }
+        } else if (a == "--reduce" && i + 1 < argc) {
+            std::string kind = argv[++i];
+            if (kind == "tput") {
+                conf.reduce = Reduce::Tput;
+            } else if (kind == "full") {
+                conf.reduce = Reduce::Full;
+            } else {
+                std::cerr << "Unknown reduce method: " << kind << " (expected tput or full)\n";
+                return false;
+            }
+        } else if (a == "--range-size" && i + 1 < argc) {
+            conf.range_size = std::max<std::uint64_t>(1, parse_size(argv[++i]));
+        } else if (a == "--follow") {
+            conf.follow = true;
+        } else if (a == "--window" && i + 1 < argc) {
+            conf.window_seconds = parse_seconds(argv[++i]);
+        } else if (a == "--window-bytes" && i + 1 < argc) {
+            conf.window_bytes = parse_size(argv[++i]);
+        } else if (a == "--interval" && i + 1 < argc) {
+            conf.interval_seconds = parse_seconds(argv[++i]);
+        } else if (a == "--no-decompress") {
+            conf.decompress = false;
+        } else if (a == "--no-simd") {
+            conf.simd = false;
+        } else if (a == "--threads" && i + 1 < argc) {
+            conf.threads = static_cast<unsigned>(std::stoul(argv[++i]));
+            if (conf.threads == 0) conf.threads = std::max(1u, std::thread::hardware_concurrency());
         } else {
             std::cerr << "Unknown argument: " << a << "\n";
             return false;
         }
     }
+    } catch (const std::exception&) {
+        std::cerr << "Invalid value for " << argv[i - 1] << ": " << argv[i] << "\n";
+        return false;
+    }
+    if (conf.inputs.empty() && conf.files_from.empty()) return false; // Require an input
+    if (conf.inputs.size() == 1) conf.input_path = conf.inputs[0];
+    if (conf.topN == 0) conf.count_only = true;
+    if (conf.approx && conf.threads > 1) {
+        std::cerr << "--approx-top cannot be combined with --threads\n";
+        return false;
+    }
+    if (conf.approx && is_batch(conf)) {
+        std::cerr << "--approx-top supports a single input only\n";
+        return false;
+    }
+    if (!conf.snapshot_path.empty() &&
+        (conf.approx || conf.count_only || (is_batch(conf) && !conf.merge && conf.workers.empty()))) {
+        std::cerr << "--snapshot needs an exact word table (and --merge in batch mode)\n";
+        return false;
+    }
+    if (!conf.state_path.empty() && (is_batch(conf) || conf.approx || is_stdin_path(conf.input_path))) {
+        std::cerr << "--state needs a single input file and exact counting\n";
+        return false;
+    }
+    if (conf.max_len != 0 && conf.max_len < conf.min_len) {
+        std::cerr << "--max-len must not be less than --min-len\n";
+        return false;
+    }
+    if (conf.ngram != 0) {
+        if (conf.ngram < 2 || conf.ngram > 4) {
+            std::cerr << "--ngram must be 2, 3 or 4\n";
+            return false;
+        }
+        if (is_batch(conf) || conf.count_only || conf.approx || conf.threads > 1 || conf.follow ||
+            !conf.state_path.empty() || !conf.snapshot_path.empty()) {
+            std::cerr << "--ngram needs a single input and exact single-threaded counting (no --counts-only, "
+                         "--approx-top, --threads, --follow, --state or --snapshot)\n";
+            return false;
+        }
+    }
+    if (!conf.workers.empty()) {
+#if defined(_WIN32)
+        std::cerr << "--workers is not supported on Windows\n";
+        return false;
+#endif
+        for (const std::string& p : conf.inputs) {
+            if (is_stdin_path(p)) {
+                std::cerr << "--workers cannot read stdin; give paths that every worker can open\n";
+                return false;
+            }
+        }
+        if (conf.approx || conf.ngram || conf.follow || conf.threads > 1 || !conf.state_path.empty()) {
+            std::cerr << "--workers cannot be combined with --approx-top, --ngram, --follow, --state or "
+                         "--threads (set --threads on each worker)\n";
+            return false;
+        }
+        if (!conf.snapshot_path.empty() && conf.reduce != Reduce::Full) {
+            std::cerr << "--snapshot with --workers needs --reduce full\n";
+            return false;
+        }
+    }
+    if (conf.gpu && (conf.utf8 || !conf.stopwords_path.empty() || conf.approx || conf.ngram || conf.threads > 1 ||
+                     conf.merge || conf.follow || !conf.state_path.empty() || !conf.snapshot_path.empty() ||
+                     !conf.workers.empty())) {
+        std::cerr << "--gpu keeps the word table on the device, so it cannot be combined with --utf8, --stopwords, "
+                     "--approx-top, --ngram, --threads, --merge, --follow, --state, --snapshot or --workers\n";
+        return false;
+    }
+    if (conf.follow) {
+#if defined(_WIN32)
+        std::cerr << "--follow is not supported on Windows\n";
+        return false;
+#endif
+        if (is_batch(conf) || is_stdin_path(conf.input_path) || conf.approx || conf.threads > 1 ||
+            !conf.state_path.empty() || !conf.snapshot_path.empty()) {
+            std::cerr << "--follow needs a single input file and cannot be combined with --approx-top, "
+                         "--threads, --state or --snapshot\n";
+            return false;
+        }
+        if (conf.interval_seconds == 0 || (conf.window_bytes == 0 && conf.window_seconds == 0)) {
+            std::cerr << "--window and --interval must be positive\n";
+            return false;
+        }
+    }
 
     return true;
 }
 
-// ASCII-safe predicate: a "word char" is alphanumeric (A–Z, a–z, 0–9).
-// This intentionally ignores accents and non-ASCII letters to avoid locale issues.
+// Per-byte lookup tables, built at compile time. A "word char" is ASCII alphanumeric
+// (A–Z, a–z, 0–9); accents and non-ASCII letters are deliberately excluded, and no
+// locale is consulted (main() sets the user locale, which std::isalnum would follow).
+struct ByteTables
+{
+    bool word[256];
+    char lower[256];
+};
+
+static constexpr ByteTables make_byte_tables() {
+    ByteTables t{};
+    for (int c = 0; c < 256; ++c) {
+        t.word[c] = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+        t.lower[c] = static_cast<char>(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+    return t;
+}
+
+static constexpr ByteTables kByteTables = make_byte_tables();
+
 static inline bool is_word_char(unsigned char ch) {
-    return std::isalnum(ch) != 0;
+    return kByteTables.word[ch];
 }
 
-// Aggregated statistics produced by the analyzer.
-struct Stats
+// ASCII lowercase; only ever applied to word chars, so no locale lookup is needed.
+static inline char ascii_lower(unsigned char ch) {
+    return kByteTables.lower[ch];
+}
+
+// ---- Unicode (--utf8) ----------------------------------------------------------
+
+// Code point ranges counted as word chars in --utf8 mode: letters, combining marks and
+// decimal digits of the major scripts, approximated per block (sorted, non-overlapping).
+struct CodeRange
 {
-    std::uint64_t lines = 0;  // Number of lines in the file
-    std::uint64_t words = 0;  // Number of words detected by is_word_char tokenization
-    std::uint64_t bytes = 0;  // File size in bytes (octets)
-    // Word frequency map: token -> count
-    std::unordered_map<std::string, std::uint64_t> freq;
+    char32_t lo, hi;
 };
 
-// Read the file, count lines/words, build frequency table, and compute byte size.
-static Stats analyze_file(const Config& conf) {
-    Stats st;
+static constexpr CodeRange kUnicodeWordRanges[] = {
+    {0x00AA, 0x00AA}, {0x00B5, 0x00B5}, {0x00BA, 0x00BA}, {0x00C0, 0x00D6}, {0x00D8, 0x00F6},
+    {0x00F8, 0x02C1}, {0x02C6, 0x02D1}, {0x02E0, 0x02E4}, {0x02EC, 0x02EC}, {0x02EE, 0x02EE},
+    {0x0300, 0x0374}, {0x0376, 0x0377}, {0x037A, 0x037D}, {0x037F, 0x037F}, {0x0386, 0x0386},
+    {0x0388, 0x038A}, {0x038C, 0x038C}, {0x038E, 0x03A1}, {0x03A3, 0x03F5}, {0x03F7, 0x0481},
+    {0x0483, 0x052F}, {0x0531, 0x0556}, {0x0559, 0x0559}, {0x0560, 0x0588}, {0x0591, 0x05BD},
+    {0x05BF, 0x05BF}, {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x05D0, 0x05EA},
+    {0x05EF, 0x05F2}, {0x0610, 0x061A}, {0x0620, 0x0669}, {0x066E, 0x06D3}, {0x06D5, 0x06DC},
+    {0x06DF, 0x06E8}, {0x06EA, 0x06FC}, {0x06FF, 0x06FF}, {0x0710, 0x074A}, {0x074D, 0x07B1},
+    {0x0900, 0x0963}, {0x0966, 0x096F}, {0x0971, 0x0DF3}, {0x0E01, 0x0E3A}, {0x0E40, 0x0E4E},
+    {0x0E50, 0x0E59}, {0x0E81, 0x0EDF}, {0x0F40, 0x0FBC}, {0x1000, 0x1049}, {0x1050, 0x109D},
+    {0x10A0, 0x10FA}, {0x10FC, 0x135A}, {0x13A0, 0x13FD}, {0x1401, 0x166C}, {0x1780, 0x17D3},
+    {0x17E0, 0x17E9}, {0x1820, 0x1878}, {0x1D00, 0x1FBC}, {0x1FC2, 0x1FCC}, {0x1FD0, 0x1FDB},
+    {0x1FE0, 0x1FEC}, {0x1FF2, 0x1FFC}, {0x2071, 0x2071}, {0x207F, 0x207F}, {0x2090, 0x209C},
+    {0x20D0, 0x20F0}, {0x2102, 0x2102}, {0x2107, 0x2107}, {0x210A, 0x2113}, {0x2115, 0x2115},
+    {0x2119, 0x211D}, {0x2124, 0x2124}, {0x2126, 0x2126}, {0x2128, 0x2128}, {0x212A, 0x212D},
+    {0x212F, 0x2139}, {0x2C00, 0x2CE4}, {0x2D00, 0x2D25}, {0x2D30, 0x2D67}, {0x2DE0, 0x2DFF},
+    {0x3005, 0x3007}, {0x3021, 0x302F}, {0x3031, 0x3035}, {0x3038, 0x303C}, {0x3041, 0x3096},
+    {0x3099, 0x309F}, {0x30A1, 0x30FA}, {0x30FC, 0x30FF}, {0x3105, 0x312F}, {0x3131, 0x318E},
+    {0x31A0, 0x31BF}, {0x31F0, 0x31FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA48C},
+    {0xA4D0, 0xA4FD}, {0xA500, 0xA60C}, {0xA610, 0xA62B}, {0xA640, 0xA672}, {0xA674, 0xA67D},
+    {0xA67F, 0xA6F1}, {0xA717, 0xA71F}, {0xA722, 0xA788}, {0xA78B, 0xA827}, {0xAC00, 0xD7A3},
+    {0xD7B0, 0xD7FB}, {0xF900, 0xFB06}, {0xFB13, 0xFB17}, {0xFB1D, 0xFB28}, {0xFB2A, 0xFBB1},
+    {0xFBD3, 0xFD3D}, {0xFD50, 0xFDC7}, {0xFDF0, 0xFDFB}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFE70, 0xFEFC}, {0xFF10, 0xFF19}, {0xFF21, 0xFF3A}, {0xFF41, 0xFF5A}, {0xFF66, 0xFFDC},
+    {0x10000, 0x100FA}, {0x10280, 0x1049D}, {0x104A0, 0x104A9}, {0x1D400, 0x1D7FF},
+    {0x20000, 0x2FA1F}, {0x30000, 0x323AF}, {0xE0100, 0xE01EF},
+};
+
+// True if the non-ASCII code point `cp` is a word char in --utf8 mode.
+static bool is_unicode_word(char32_t cp) {
+    const CodeRange* end = std::end(kUnicodeWordRanges);
+    const CodeRange* r = std::upper_bound(std::begin(kUnicodeWordRanges), end, cp,
+                                          [](char32_t c, const CodeRange& range) { return c < range.lo; });
+    return r != std::begin(kUnicodeWordRanges) && cp <= (r - 1)->hi;
+}
 
-    // Open text file in default (text) mode.
-    std::ifstream in(conf.input_path);
-    if (!in) {
-        throw std::runtime_error("Cannot open input file: " + conf.input_path);
+// Simple (1:1) case folding for ASCII, Latin, Greek, Cyrillic, Armenian, Georgian and
+// fullwidth Latin; other code points are returned as they are.
+static char32_t fold_case(char32_t c) {
+    auto pair_even = [](char32_t u) { return u | 1; };                     // Upper case at even code points
+    auto pair_odd = [](char32_t u) { return (u & 1) ? u + 1 : u; };        // Upper case at odd code points
+    if (c < 0x80) return static_cast<unsigned char>(ascii_lower(static_cast<unsigned char>(c)));
+    if (c < 0x100) {
+        if (c == 0xB5) return 0x3BC;                                         // MICRO SIGN -> mu
+        return (c >= 0xC0 && c <= 0xDE && c != 0xD7) ? c + 0x20 : c;
+    }
+    if (c < 0x180) {
+        if (c == 0x130 || c == 0x131 || c == 0x138 || c == 0x149) return c;  // No simple pair
+        if (c == 0x178) return 0xFF;
+        if (c == 0x17F) return 's';
+        if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) return pair_odd(c);
+        return pair_even(c);
     }
+    if (c < 0x250) {
+        if (c >= 0x1CD && c <= 0x1DC) return pair_odd(c);
+        if ((c >= 0x1DE && c <= 0x1EF) || (c >= 0x1F8 && c <= 0x21F) || (c >= 0x222 && c <= 0x233) ||
+            (c >= 0x246 && c <= 0x24F)) {
+            return pair_even(c);
+        }
+        return c;
+    }
+    if (c >= 0x370 && c < 0x400) {
+        if (c == 0x386) return 0x3AC;
+        if (c >= 0x388 && c <= 0x38A) return c + 37;
+        if (c == 0x38C) return 0x3CC;
+        if (c == 0x38E || c == 0x38F) return c + 63;
+        if ((c >= 0x391 && c <= 0x3A1) || (c >= 0x3A3 && c <= 0x3AB)) return c + 32;
+        if (c == 0x3C2) return 0x3C3;                                      // Final sigma
+        return c;
+    }
+    if (c >= 0x400 && c < 0x530) {
+        if (c < 0x410) return c + 80;
+        if (c < 0x430) return c + 32;
+        if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF) || (c >= 0x4D0 && c <= 0x52F)) return pair_even(c);
+        if (c == 0x4C0) return 0x4CF;
+        if (c >= 0x4C1 && c <= 0x4CE) return pair_odd(c);
+        return c;
+    }
+    if (c >= 0x531 && c <= 0x556) return c + 48;
+    if (c >= 0x10A0 && c <= 0x10C5) return c + 0x1C60;
+    if (c >= 0x1E00 && c <= 0x1EFF) {
+        if (c == 0x1E9E) return 0xDF;                                        // Capital sharp s
+        return (c <= 0x1E95 || c >= 0x1EA0) ? pair_even(c) : c;
+    }
+    if (c >= 0xFF21 && c <= 0xFF3A) return c + 32;
+    return c;
+}
 
-    std::string line;
-    // Read line by line to count lines and tokenize content into words.
-    while (std::getline(in, line)) {
-        ++st.lines;
+// Append the UTF-8 encoding of a valid code point.
+static void append_utf8(std::string& out, char32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
 
-        // Access raw bytes to avoid signed-char UB and to keep ASCII logic explicit.
-        const unsigned char* p = reinterpret_cast<const unsigned char*>(line.data());
-        std::size_t n = line.size();
-        std::string token;            // Current word being built
-        token.reserve(32);            // Small optimization: reduce reallocations
+static inline unsigned popcount64(std::uint64_t x) {
+#if defined(_MSC_VER)
+    return static_cast<unsigned>(__popcnt64(x));
+#else
+    return static_cast<unsigned>(__builtin_popcountll(x));
+#endif
+}
 
-        for (std::size_t i = 0; i < n; ++i) {
-            unsigned char ch = p[i];
-            if (is_word_char(ch)) {
-                // Build token; optionally lowercase for case-insensitive mode.
-                char c = static_cast<char>(ch);
-                if (!conf.case_sensitive) c = static_cast<char>(std::tolower(c));
-                token.push_back(c);
-            } else {
-                // Non-word boundary: flush any pending token.
-                if (!token.empty()) {
-                    ++st.words;
-                    ++st.freq[token];
-                    token.clear();
-                }
-            }
-        }
-        // Flush last token at end of line (if the line ends with a word character).
-        if (!token.empty()) {
-            ++st.words;
-            ++st.freq[token];
-            token.clear();
-        }
+// Count trailing zeros; `x` must be non-zero.
+static inline unsigned ctz64(std::uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, x);
+    return static_cast<unsigned>(idx);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(x));
+#endif
+}
+
+// Index of the highest set bit; `x` must be non-zero.
+static inline unsigned log2_floor64(std::uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanReverse64(&idx, x);
+    return static_cast<unsigned>(idx);
+#else
+    return 63u - static_cast<unsigned>(__builtin_clzll(x));
+#endif
+}
+
+// ---- Block scanner kernels -------------------------------------------------
+// Each kernel classifies kScanBlock input bytes at once: bit i of `word` is set when
+// byte i is a word char, bit i of `newline` when it is '\n', and bit i of `nonascii`
+// when its high bit is set. They all implement exactly is_word_char(); the scalar
+// kernel is the reference for the vector ones.
+
+static constexpr std::size_t kScanBlock = 64;
+
+struct BlockMasks
+{
+    std::uint64_t word;
+    std::uint64_t newline;
+    std::uint64_t nonascii;   // --utf8 takes the ASCII fast path when this is 0
+};
+
+using ClassifyFn = BlockMasks (*)(const unsigned char* p);
+
+[[maybe_unused]] static BlockMasks classify_scalar(const unsigned char* p) {
+    BlockMasks m{0, 0, 0};
+    for (std::size_t i = 0; i < kScanBlock; ++i) {
+        m.word |= static_cast<std::uint64_t>(is_word_char(p[i])) << i;
+        m.newline |= static_cast<std::uint64_t>(p[i] == '\n') << i;
+        m.nonascii |= static_cast<std::uint64_t>(p[i] >> 7) << i;
     }
+    return m;
+}
 
-    // Determine file size in bytes. This is precise and includes newlines.
-    std::error_code ec;
-    st.bytes = std::filesystem::file_size(conf.input_path, ec);
-    if (ec) {
-        // Fallback path for special cases (e.g., file_size error, virtual files).
-        std::ifstream in2(conf.input_path, std::ios::binary);
-        st.bytes = 0;
-        char buf[1 << 14]; // 16 KB buffer
-        while (in2.read(buf, sizeof(buf)) || in2.gcount() > 0) {
-            st.bytes += static_cast<std::uint64_t>(in2.gcount());
-        }
+#if FILE_STATS_SSE2
+// Unsigned range checks: (c - '0') <= 9 for digits, ((c | 0x20) - 'a') <= 25 for letters.
+static inline void classify16_sse2(const unsigned char* p, std::uint32_t& word, std::uint32_t& nl,
+                                   std::uint32_t& high) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(25)), l);
+    word = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)));
+    nl = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+    high = static_cast<std::uint32_t>(_mm_movemask_epi8(v));
+}
+
+static BlockMasks classify_sse2(const unsigned char* p) {
+    BlockMasks m{0, 0, 0};
+    for (unsigned k = 0; k < 4; ++k) {
+        std::uint32_t w, nl, high;
+        classify16_sse2(p + 16 * k, w, nl, high);
+        m.word |= static_cast<std::uint64_t>(w) << (16 * k);
+        m.newline |= static_cast<std::uint64_t>(nl) << (16 * k);
+        m.nonascii |= static_cast<std::uint64_t>(high) << (16 * k);
     }
+    return m;
+}
+#endif
 
-    return st;
+#if FILE_STATS_AVX2
+__attribute__((target("avx2")))
+static inline void classify32_avx2(const unsigned char* p, std::uint32_t& word, std::uint32_t& nl,
+                                   std::uint32_t& high) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(25)), l);
+    word = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)));
+    nl = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+    high = static_cast<std::uint32_t>(_mm256_movemask_epi8(v));
 }
 
-// Return the top-K (word, count) pairs by frequency (desc), breaking ties by word (asc).
-static std::vector<std::pair<std::string, std::uint64_t>> top_k(const std::unordered_map<std::string, std::uint64_t>& freq, std::size_t k) {
-    std::vector<std::pair<std::string, std::uint64_t>> v(freq.begin(), freq.end());
-    // partial_sort is more efficient than full sort when we only need the top K.
-    std::partial_sort(v.begin(), v.begin() + std::min(k, v.size()), v.end(), [](auto& a, auto& b) {
-        if (a.second != b.second) return a.second > b.second; // higher count first
-        return a.first < b.first;                              // then lexicographic
-    });
-    if (v.size() > k) v.resize(k);
-    return v;
+__attribute__((target("avx2")))
+static BlockMasks classify_avx2(const unsigned char* p) {
+    std::uint32_t w0, n0, h0, w1, n1, h1;
+    classify32_avx2(p, w0, n0, h0);
+    classify32_avx2(p + 32, w1, n1, h1);
+    return BlockMasks{w0 | (static_cast<std::uint64_t>(w1) << 32), n0 | (static_cast<std::uint64_t>(n1) << 32),
+                      h0 | (static_cast<std::uint64_t>(h1) << 32)};
 }
+#endif
 
-// Produce an ISO 8601 UTC timestamp string (e.g., "2025-09-22T17:03:00Z").
-static std::string iso8601_utc_now() {
-    using namespace std::chrono;
-    auto now = system_clock::now();
-    auto t = system_clock::to_time_t(now);
-    std::tm tm{};
-#if defined(_WIN32)
-    gmtime_s(&tm, &t);
+#if FILE_STATS_NEON
+// NEON has no movemask; weight each lane by its bit and add across the halves.
+static inline std::uint32_t neon_movemask(uint8x16_t v) {
+    static const uint8_t kBits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t m = vandq_u8(v, vld1q_u8(kBits));
+    return static_cast<std::uint32_t>(vaddv_u8(vget_low_u8(m))) |
+           (static_cast<std::uint32_t>(vaddv_u8(vget_high_u8(m))) << 8);
+}
+
+static BlockMasks classify_neon(const unsigned char* p) {
+    BlockMasks m{0, 0, 0};
+    for (unsigned k = 0; k < 4; ++k) {
+        uint8x16_t v = vld1q_u8(p + 16 * k);
+        uint8x16_t d = vsubq_u8(v, vdupq_n_u8('0'));
+        uint8x16_t l = vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+        uint8x16_t word = vorrq_u8(vcleq_u8(d, vdupq_n_u8(9)), vcleq_u8(l, vdupq_n_u8(25)));
+        m.word |= static_cast<std::uint64_t>(neon_movemask(word)) << (16 * k);
+        m.newline |= static_cast<std::uint64_t>(neon_movemask(vceqq_u8(v, vdupq_n_u8('\n')))) << (16 * k);
+        m.nonascii |= static_cast<std::uint64_t>(neon_movemask(vcgeq_u8(v, vdupq_n_u8(0x80)))) << (16 * k);
+    }
+    return m;
+}
+#endif
+
+struct ScanKernel
+{
+    const char* name;
+    ClassifyFn classify;
+};
+
+// Pick the widest kernel the running CPU supports. Resolved once, on first use.
+static const ScanKernel& scan_kernel() {
+    static const ScanKernel kernel = [] {
+#if FILE_STATS_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return ScanKernel{"avx2", classify_avx2};
+#endif
+#if FILE_STATS_SSE2
+        return ScanKernel{"sse2", classify_sse2};
+#elif FILE_STATS_NEON
+        return ScanKernel{"neon", classify_neon};
 #else
-    gmtime_r(&t, &tm);
+        return ScanKernel{"scalar", classify_scalar};
 #endif
-    std::ostringstream oss;
-    oss << std::put_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
-    return oss.str();
+    }();
+    return kernel;
 }
 
-// Minimal JSON string escaping (quotes, backslashes, and control chars).
-static std::string json_escape(const std::string& s) {
-    std::string out;
-    out.reserve(s.size() + 8);
-    for (unsigned char c : s) {
-        switch (c) {
-            case '\"': out += "\\\""; break;
-            case '\\': out += "\\\\"; break;
-            case '\b': out += "\\b"; break;
-            case '\f': out += "\\f"; break;
-            case '\n': out += "\\n"; break;
-            case '\r': out += "\\r"; break;
-            case '\t': out += "\\t"; break;        
-            default:
-                if (c < 0x20) { // Other control characters → \u00XX
-                    char buf[7];
-                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
-                    out += buf;
-                } else {
-                    out += static_cast<char>(c);
-                }
-        }
+// ---- Word table --------------------------------------------------------------
+
+// 64-bit hash of a byte string: 8-byte words folded with a multiply/xorshift mix.
+static inline std::uint64_t hash_bytes(const char* p, std::size_t n) {
+    const std::uint64_t k = 0x9E3779B97F4A7C15ull;
+    std::uint64_t h = n * k;
+    for (; n >= 8; p += 8, n -= 8) {
+        std::uint64_t v;
+        std::memcpy(&v, p, 8);
+        h = (h ^ v) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
     }
-    return out;
+    std::uint64_t v = 0;
+    for (std::size_t i = 0; i < n; ++i) v |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    h = (h ^ v) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 29;
+    h *= k;
+    return h ^ (h >> 32);
 }
 
-// Serialize the Stats and top words to a JSON file.
-static void write_json(const Config& conf, const Stats& st, const std::vector<std::pair<std::string, std::uint64_t>>& top) {
-    std::ofstream out(conf.json_path);
-    if (!out) {
-        throw std::runtime_error("Cannot write JSON file: " + conf.json_path);
-    }
-
-    out << "{\n";
-    out << "  \"tool\": \"file-stats\",\n";
-    out << "  \"timestamp\": \"" << iso8601_utc_now() << "\",\n";
-    out << "  \"input_path\": \"" << json_escape(conf.input_path) << "\",\n";
-    out << "  \"lines\": " << st.lines << ",\n";
-    out << "  \"words\": " << st.words << ",\n";
-    out << "  \"bytes\": " << st.bytes << ",\n";
-    out << "  \"case_sensitive\": " << (conf.case_sensitive ? "true" : "false") << ",\n";
-    out << "  \"top_words\": [\n";
-    for (std::size_t i = 0; i < top.size(); ++i) {
-        out << "    { \"word\": \"" << json_escape(top[i].first)
-            << "\", \"count\": " << top[i].second << " }";
-        if (i + 1 < top.size()) out << ",";
-        out << "\n";
+// Finalizer for integer keys (MurmurHash3 fmix64).
+static inline std::uint64_t mix64(std::uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    return x ^ (x >> 33);
+}
+
+// ---- Large allocations (--huge-pages) ------------------------------------------------
+//
+// Allocations of at least kHugePageSize (slot arrays, the arenas' later blocks and the
+// read-ahead buffers) are mapped directly, aligned to kHugePageSize, and offered huge
+// pages: transparent huge pages through MADV_HUGEPAGE by default, or with
+// --huge-pages=explicit the hugetlb pool (MAP_HUGETLB) first. A word table that no
+// longer fits the TLB then costs one TLB entry per 2 MB instead of per 4 KB.
+
+static constexpr std::size_t kHugePageSize = std::size_t(2) << 20; // 2 MB
+
+static HugePages g_huge_pages = HugePages::Transparent;
+
+// Large allocations so far, for --profile.
+struct LargeAllocStats
+{
+    std::atomic<std::uint64_t> live{0};       // Bytes currently allocated
+    std::atomic<std::uint64_t> peak{0};       // Most bytes allocated at once
+};
+static LargeAllocStats g_large_allocs;
+
+// `bytes` (a multiple of kHugePageSize) of zeroed memory.
+static char* large_alloc(std::size_t bytes) {
+    char* p = nullptr;
+#if defined(_WIN32)
+    p = new char[bytes]();
+#else
+#if defined(MAP_HUGETLB)
+    if (g_huge_pages == HugePages::Explicit) {
+        void* m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (m != MAP_FAILED) p = static_cast<char*>(m);
+    }
+#endif
+    if (!p) {
+        // Over-map by one huge page and trim, so the block starts on a huge-page boundary.
+        void* m = mmap(nullptr, bytes + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) throw std::bad_alloc();
+        char* base = static_cast<char*>(m);
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(base) + kHugePageSize - 1) &
+                                                ~std::uintptr_t(kHugePageSize - 1));
+        if (aligned > base) munmap(base, static_cast<std::size_t>(aligned - base));
+        munmap(aligned + bytes, static_cast<std::size_t>(base + kHugePageSize - aligned));
+        p = aligned;
+#if defined(MADV_HUGEPAGE)
+        if (g_huge_pages != HugePages::Off) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
     }
-    out << "  ]\n";
-    out << "}\n";
+#endif
+    std::uint64_t live = g_large_allocs.live += bytes;
+    std::uint64_t peak = g_large_allocs.peak.load();
+    while (live > peak && !g_large_allocs.peak.compare_exchange_weak(peak, live)) {}
+    return p;
 }
 
-int main(int argc, char** argv) {
-    std::ios::sync_with_stdio(false); // Faster I/O for large files
-    std::setlocale(LC_ALL, "");       // Optional: enable system C-locale (safe under Windows)
+static void large_free(char* p, std::size_t bytes) {
+    g_large_allocs.live -= bytes;
+#if defined(_WIN32)
+    delete[] p;
+#else
+    munmap(p, bytes);   // Releases hugetlb and ordinary mappings alike
+#endif
+}
 
-    Config conf;
-    if (!parse_args(argc, argv, conf)) {
-        print_help(argv[0]);
-        return 1;                      // Bad usage → show help and exit non-zero
+// Whether an allocation of `bytes` goes to large_alloc, and its size rounded up there.
+static inline bool is_large(std::size_t bytes) { return bytes >= kHugePageSize; }
+static inline std::size_t large_size(std::size_t bytes) { return (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1); }
+
+// Allocator for element arrays: large ones come from large_alloc, the rest from the heap.
+template <class T>
+struct LargeAllocator
+{
+    using value_type = T;
+
+    LargeAllocator() = default;
+    template <class U>
+    LargeAllocator(const LargeAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+        std::size_t bytes = n * sizeof(T);
+        if (is_large(bytes)) return reinterpret_cast<T*>(large_alloc(large_size(bytes)));
+        return std::allocator<T>().allocate(n);
     }
 
-    try {
-        Stats st = analyze_file(conf);
-        auto top = top_k(st.freq, conf.topN);
+    void deallocate(T* p, std::size_t n) {
+        std::size_t bytes = n * sizeof(T);
+        if (is_large(bytes)) large_free(reinterpret_cast<char*>(p), large_size(bytes));
+        else std::allocator<T>().deallocate(p, n);
+    }
 
-        // Human-readable report.
-        std::cout << "File:   " << conf.input_path << "\n";
-        std::cout << "Lines:  " << st.lines << "\n";
-        std::cout << "Words:  " << st.words << "\n";
-        std::cout << "Bytes:  " << st.bytes << "\n";
-        std::cout << "Top " << top.size() << " words"
-                  << (conf.case_sensitive ? " (case-sensitive)" : " (case-insensitive)")
-                  << ":\n";
+    template <class U>
+    bool operator==(const LargeAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const LargeAllocator<U>&) const { return false; }
+};
 
-        for (const auto& [w, c] : top) {
-            std::cout << "  " << std::setw(8) << c << "  " << w << "\n";
+// An owned byte block, from large_alloc when it is large.
+class LargeBlock
+{
+public:
+    explicit LargeBlock(std::size_t size)
+        : data_(is_large(size) ? large_alloc(large_size(size)) : new char[size]), size_(size) {}
+    ~LargeBlock() { release(); }
+    LargeBlock(LargeBlock&& o) noexcept : data_(o.data_), size_(o.size_) { o.data_ = nullptr; }
+    LargeBlock& operator=(LargeBlock&& o) noexcept {
+        if (this != &o) {
+            release();
+            data_ = o.data_;
+            size_ = o.size_;
+            o.data_ = nullptr;
         }
+        return *this;
+    }
 
-        // Optional JSON export.
-        if (!conf.json_path.empty()) {
-            write_json(conf, st, top);
-            std::cout << "\nJSON written to: " << conf.json_path << "\n";
+    char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    void release() {
+        if (!data_) return;
+        if (is_large(size_)) large_free(data_, large_size(size_));
+        else delete[] data_;
+    }
+
+    char* data_;
+    std::size_t size_;
+};
+
+static const char* huge_pages_name(HugePages mode) {
+    switch (mode) {
+        case HugePages::Off: return "off";
+        case HugePages::Explicit: return "explicit";
+        default: return "transparent";
+    }
+}
+
+// Memory of this process that huge pages back right now, as the kernel reports it.
+struct HugePageUsage
+{
+    bool known = false;             // False without /proc/self/smaps_rollup (or off Linux)
+    std::uint64_t transparent = 0;  // AnonHugePages
+    std::uint64_t hugetlb = 0;      // Private_Hugetlb + Shared_Hugetlb
+};
+
+static HugePageUsage huge_page_usage() {
+    HugePageUsage u;
+#if defined(__linux__)
+    std::ifstream in("/proc/self/smaps_rollup");
+    std::string line;
+    while (std::getline(in, line)) {
+        std::size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string_view key(line.data(), colon);
+        std::uint64_t kb = std::strtoull(line.c_str() + colon + 1, nullptr, 10);
+        if (key == "AnonHugePages") {
+            u.transparent = kb << 10;
+            u.known = true;
+        } else if (key == "Private_Hugetlb" || key == "Shared_Hugetlb") {
+            u.hugetlb += kb << 10;
         }
+    }
+#endif
+    return u;
+}
 
-        return 0; // Success
-    } catch (const std::exception& ex) {
-        // Any I/O or processing error is reported here.
-        std::cerr << "Error: " << ex.what() << "\n";
-        return 2;
+// Bump allocator for interned key bytes. Keys are never freed individually; blocks are
+// released together, so every key keeps a stable address for the arena's lifetime.
+class Arena
+{
+public:
+    Arena() = default;
+    Arena(Arena&& o) noexcept { swap(o); }
+    Arena& operator=(Arena&& o) noexcept {
+        Arena tmp(std::move(o));
+        swap(tmp);
+        return *this;
+    }
+
+    // Copy `n` bytes into the arena and return their new, stable (non-null) address.
+    const char* copy(const char* p, std::size_t n) {
+        char* dst;
+        if (n <= left_ && left_ != 0) {
+            dst = cur_;
+            cur_ += n;
+            left_ -= n;
+        } else if (n > kBlockSize / 4) {
+            // Oversized keys get a block of their own; the current block keeps bumping.
+            oversized_.emplace_back(new char[n]);
+            dst = oversized_.back().get();
+        } else {
+            // The first blocks are small, so small tables stay small; a growing table
+            // moves on to huge-page-sized blocks.
+            if (next_ == blocks_.size()) blocks_.emplace_back(next_ < kSmallBlocks ? kBlockSize : kHugePageSize);
+            dst = blocks_[next_].data();
+            cur_ = dst + n;
+            left_ = blocks_[next_++].size() - n;
+        }
+        std::memcpy(dst, p, n);
+        return dst;
     }
-}
\ No newline at end of file
+
+    // Invalidate every copy but keep the standard blocks for reuse.
+    void clear() {
+        oversized_.clear();
+        next_ = 0;
+        cur_ = nullptr;
+        left_ = 0;
+    }
+
+    void swap(Arena& o) noexcept {
+        blocks_.swap(o.blocks_);
+        oversized_.swap(o.oversized_);
+        std::swap(next_, o.next_);
+        std::swap(cur_, o.cur_);
+        std::swap(left_, o.left_);
+    }
+
+private:
+    static constexpr std::size_t kBlockSize = 1 << 16; // 64 KB
+    static constexpr std::size_t kSmallBlocks = kHugePageSize / kBlockSize;
+
+    std::vector<LargeBlock> blocks_;                  // kBlockSize each, then kHugePageSize
+
+    std::vector<std::unique_ptr<char[]>> oversized_;  // One key each
+    std::size_t next_ = 0;     // blocks_[next_] is the next block to bump from
+    char* cur_ = nullptr;      // Next free byte in the current block
+    std::size_t left_ = 0;     // Bytes remaining in the current block
+};
+
+// Open-addressing (linear probing) word -> count table. Each slot stores the full
+// hash inline next to a string_view of the key, whose bytes live in an Arena, so a
+// lookup hashes the view once and compares bytes only on a hash match; no temporary
+// std::string or per-entry node is ever allocated.
+//
+// Iteration yields std::pair<std::string_view, std::uint64_t> in unspecified order,
+// like std::unordered_map; views remain valid until the table is destroyed.
+class WordTable
+{
+public:
+    using value_type = std::pair<std::string_view, std::uint64_t>;
+
+private:
+    struct Slot
+    {
+        std::uint64_t hash;
+        value_type kv;         // kv.first.data() == nullptr marks an empty slot
+    };
+
+public:
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = WordTable::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        const_iterator() = default;
+        const_iterator(const Slot* p, const Slot* end) : p_(p), end_(end) { skip(); }
+
+        reference operator*() const { return p_->kv; }
+        pointer operator->() const { return &p_->kv; }
+        const_iterator& operator++() {
+            ++p_;
+            skip();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        bool operator==(const const_iterator& o) const { return p_ == o.p_; }
+        bool operator!=(const const_iterator& o) const { return p_ != o.p_; }
+
+    private:
+        void skip() {
+            while (p_ != end_ && p_->kv.first.data() == nullptr) ++p_;
+        }
+
+        const Slot* p_ = nullptr;
+        const Slot* end_ = nullptr;
+    };
+
+    WordTable() = default;
+    WordTable(WordTable&& o) noexcept { swap(o); }
+    WordTable& operator=(WordTable&& o) noexcept {
+        WordTable tmp(std::move(o));
+        swap(tmp);
+        return *this;
+    }
+
+    // Return the count for `key`, inserting it with count 0 if absent.
+    std::uint64_t& operator[](std::string_view key) { return entry(key).second; }
+
+    // Like operator[], but return the whole entry, whose key views the table's own copy
+    // of the bytes. The key must not be modified.
+    value_type& entry(std::string_view key) {
+        std::uint64_t h = hash_bytes(key.data(), key.size());
+        if ((size_ + 1) * 4 > slots_.size() * 3) grow();   // Keep load factor <= 3/4
+        std::size_t mask = slots_.size() - 1;
+        for (std::size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot& s = slots_[i];
+            if (s.kv.first.data() == nullptr) {
+                s.hash = h;
+                s.kv.first = std::string_view(arena_.copy(key.data(), key.size()), key.size());
+                s.kv.second = 0;
+                ++size_;
+                return s.kv;
+            }
+            if (s.hash == h && s.kv.first == key) return s.kv;
+        }
+    }
+
+    // The count for `key`, or nullptr if it is absent.
+    const std::uint64_t* find(std::string_view key) const {
+        if (size_ == 0) return nullptr;
+        std::uint64_t h = hash_bytes(key.data(), key.size());
+        std::size_t mask = slots_.size() - 1;
+        for (std::size_t i = h & mask;; i = (i + 1) & mask) {
+            const Slot& s = slots_[i];
+            if (s.kv.first.data() == nullptr) return nullptr;
+            if (s.hash == h && s.kv.first == key) return &s.kv.second;
+        }
+    }
+
+    // Replace every count c with fn(c).
+    template <class Fn>
+    void transform_values(Fn&& fn) {
+        for (Slot& s : slots_) {
+            if (s.kv.first.data() != nullptr) s.kv.second = fn(s.kv.second);
+        }
+    }
+
+    // Pre-size the table so `n` keys fit without rehashing.
+    void reserve(std::size_t n) {
+        if (n == 0) return;
+        std::size_t cap = kMinCapacity;
+        while (cap * 3 < n * 4) cap <<= 1;
+        if (cap > slots_.size()) rehash(cap);
+    }
+
+    // Remove every entry but keep the slot array and the arena's blocks.
+    void clear() {
+        std::fill(slots_.begin(), slots_.end(), Slot{0, value_type{}});
+        size_ = 0;
+        rehashes_ = 0;
+        arena_.clear();
+    }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    // Number of times the slot array has grown, including tables merged into this one.
+    std::size_t rehashes() const { return rehashes_; }
+    void add_rehashes(std::size_t n) { rehashes_ += n; }
+
+    const_iterator begin() const { return const_iterator(slots_.data(), slots_.data() + slots_.size()); }
+    const_iterator end() const { return const_iterator(slots_.data() + slots_.size(), slots_.data() + slots_.size()); }
+
+    void swap(WordTable& o) noexcept {
+        slots_.swap(o.slots_);
+        std::swap(size_, o.size_);
+        std::swap(rehashes_, o.rehashes_);
+        arena_.swap(o.arena_);
+    }
+
+private:
+    static constexpr std::size_t kMinCapacity = 64;
+
+    void grow() { rehash(slots_.empty() ? kMinCapacity : slots_.size() * 2); }
+
+    // Move every slot into a table of `cap` (power of two) slots. Hashes are stored,
+    // so no key is rehashed and the arena is untouched.
+    void rehash(std::size_t cap) {
+        if (!slots_.empty()) ++rehashes_;
+        SlotArray old(cap, Slot{0, value_type{}});
+        old.swap(slots_);
+        std::size_t mask = cap - 1;
+        for (const Slot& s : old) {
+            if (s.kv.first.data() == nullptr) continue;
+            std::size_t i = s.hash & mask;
+            while (slots_[i].kv.first.data() != nullptr) i = (i + 1) & mask;
+            slots_[i] = s;
+        }
+    }
+
+    using SlotArray = std::vector<Slot, LargeAllocator<Slot>>;   // Huge pages once large
+
+    SlotArray slots_;          // Power-of-two capacity (or empty)
+    std::size_t size_ = 0;     // Occupied slots
+    std::size_t rehashes_ = 0; // Growth steps so far
+    Arena arena_;              // Owns the key bytes referenced by slots_
+};
+
+// ---- Tokenizer rules (--word-chars, --min-len, --max-len, --stopwords) ---------
+
+// Exact word set behind a Bloom filter (two bits per word, about 16 filter bits per
+// word, so ~1.5% false positives). A token costs one hash and two bit tests; only the
+// stopwords themselves and the rare false positives go on to the exact table lookup.
+class StopwordSet
+{
+public:
+    // Replace the set with every word of `words`.
+    void assign(WordTable&& words) {
+        words_ = std::move(words);
+        std::size_t nbits = 1024;
+        while (nbits < words_.size() * 16) nbits <<= 1;
+        bits_.assign(nbits / 64, 0);
+        mask_ = nbits - 1;
+        for (const auto& entry : words_) {
+            std::uint64_t h = hash_bytes(entry.first.data(), entry.first.size());
+            bits_[(h & mask_) >> 6] |= std::uint64_t(1) << (h & 63);
+            bits_[((h >> 32) & mask_) >> 6] |= std::uint64_t(1) << ((h >> 32) & 63);
+        }
+    }
+
+    bool contains(std::string_view w) const {
+        if (bits_.empty()) return false;
+        std::uint64_t h = hash_bytes(w.data(), w.size());
+        if (!(bits_[(h & mask_) >> 6] >> (h & 63) & 1)) return false;
+        if (!(bits_[((h >> 32) & mask_) >> 6] >> ((h >> 32) & 63) & 1)) return false;
+        return words_.find(w) != nullptr;
+    }
+
+    std::size_t size() const { return words_.size(); }
+    const WordTable& words() const { return words_; }
+
+private:
+    std::vector<std::uint64_t> bits_;
+    std::uint64_t mask_ = 0;
+    WordTable words_;
+};
+
+// What counts as a word, when the defaults are overridden on the command line. Built
+// once per run by make_rules() and shared read-only by every tokenizer (and thread).
+struct TokenRules
+{
+    ByteTables tables = kByteTables;   // `word` replaced by --word-chars
+    bool custom_chars = false;
+    std::size_t min_len = 0;           // In bytes, or in code points with --utf8
+    std::size_t max_len = SIZE_MAX;
+    bool utf8 = false;
+    StopwordSet stopwords;
+
+    // True if some tokens are dropped (as opposed to only the word chars changing).
+    bool filters() const { return min_len > 1 || max_len != SIZE_MAX || stopwords.size() > 0; }
+
+    bool accept(std::string_view token) const {
+        if (min_len > 1 || max_len != SIZE_MAX) {
+            std::size_t len = token.size();
+            if (utf8) {
+                len = 0;
+                for (char c : token) len += (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+            }
+            if (len < min_len || len > max_len) return false;
+        }
+        return !stopwords.contains(token);
+    }
+
+    // Changes whenever the rules would count differently (for --state).
+    std::uint64_t fingerprint() const {
+        std::uint64_t h = hash_bytes(reinterpret_cast<const char*>(tables.word), sizeof(tables.word));
+        h = mix64(h ^ min_len) ^ mix64(max_len);
+        std::uint64_t words = 0;   // Order-independent over the stopword table
+        for (const auto& entry : stopwords.words()) words += mix64(hash_bytes(entry.first.data(), entry.first.size()));
+        return mix64(h ^ words);
+    }
+};
+
+// The word-char class that `conf` tokenizes with.
+static const bool* word_class(const Config& conf) {
+    return conf.rules && conf.rules->custom_chars ? conf.rules->tables.word : kByteTables.word;
+}
+
+// The rules that drop tokens, or nullptr if every token is counted.
+static const TokenRules* token_filter(const Config& conf) {
+    return conf.rules && conf.rules->filters() ? conf.rules.get() : nullptr;
+}
+
+// Parse a --word-chars set: single chars and ranges such as "a-z"; '\' takes the next
+// char literally, and a leading '+' starts from the default set instead of an empty one.
+static void parse_word_chars(const std::string& spec, bool (&word)[256]) {
+    std::size_t i = 0;
+    if (!spec.empty() && spec[0] == '+') {
+        std::copy(std::begin(kByteTables.word), std::end(kByteTables.word), word);
+        i = 1;
+    } else {
+        std::fill(std::begin(word), std::end(word), false);
+    }
+    auto next = [&](unsigned char& c) {
+        if (spec[i] == '\\' && i + 1 < spec.size()) ++i;
+        c = static_cast<unsigned char>(spec[i++]);
+    };
+    while (i < spec.size()) {
+        unsigned char lo, hi;
+        next(lo);
+        hi = lo;
+        if (i + 1 < spec.size() && spec[i] == '-') {
+            ++i;
+            next(hi);
+            if (hi < lo) throw std::invalid_argument("Bad --word-chars range in: " + spec);
+        }
+        for (unsigned c = lo; c <= hi; ++c) word[c] = true;
+    }
+    if (word[static_cast<unsigned char>('\n')]) {
+        throw std::invalid_argument("--word-chars cannot include a newline");
+    }
+}
+
+// Packed IDs of three or four consecutive words (--ngram 3 and 4), newest in the low bits.
+struct NgramKey128
+{
+    std::uint64_t lo = 0;
+    std::uint64_t hi = 0;
+
+    bool operator==(const NgramKey128& o) const { return lo == o.lo && hi == o.hi; }
+};
+
+static inline std::uint64_t ngram_hash(std::uint64_t key) { return mix64(key); }
+static inline std::uint64_t ngram_hash(const NgramKey128& key) { return mix64(key.lo ^ mix64(key.hi)); }
+
+// The word ID stored `shift` bits up in a packed n-gram key.
+static inline std::uint32_t ngram_id(std::uint64_t key, unsigned shift) {
+    return static_cast<std::uint32_t>(key >> shift);
+}
+static inline std::uint32_t ngram_id(const NgramKey128& key, unsigned shift) {
+    return static_cast<std::uint32_t>(shift >= 64 ? key.hi >> (shift - 64) : key.lo >> shift);
+}
+
+// Open-addressing (linear probing) table from packed integer n-gram keys to counts.
+// Slots hold the key and its count inline (a count of 0 marks an empty slot), so an
+// insert is one hash of the integers and one probe sequence; nothing is allocated
+// per n-gram.
+template <class Key>
+class NgramTable
+{
+public:
+    struct Slot
+    {
+        Key key;
+        std::uint64_t count;
+    };
+
+    // Count one more occurrence of `key`.
+    void add(const Key& key) {
+        if ((size_ + 1) * 4 > slots_.size() * 3) grow();   // Keep load factor <= 3/4
+        std::size_t mask = slots_.size() - 1;
+        for (std::size_t i = ngram_hash(key) & mask;; i = (i + 1) & mask) {
+            Slot& s = slots_[i];
+            if (s.count == 0) {
+                s.key = key;
+                s.count = 1;
+                ++size_;
+                return;
+            }
+            if (s.key == key) {
+                ++s.count;
+                return;
+            }
+        }
+    }
+
+    std::size_t size() const { return size_; }
+    // Every slot, empty ones (count 0) included.
+    const std::vector<Slot, LargeAllocator<Slot>>& slots() const { return slots_; }
+
+private:
+    static constexpr std::size_t kMinCapacity = 64;
+
+    void grow() {
+        std::vector<Slot, LargeAllocator<Slot>> old(slots_.empty() ? kMinCapacity : slots_.size() * 2, Slot{Key(), 0});
+        old.swap(slots_);
+        std::size_t mask = slots_.size() - 1;
+        for (const Slot& s : old) {
+            if (s.count == 0) continue;
+            std::size_t i = ngram_hash(s.key) & mask;
+            while (slots_[i].count != 0) i = (i + 1) & mask;
+            slots_[i] = s;
+        }
+    }
+
+    std::vector<Slot, LargeAllocator<Slot>> slots_;  // Power-of-two capacity (or empty); huge pages once large
+    std::size_t size_ = 0;
+};
+
+// --ngram: counts of every run of `n` consecutive words. Each distinct word is interned
+// to a 32-bit ID (in order of first appearance) through the word table, and an n-gram
+// is counted under its packed IDs: 64 bits for bigrams, 128 for trigrams and 4-grams.
+// No n-gram text exists until the top n-grams are decoded for output.
+//
+// While counting, Stats::freq maps each word to its ID + 1 and `counts` holds the real
+// word counts; finish_counts() writes them back into the table.
+struct NgramCounts
+{
+    explicit NgramCounts(unsigned n_) : n(n_) {}
+
+    unsigned n;                            // Words per n-gram, 2 to 4
+    std::vector<std::string_view> words;   // ID -> word (views of Stats::freq's keys)
+    std::vector<std::uint64_t> counts;     // ID -> occurrences, until finish_counts()
+    NgramTable<std::uint64_t> pairs;       // n == 2
+    NgramTable<NgramKey128> wide;          // n == 3 or 4
+    NgramKey128 recent;                    // IDs of the last words seen
+    unsigned seen = 0;                     // Words in `recent`, up to n
+    bool finished = false;
+
+    std::size_t size() const { return n == 2 ? pairs.size() : wide.size(); }
+
+    // Count the word `freq_entry` (from Stats::freq) and the n-gram it completes.
+    void add(WordTable::value_type& freq_entry) {
+        if (freq_entry.second == 0) {
+            if (words.size() >= UINT32_MAX) {
+                throw std::runtime_error("--ngram: more than 2^32 distinct words");
+            }
+            words.push_back(freq_entry.first);
+            counts.push_back(0);
+            freq_entry.second = words.size();
+        }
+        std::uint64_t id = freq_entry.second - 1;
+        ++counts[id];
+        recent.hi = (recent.hi << 32) | (recent.lo >> 32);
+        recent.lo = (recent.lo << 32) | id;
+        if (seen < n) ++seen;
+        if (seen < n) return;
+        if (n == 2) {
+            pairs.add(recent.lo);
+        } else {
+            if (n == 3) recent.hi &= 0xFFFFFFFFull;
+            wide.add(recent);
+        }
+    }
+
+    // Start a new run: no n-gram spans the break.
+    void restart() { seen = 0; recent = NgramKey128(); }
+
+    void finish_counts(WordTable& freq) {
+        if (finished) return;
+        freq.transform_values([&](std::uint64_t id1) { return counts[id1 - 1]; });
+        counts = std::vector<std::uint64_t>();
+        finished = true;
+    }
+};
+
+// Space-Saving heavy-hitters summary (Metwally, Agrawal, El Abbadi 2005) over a fixed
+// number of counters. A word that is not monitored when the summary is full takes over
+// the counter with the smallest count c_min, starting at c_min + 1 with error c_min.
+// For every monitored word: count - error <= true count <= count, and every word whose
+// true count exceeds the current minimum counter is guaranteed to be monitored.
+// Key bytes are charged to the budget as they are stored: when long words push them
+// past it, minimum counters are dropped and the capacity shrinks with them (down to
+// one counter), which keeps both guarantees because the minimum only grows.
+class SpaceSaving
+{
+public:
+    struct Counter
+    {
+        std::string word;
+        std::uint64_t count = 0;
+        std::uint64_t error = 0;   // Maximum overestimation of `count`
+        std::uint64_t hash = 0;
+        std::uint32_t heap_pos = 0;
+    };
+
+    // Per-counter footprint: Counter, heap entry, two index slots and an allowance of
+    // key bytes beyond the small-string buffer.
+    static constexpr std::size_t kKeyBytesPerCounter = 16;
+    static constexpr std::size_t kBytesPerCounter =
+        sizeof(Counter) + 3 * sizeof(std::uint32_t) + kKeyBytesPerCounter;
+
+    // `key_budget` bounds the heap bytes of the stored words (default: the allowance).
+    explicit SpaceSaving(std::size_t capacity, std::size_t key_budget = SIZE_MAX)
+        : capacity_(std::max<std::size_t>(capacity, 1)) {
+        capacity_ = std::min<std::size_t>(capacity_, UINT32_MAX / 2);
+        key_budget_ = key_budget == SIZE_MAX ? capacity_ * kKeyBytesPerCounter : key_budget;
+        counters_.reserve(capacity_);
+        heap_.reserve(capacity_);
+        std::size_t slots = 1;
+        while (slots < capacity_ * 2) slots <<= 1;   // Index load factor <= 1/2
+        index_.assign(slots, kEmpty);
+    }
+
+    // Size the summary so that it stays within roughly `budget` bytes.
+    static std::size_t capacity_for(std::size_t budget) { return budget / kBytesPerCounter; }
+
+    void add(std::string_view w) {
+        std::uint64_t h = hash_bytes(w.data(), w.size());
+        std::size_t mask = index_.size() - 1;
+        std::size_t i = h & mask;
+        for (; index_[i] != kEmpty; i = (i + 1) & mask) {
+            Counter& c = counters_[index_[i]];
+            if (c.hash == h && c.word == w) {
+                ++c.count;
+                sift_down(c.heap_pos);
+                return;
+            }
+        }
+        if (counters_.size() < capacity_) {
+            // Free counter: the word is counted exactly.
+            std::uint32_t idx = static_cast<std::uint32_t>(counters_.size());
+            counters_.push_back(Counter{std::string(w), 1, 0, h, static_cast<std::uint32_t>(heap_.size())});
+            heap_.push_back(idx);
+            index_[i] = idx;
+            key_bytes_ += key_bytes(counters_[idx].word);
+            sift_up(counters_[idx].heap_pos);
+            fit_keys();
+            return;
+        }
+        // Evict the minimum counter and hand it to the new word.
+        std::uint32_t idx = heap_[0];
+        Counter& c = counters_[idx];
+        erase_index(c);
+        key_bytes_ -= key_bytes(c.word);
+        c.word.assign(w.data(), w.size());
+        if (c.word.capacity() > 2 * w.size() + kKeyBytesPerCounter) c.word.shrink_to_fit();
+        key_bytes_ += key_bytes(c.word);
+        c.hash = h;
+        c.error = c.count;
+        ++c.count;
+        insert_index(idx);
+        sift_down(0);
+        fit_keys();
+    }
+
+    std::size_t capacity() const { return capacity_; }
+    std::size_t key_bytes() const { return key_bytes_; }
+    std::uint64_t min_count() const { return heap_.empty() ? 0 : counters_[heap_[0]].count; }
+    const std::vector<Counter>& counters() const { return counters_; }
+
+    // The K monitored words with the highest counts (count desc, word asc).
+    std::vector<const Counter*> top(std::size_t k) const {
+        std::vector<const Counter*> v;
+        v.reserve(counters_.size());
+        for (const Counter& c : counters_) v.push_back(&c);
+        std::size_t n = std::min(k, v.size());
+        std::partial_sort(v.begin(), v.begin() + n, v.end(), [](const Counter* a, const Counter* b) {
+            if (a->count != b->count) return a->count > b->count;
+            return a->word < b->word;
+        });
+        v.resize(n);
+        return v;
+    }
+
+private:
+    static constexpr std::uint32_t kEmpty = UINT32_MAX;
+
+    // Heap bytes held by a stored word (none while it fits the small-string buffer).
+    static std::size_t key_bytes(const std::string& w) {
+        static const std::size_t inline_capacity = std::string().capacity();
+        return w.capacity() > inline_capacity ? w.capacity() + 1 : 0;
+    }
+
+    // Drop minimum counters until the stored words fit the key budget. The summary
+    // stays full (size == capacity), so no dropped word can re-enter with a count below
+    // its true one.
+    void fit_keys() {
+        while (key_bytes_ > key_budget_ && counters_.size() > 1) {
+            std::uint32_t idx = heap_[0];
+            erase_index(counters_[idx]);
+            key_bytes_ -= key_bytes(counters_[idx].word);
+            swap_heap(0, heap_.size() - 1);
+            heap_.pop_back();
+            if (!heap_.empty()) sift_down(0);
+            std::uint32_t last = static_cast<std::uint32_t>(counters_.size() - 1);
+            if (idx != last) {
+                // Move the last counter into the hole, repointing its index slot and heap entry.
+                std::size_t mask = index_.size() - 1;
+                std::size_t i = counters_[last].hash & mask;
+                while (index_[i] != last) i = (i + 1) & mask;
+                index_[i] = idx;
+                heap_[counters_[last].heap_pos] = idx;
+                counters_[idx] = std::move(counters_[last]);
+            }
+            counters_.pop_back();
+            capacity_ = counters_.size();
+        }
+    }
+
+    void insert_index(std::uint32_t idx) {
+        std::size_t mask = index_.size() - 1;
+        std::size_t i = counters_[idx].hash & mask;
+        while (index_[i] != kEmpty) i = (i + 1) & mask;
+        index_[i] = idx;
+    }
+
+    // Linear-probing deletion by backward shift: no tombstones accumulate.
+    void erase_index(const Counter& c) {
+        std::size_t mask = index_.size() - 1;
+        std::size_t i = c.hash & mask;
+        while (&counters_[index_[i]] != &c) i = (i + 1) & mask;
+        for (std::size_t j = (i + 1) & mask; index_[j] != kEmpty; j = (j + 1) & mask) {
+            std::size_t home = counters_[index_[j]].hash & mask;
+            // Move slot j into the hole at i unless its home lies cyclically in (i, j].
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                index_[i] = index_[j];
+                i = j;
+            }
+        }
+        index_[i] = kEmpty;
+    }
+
+    void swap_heap(std::size_t a, std::size_t b) {
+        std::swap(heap_[a], heap_[b]);
+        counters_[heap_[a]].heap_pos = static_cast<std::uint32_t>(a);
+        counters_[heap_[b]].heap_pos = static_cast<std::uint32_t>(b);
+    }
+
+    void sift_up(std::size_t i) {
+        while (i > 0) {
+            std::size_t parent = (i - 1) / 2;
+            if (counters_[heap_[parent]].count <= counters_[heap_[i]].count) break;
+            swap_heap(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(std::size_t i) {
+        for (;;) {
+            std::size_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < heap_.size() && counters_[heap_[l]].count < counters_[heap_[m]].count) m = l;
+            if (r < heap_.size() && counters_[heap_[r]].count < counters_[heap_[m]].count) m = r;
+            if (m == i) return;
+            swap_heap(i, m);
+            i = m;
+        }
+    }
+
+    std::size_t capacity_;
+    std::size_t key_budget_ = 0;
+    std::size_t key_bytes_ = 0;
+    std::vector<Counter> counters_;
+    std::vector<std::uint32_t> heap_;   // Min-heap of counter indices, keyed by count
+    std::vector<std::uint32_t> index_;  // Open-addressing word -> counter index
+};
+
+// How Stats::bytes was obtained. Either way the input is read exactly once.
+enum class ByteSource
+{
+    Mapped,       // Length of the memory mapping (the size reported by fstat)
+    Streamed,     // Sum of the bytes returned by read() during tokenization
+    Decompressed, // Sum of the decoded bytes fed to the tokenizer
+    Pread,        // Sum of the bytes returned by the read-ahead thread (--io=pread)
+    Uring         // Sum of the bytes returned by io_uring completions (--io=uring)
+};
+
+static const char* byte_source_name(ByteSource src) {
+    switch (src) {
+        case ByteSource::Mapped: return "mmap";
+        case ByteSource::Streamed: return "read";
+        case ByteSource::Pread: return "pread";
+        case ByteSource::Uring: return "io_uring";
+        default: return "decompressed";
+    }
+}
+
+// Distribution of lengths (in bytes) with fixed log-spaced buckets: lengths below 16
+// have a bucket each, longer ones share 8 buckets per power of two. add() is a
+// branch-free handful of instructions, merging is element-wise, and a percentile is
+// exact below 16 and within 12.5% above (and never more than the true maximum).
+struct LengthHistogram
+{
+    static constexpr unsigned kSubBits = 3;
+    static constexpr unsigned kBuckets = (64 - kSubBits + 1) << kSubBits;   // 496
+
+    std::array<std::uint64_t, kBuckets> counts{};
+    std::uint64_t sum = 0;     // Sum of the lengths added
+    std::uint64_t max = 0;
+
+    // Bucket (shift, mantissa): the length's top kSubBits + 1 bits and the bits below them.
+    static unsigned bucket(std::uint64_t len) {
+        unsigned shift = log2_floor64(len | (1u << kSubBits)) - kSubBits;
+        return (shift << kSubBits) + static_cast<unsigned>(len >> shift);
+    }
+
+    // Largest length that falls into bucket `b`.
+    static std::uint64_t bucket_high(unsigned b) {
+        unsigned shift = b < (2u << kSubBits) ? 0 : (b >> kSubBits) - 1;
+        std::uint64_t low = static_cast<std::uint64_t>(b - (shift << kSubBits)) << shift;
+        return low + ((std::uint64_t(1) << shift) - 1);
+    }
+
+    void add(std::uint64_t len) {
+        ++counts[bucket(len)];
+        sum += len;
+        max = std::max(max, len);
+    }
+
+    // Take back one add(len). `max` is kept, so only use this when a length at least as
+    // large is added in its place (see join_chunk_lines).
+    void remove(std::uint64_t len) {
+        --counts[bucket(len)];
+        sum -= len;
+    }
+
+    void merge(const LengthHistogram& other) {
+        for (unsigned b = 0; b < kBuckets; ++b) counts[b] += other.counts[b];
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    std::uint64_t total() const {
+        std::uint64_t n = 0;
+        for (std::uint64_t c : counts) n += c;
+        return n;
+    }
+
+    // Smallest bucket bound below which at least a fraction `q` of the lengths fall.
+    std::uint64_t percentile(double q) const {
+        std::uint64_t n = total();
+        if (n == 0) return 0;
+        std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(n))));
+        std::uint64_t seen = 0;
+        for (unsigned b = 0; b < kBuckets; ++b) {
+            seen += counts[b];
+            if (seen >= rank) return std::min(bucket_high(b), max);
+        }
+        return max;
+    }
+};
+
+// What reports show of a LengthHistogram; small enough to keep for every file of a batch.
+struct LengthSummary
+{
+    std::uint64_t count = 0;
+    double mean = 0;
+    std::uint64_t p50 = 0;
+    std::uint64_t p90 = 0;
+    std::uint64_t p99 = 0;
+    std::uint64_t max = 0;
+};
+
+static LengthSummary summarize(const LengthHistogram& h) {
+    LengthSummary s;
+    s.count = h.total();
+    s.mean = s.count ? static_cast<double>(h.sum) / static_cast<double>(s.count) : 0.0;
+    s.p50 = h.percentile(0.50);
+    s.p90 = h.percentile(0.90);
+    s.p99 = h.percentile(0.99);
+    s.max = h.max;
+    return s;
+}
+
+// Line lengths exclude the '\n'; word lengths are in bytes of the counted token.
+struct Lengths
+{
+    LengthHistogram line;
+    LengthHistogram word;
+
+    void merge(const Lengths& other) {
+        line.merge(other.line);
+        word.merge(other.word);
+    }
+};
+
+// Aggregated statistics produced by the analyzer.
+struct Stats
+{
+    std::uint64_t lines = 0;  // Number of lines in the file
+    std::uint64_t words = 0;  // Number of words detected by is_word_char tokenization
+    std::uint64_t bytes = 0;  // File size in bytes (octets)
+    ByteSource bytes_source = ByteSource::Streamed;
+    const char* codec = nullptr;         // Compression format of the input, if any
+    std::uint64_t compressed_bytes = 0;  // Size of the compressed input, if any
+    // Line and word length distributions (left empty by --counts-only)
+    Lengths lengths;
+    // Word frequency map: token -> count
+    WordTable freq;
+    // --approx-top: bounded summary used instead of `freq`
+    std::unique_ptr<SpaceSaving> sketch;
+    // --table sharded: tables holding disjoint sets of words, used instead of `freq`
+    std::vector<WordTable> shards;
+    // --ngram: n-gram counts over word IDs interned through `freq`
+    std::unique_ptr<NgramCounts> ngrams;
+    // --gpu: distinct words left in the device table; `freq` holds only the top-K candidates
+    std::uint64_t device_words = 0;
+};
+
+// Distinct words counted, whichever table backend holds them.
+static std::size_t distinct_words(const Stats& st) {
+    std::size_t n = st.freq.size() + static_cast<std::size_t>(st.device_words);
+    for (const WordTable& t : st.shards) n += t.size();
+    return n;
+}
+
+static std::uint64_t table_rehashes(const Stats& st) {
+    std::uint64_t n = st.freq.rehashes();
+    for (const WordTable& t : st.shards) n += t.rehashes();
+    return n;
+}
+
+// Add every count of `from` to `into`; `from` is left in an unspecified state.
+// `expected` (if known) is the size of the union, reserved before the merge.
+static void merge_freq(WordTable& into, WordTable&& from, std::size_t expected = 0) {
+    // Always insert the smaller table into the larger one.
+    if (into.size() < from.size()) into.swap(from);
+    if (expected > 0) into.reserve(expected);
+    for (const auto& [w, c] : from) {
+        into[w] += c;
+    }
+    into.add_rehashes(from.rehashes());
+}
+
+// Fold the counts of `from` into `into`. Used to combine per-thread partial results.
+static void merge_stats(Stats& into, Stats&& from, std::size_t expected = 0) {
+    into.lines += from.lines;
+    into.words += from.words;
+    into.bytes += from.bytes;
+    into.lengths.merge(from.lengths);
+    merge_freq(into.freq, std::move(from.freq), expected);
+}
+
+// Read-only view of an input file. Regular files are memory-mapped so the tokenizer
+// can scan the page cache directly; anything that cannot be mapped (stdin, pipes,
+// character devices, empty or virtual files) is read sequentially through read_some().
+class InputFile
+{
+public:
+    // With `map` false, regular files are read with read_at() instead of being mapped.
+    explicit InputFile(const std::string& path, bool map = true) : path_(path) {
+#if defined(_WIN32)
+        if (is_stdin_path(path)) {
+            _setmode(_fileno(stdin), _O_BINARY);
+            fp_ = stdin;
+        } else {
+            fp_ = std::fopen(path.c_str(), "rb");
+            if (!fp_) {
+                throw std::runtime_error("Cannot open input file: " + path);
+            }
+        }
+#else
+        if (is_stdin_path(path)) {
+            // Always streamed: a redirected stdin may not start at offset 0.
+            fd_ = STDIN_FILENO;
+            return;
+        }
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            throw std::runtime_error("Cannot open input file: " + path);
+        }
+        struct stat sb{};
+        if (::fstat(fd_, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            ::close(fd_);
+            throw std::runtime_error(path + " is a directory (use --recursive)");
+        }
+        dev_ = static_cast<std::uint64_t>(sb.st_dev);
+        ino_ = static_cast<std::uint64_t>(sb.st_ino);
+        if (S_ISREG(sb.st_mode)) {
+            seekable_ = true;
+            file_size_ = static_cast<std::uint64_t>(sb.st_size);
+        }
+        if (!map) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+            ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        } else if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+            static_cast<std::uint64_t>(sb.st_size) <= SIZE_MAX) {
+            void* p = ::mmap(nullptr, static_cast<std::size_t>(sb.st_size), PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<const char*>(p);
+                size_ = static_cast<std::size_t>(sb.st_size);
+                // Hint the kernel to read ahead aggressively and drop pages behind us.
+                ::madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        }
+#endif
+    }
+
+    ~InputFile() {
+#if defined(_WIN32)
+        if (fp_ && fp_ != stdin) std::fclose(fp_);
+#else
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+        if (fd_ > STDIN_FILENO) ::close(fd_);
+#endif
+    }
+
+    InputFile(const InputFile&) = delete;
+    InputFile& operator=(const InputFile&) = delete;
+
+    bool mapped() const { return data_ != nullptr; }
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    // Device and inode numbers identifying the opened file (0 where unsupported).
+    std::uint64_t device() const { return dev_; }
+    std::uint64_t inode() const { return ino_; }
+    // True for regular files, which can be read at arbitrary offsets.
+    bool seekable() const { return seekable_; }
+    // Size reported by fstat for regular files (0 otherwise).
+    std::uint64_t file_size() const { return file_size_; }
+#if !defined(_WIN32)
+    int fd() const { return fd_; }
+#endif
+
+    // Read up to `cap` bytes into `buf` (unmapped inputs only). Returns 0 at end of input.
+    std::size_t read_some(char* buf, std::size_t cap) {
+#if defined(_WIN32)
+        std::size_t r = std::fread(buf, 1, cap, fp_);
+        if (r == 0 && std::ferror(fp_)) {
+            throw std::runtime_error("Error reading input file: " + path_);
+        }
+        return r;
+#else
+        for (;;) {
+            ssize_t r = ::read(fd_, buf, cap);
+            if (r >= 0) return static_cast<std::size_t>(r);
+            if (errno != EINTR) {
+                throw std::runtime_error("Error reading input file: " + path_);
+            }
+        }
+#endif
+    }
+
+    // Fill `buf` with up to `cap` bytes starting at `offset` (seekable inputs only).
+    // Returns fewer than `cap` bytes only at the end of the file.
+    std::size_t read_at(char* buf, std::size_t cap, std::uint64_t offset) {
+#if defined(_WIN32)
+        (void)offset;              // Windows inputs are read sequentially
+        return read_some(buf, cap);
+#else
+        std::size_t got = 0;
+        while (got < cap) {
+            ssize_t r = ::pread(fd_, buf + got, cap - got, static_cast<off_t>(offset + got));
+            if (r == 0) break;
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("Error reading input file: " + path_);
+            }
+            got += static_cast<std::size_t>(r);
+        }
+        return got;
+#endif
+    }
+
+private:
+    std::string path_;
+    const char* data_ = nullptr;  // Start of the mapping, or nullptr if not mapped
+    std::size_t size_ = 0;        // Length of the mapping in bytes
+    std::uint64_t dev_ = 0;
+    std::uint64_t ino_ = 0;
+    std::uint64_t file_size_ = 0;
+    bool seekable_ = false;
+#if defined(_WIN32)
+    std::FILE* fp_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Incremental tokenizer over raw bytes. Input may arrive as one mapped range or as a
+// sequence of read buffers; a word or line cut by a buffer boundary is carried over.
+// The scanning loops are templates over the tokenizer's policies (case folding, and
+// where tokens go); the constructor picks one instantiation, so the per-byte loops
+// never test the configuration.
+struct Tokenizer
+{
+    const Config& conf;
+    Stats& st;
+    std::string token;         // Current word being built (may span buffers)
+    bool line_open = false;    // True if the last byte seen was not a newline
+    ClassifyFn classify;       // Block kernel, or nullptr for the scalar reference loop
+    std::uint64_t prev_word = 0; // Counts-only mode: 1 if the last byte was a word char
+    // --utf8: the multi-byte sequence being decoded (it may span buffers).
+    char32_t u8_cp = 0;        // Bits accumulated so far
+    unsigned u8_need = 0;      // Continuation bytes still expected
+    unsigned u8_seen = 0;      // Bytes of the sequence seen so far
+    std::uint64_t line_carry = 0; // Bytes of the open line in earlier buffers
+
+    // `s.sketch` (or `s.ngrams`) must already be set up if approximate counting (or
+    // n-gram counting) is wanted.
+    // A custom --word-chars set runs on the table-driven scalar loop; the block kernels
+    // implement only the default set.
+    Tokenizer(const Config& c, Stats& s)
+        : conf(c), st(s), classify(c.simd && word_class(c) == kByteTables.word ? scan_kernel().classify : nullptr),
+          feed_(select_feed(c, s)), word_(word_class(c)), filter_(token_filter(c)) {
+        token.reserve(32);     // Small optimization: reduce reallocations
+    }
+
+    void feed(const char* data, std::size_t n) {
+        if (n == 0) return;
+        // Access raw bytes to avoid signed-char UB and to keep ASCII logic explicit.
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        line_open = p[n - 1] != '\n';
+        line_from_ = p;
+        (this->*feed_)(p, n);
+        line_carry += static_cast<std::uint64_t>(p + n - line_from_);
+    }
+
+    // Forget any partially scanned word or line.
+    void reset() {
+        token.clear();
+        line_open = false;
+        prev_word = 0;
+        u8_need = u8_seen = 0;
+        line_carry = 0;
+        if (st.ngrams) st.ngrams->restart();
+    }
+
+    // Flush the trailing token and count a final line that lacks a newline.
+    void finish() {
+        u8_need = u8_seen = 0;     // A truncated final sequence is not a word char
+        flush_token();
+        if (line_open) {
+            ++st.lines;
+            if (!conf.count_only) st.lengths.line.add(line_carry);
+        }
+        line_open = false;
+        line_carry = 0;
+        if (st.ngrams) st.ngrams->finish_counts(st.freq);
+    }
+
+    void flush_token() {
+        if (st.sketch) flush<Sink::Sketch>();
+        else if (st.ngrams) flush<Sink::Ngram>();
+        else if (conf.count_only) flush<Sink::Count>();
+        else flush<Sink::Table>();
+    }
+
+    // Trailing bytes of an incomplete UTF-8 sequence, which are not part of the token.
+    unsigned pending_bytes() const { return u8_seen; }
+
+private:
+    // Where finished tokens go.
+    enum class Sink
+    {
+        Table,     // Exact frequency table
+        Sketch,    // Space-Saving summary (--approx-top)
+        Ngram,     // Word table used to intern IDs, plus n-gram counts (--ngram)
+        Count      // Counted only (--counts-only)
+    };
+
+    using FeedFn = void (Tokenizer::*)(const unsigned char*, std::size_t);
+
+    static FeedFn select_feed(const Config& c, const Stats& s) {
+        bool fold = !c.case_sensitive;
+        // Counts-only runs build tokens only if a filter has to see them (folded).
+        bool filtered = token_filter(c) != nullptr;
+        if (c.utf8) {
+            if (c.count_only && filtered) return fold ? &Tokenizer::feed_utf8<true, Sink::Count> : &Tokenizer::feed_utf8<false, Sink::Count>;
+            if (c.count_only) return &Tokenizer::feed_utf8<false, Sink::Count>;
+            if (s.sketch) return fold ? &Tokenizer::feed_utf8<true, Sink::Sketch> : &Tokenizer::feed_utf8<false, Sink::Sketch>;
+            if (s.ngrams) return fold ? &Tokenizer::feed_utf8<true, Sink::Ngram> : &Tokenizer::feed_utf8<false, Sink::Ngram>;
+            return fold ? &Tokenizer::feed_utf8<true, Sink::Table> : &Tokenizer::feed_utf8<false, Sink::Table>;
+        }
+        if (c.count_only && filtered) return fold ? &Tokenizer::feed_words<true, Sink::Count> : &Tokenizer::feed_words<false, Sink::Count>;
+        if (c.count_only) return &Tokenizer::feed_counts;
+        if (s.sketch) return fold ? &Tokenizer::feed_words<true, Sink::Sketch> : &Tokenizer::feed_words<false, Sink::Sketch>;
+        if (s.ngrams) return fold ? &Tokenizer::feed_words<true, Sink::Ngram> : &Tokenizer::feed_words<false, Sink::Ngram>;
+        return fold ? &Tokenizer::feed_words<true, Sink::Table> : &Tokenizer::feed_words<false, Sink::Table>;
+    }
+
+    template <Sink S>
+    void flush() {
+        if (!token.empty()) {
+            if (filter_ && !filter_->accept(token)) {
+                token.clear();     // Rejected tokens are not words: never counted or stored
+                return;
+            }
+            ++st.words;
+            if constexpr (S != Sink::Count) st.lengths.word.add(token.size());
+            if constexpr (S == Sink::Sketch) st.sketch->add(token);
+            else if constexpr (S == Sink::Table) ++st.freq[token];
+            else if constexpr (S == Sink::Ngram) st.ngrams->add(st.freq.entry(token));
+            token.clear();
+        }
+    }
+
+    // The line ending at the '\n' at `nl` (in the current buffer) is complete.
+    void end_line(const unsigned char* nl) {
+        st.lengths.line.add(line_carry + static_cast<std::uint64_t>(nl - line_from_));
+        line_carry = 0;
+        line_from_ = nl + 1;
+    }
+
+    // Count the newlines of a classified block; outside counts-only mode, also record the
+    // length of each line they end.
+    template <Sink S>
+    void newlines(const unsigned char* p, std::uint64_t mask) {
+        st.lines += popcount64(mask);
+        if constexpr (S != Sink::Count) {
+            for (; mask; mask &= mask - 1) end_line(p + ctz64(mask));
+        }
+    }
+
+    template <bool FoldCase, Sink S>
+    void feed_words(const unsigned char* p, std::size_t n) {
+        std::size_t i = 0;
+        if (classify) {
+            for (; i + kScanBlock <= n; i += kScanBlock) {
+                BlockMasks m = classify(p + i);
+                newlines<S>(p + i, m.newline);
+                scan_block<FoldCase, S>(p + i, m.word);
+            }
+        }
+        feed_scalar<FoldCase, S>(p + i, n - i);
+    }
+
+    // --utf8: blocks without a high bit go through the ASCII run scanner unchanged; only
+    // blocks containing non-ASCII bytes are decoded code point by code point.
+    template <bool FoldCase, Sink S>
+    void feed_utf8(const unsigned char* p, std::size_t n) {
+        std::size_t i = 0;
+        if (classify) {
+            for (; i + kScanBlock <= n; i += kScanBlock) {
+                BlockMasks m = classify(p + i);
+                newlines<S>(p + i, m.newline);
+                if (m.nonascii == 0 && u8_need == 0) scan_block<FoldCase, S>(p + i, m.word);
+                else decode_utf8<FoldCase, S>(p + i, kScanBlock);
+            }
+        }
+        for (const unsigned char* q = p + i; (q = static_cast<const unsigned char*>(std::memchr(q, '\n', p + n - q)));
+             ++q) {
+            ++st.lines;
+            if constexpr (S != Sink::Count) end_line(q);
+        }
+        decode_utf8<FoldCase, S>(p + i, n - i);
+    }
+
+    // Reference UTF-8 loop (newlines are counted by the caller). Malformed, overlong and
+    // surrogate sequences are separators, like any other non-word char.
+    template <bool FoldCase, Sink S>
+    void decode_utf8(const unsigned char* p, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            unsigned char b = p[i];
+            if (u8_need) {
+                if ((b & 0xC0) == 0x80) {
+                    u8_cp = (u8_cp << 6) | (b & 0x3F);
+                    ++u8_seen;
+                    if (--u8_need == 0) end_code_point<FoldCase, S>();
+                    continue;
+                }
+                u8_seen = 0;       // Truncated sequence; `b` starts afresh
+                u8_need = 0;
+                flush<S>();
+            }
+            if (b < 0x80) {
+                if (word_[b]) token.push_back(FoldCase ? ascii_lower(b) : static_cast<char>(b));
+                else flush<S>();
+            } else if (b >= 0xC2 && b <= 0xF4) {
+                u8_need = b >= 0xF0 ? 3 : b >= 0xE0 ? 2 : 1;
+                u8_cp = b & (0x3Fu >> u8_need);
+                u8_seen = 1;
+            } else {
+                flush<S>();        // Stray continuation byte or invalid lead byte
+            }
+        }
+    }
+
+    template <bool FoldCase, Sink S>
+    void end_code_point() {
+        static constexpr char32_t kMin[5] = {0, 0, 0x80, 0x800, 0x10000};
+        char32_t cp = u8_cp;
+        bool valid = cp >= kMin[u8_seen] && cp <= 0x10FFFF && !(cp >= 0xD800 && cp <= 0xDFFF);
+        u8_seen = 0;
+        if (valid && is_unicode_word(cp)) append_utf8(token, FoldCase ? fold_case(cp) : cp);
+        else flush<S>();
+    }
+
+    // Counts-only fast path: no tokens are built. A word starts wherever a word char
+    // follows a non-word char, so words are counted as rising edges of the class mask.
+    void feed_counts(const unsigned char* p, std::size_t n) {
+        std::size_t i = 0;
+        if (classify) {
+            for (; i + kScanBlock <= n; i += kScanBlock) {
+                BlockMasks m = classify(p + i);
+                st.lines += popcount64(m.newline);
+                st.words += popcount64(m.word & ~((m.word << 1) | prev_word));
+                prev_word = m.word >> (kScanBlock - 1);
+            }
+        }
+        std::uint64_t lines = 0, words = 0;
+        for (; i < n; ++i) {
+            std::uint64_t w = word_[p[i]];
+            words += w & ~prev_word;
+            lines += p[i] == '\n';
+            prev_word = w;
+        }
+        st.lines += lines;
+        st.words += words;
+    }
+
+    // Reference byte-at-a-time loop; also handles the sub-block tail of each buffer.
+    template <bool FoldCase, Sink S>
+    void feed_scalar(const unsigned char* p, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            unsigned char ch = p[i];
+            if (word_[ch]) {
+                token.push_back(FoldCase ? ascii_lower(ch) : static_cast<char>(ch));
+            } else {
+                // Non-word boundary: flush any pending token.
+                flush<S>();
+                if (ch == '\n') {
+                    ++st.lines;
+                    if constexpr (S != Sink::Count) end_line(p + i);
+                }
+            }
+        }
+    }
+
+    // Walk one classified block run by run instead of byte by byte: each run of set
+    // bits in `word` is appended to the token, each run of clear bits ends it.
+    template <bool FoldCase, Sink S>
+    void scan_block(const unsigned char* p, std::uint64_t word) {
+        unsigned pos = 0;
+        while (pos < kScanBlock) {
+            std::uint64_t rest = word >> pos;
+            if (rest & 1) {
+                // Bits shifted in from the top are clear, so ~rest is non-zero unless
+                // the whole block is one word.
+                std::uint64_t inv = ~rest;
+                unsigned len = inv ? ctz64(inv) : static_cast<unsigned>(kScanBlock);
+                append_word<FoldCase>(p + pos, len);
+                pos += len;
+            } else {
+                flush<S>();
+                if (rest == 0) break;
+                pos += ctz64(rest);
+            }
+        }
+    }
+
+    template <bool FoldCase>
+    void append_word(const unsigned char* p, std::size_t len) {
+        if constexpr (FoldCase) {
+            std::size_t at = token.size();
+            token.resize(at + len);
+            for (std::size_t i = 0; i < len; ++i) token[at + i] = ascii_lower(p[i]);
+        } else {
+            token.append(reinterpret_cast<const char*>(p), len);
+        }
+    }
+
+    FeedFn feed_;              // Loop instantiation chosen once from the configuration
+    const unsigned char* line_from_ = nullptr; // Start of the open line in the current buffer
+    const bool* word_;         // Word-char class (kByteTables.word unless --word-chars)
+    const TokenRules* filter_; // Token filters, or nullptr if every token counts
+};
+
+
+// Build Config::rules from --word-chars, --min-len, --max-len and --stopwords, or return
+// nullptr if none was given. The stopword file is tokenized with the run's own word
+// chars, case folding and --utf8 setting, so its words match the input's tokens exactly.
+[[maybe_unused]] static std::shared_ptr<const TokenRules> make_rules(const Config& conf) {
+    if (conf.word_chars.empty() && conf.min_len == 0 && conf.max_len == 0 && conf.stopwords_path.empty()) {
+        return nullptr;
+    }
+    auto rules = std::make_shared<TokenRules>();
+    rules->utf8 = conf.utf8;
+    if (!conf.word_chars.empty()) {
+        parse_word_chars(conf.word_chars, rules->tables.word);
+        rules->custom_chars = !std::equal(std::begin(rules->tables.word), std::end(rules->tables.word),
+                                          std::begin(kByteTables.word));
+    }
+    if (!conf.stopwords_path.empty()) {
+        std::ifstream f(conf.stopwords_path, std::ios::binary);
+        if (!f) {
+            throw std::runtime_error("Cannot open stopword file: " + conf.stopwords_path);
+        }
+        std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        Config sc;                     // Same tokenization, no filters yet
+        sc.case_sensitive = conf.case_sensitive;
+        sc.utf8 = conf.utf8;
+        sc.rules = rules;
+        Stats words;
+        Tokenizer tok(sc, words);
+        tok.feed(text.data(), text.size());
+        tok.finish();
+        rules->stopwords.assign(std::move(words.freq));
+    }
+    rules->min_len = conf.min_len;
+    rules->max_len = conf.max_len ? conf.max_len : SIZE_MAX;
+    return rules;
+}
+
+// ---- Profiling -----------------------------------------------------------------
+
+// CPU time consumed by the whole process (all threads), in seconds.
+static double process_cpu_seconds() {
+#if defined(_WIN32)
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+    timespec ts{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<double>(ts.tv_sec) + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Peak resident set size of the process in bytes (0 if unknown).
+static std::uint64_t peak_rss_bytes() {
+#if defined(_WIN32)
+    return 0;
+#else
+    rusage ru{};
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#if defined(__APPLE__)
+    return static_cast<std::uint64_t>(ru.ru_maxrss);          // bytes
+#else
+    return static_cast<std::uint64_t>(ru.ru_maxrss) * 1024;   // kilobytes
+#endif
+#endif
+}
+
+// Process-wide hardware counters via perf_event_open (Linux only). Counters are opened
+// with `inherit`, so threads started after start() are included. Any counter the kernel
+// refuses (no PMU, perf_event_paranoid, containers) is simply reported as unavailable.
+class PerfCounters
+{
+public:
+    static constexpr int kCount = 3;
+    static constexpr const char* kNames[kCount] = {"cycles", "llc_misses", "branch_misses"};
+
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    ~PerfCounters() {
+#if defined(__linux__)
+        for (int fd : fds_) {
+            if (fd >= 0) ::close(fd);
+        }
+#endif
+    }
+
+    void start() {
+#if defined(__linux__)
+        static const std::uint64_t kConfigs[kCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES,
+                                                       PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < kCount; ++i) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = kConfigs[i];
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds_[i] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+            if (fds_[i] >= 0) ::ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#if defined(__linux__)
+        for (int i = 0; i < kCount; ++i) {
+            if (fds_[i] < 0) continue;
+            ::ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            std::uint64_t v = 0;
+            if (::read(fds_[i], &v, sizeof(v)) == static_cast<ssize_t>(sizeof(v))) {
+                values_[i] = v;
+                valid_[i] = true;
+            }
+        }
+#endif
+    }
+
+    bool valid(int i) const { return valid_[i]; }
+    std::uint64_t value(int i) const { return values_[i]; }
+
+private:
+    int fds_[kCount] = {-1, -1, -1};
+    std::uint64_t values_[kCount] = {};
+    bool valid_[kCount] = {};
+};
+
+// ---- Thread placement (--numa) -----------------------------------------------------
+
+// A NUMA node and the CPUs of it that this process may run on.
+struct NumaNode
+{
+    int id;                 // Node number, as in /sys/devices/system/node/node<id>
+    std::vector<int> cpus;  // Allowed CPUs, ascending
+};
+
+#if defined(__linux__)
+// Parse a kernel CPU list such as "0-3,8-11".
+static std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        std::size_t end = text.find(',', pos);
+        if (end == std::string::npos) end = text.size();
+        const char* b = text.data() + pos;
+        const char* e = text.data() + end;
+        int lo = 0;
+        auto r = std::from_chars(b, e, lo);
+        if (r.ec == std::errc()) {
+            int hi = lo;
+            if (r.ptr != e && *r.ptr == '-') std::from_chars(r.ptr + 1, e, hi);
+            for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+#endif
+
+// The NUMA nodes holding at least one CPU of this process's affinity mask, by node id.
+// Where the kernel exposes no topology, every allowed CPU is reported as node 0; on
+// other platforms the list is empty and workers are left unpinned.
+static std::vector<NumaNode> numa_nodes() {
+    std::vector<NumaNode> nodes;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+    std::error_code ec;
+    for (const auto& e : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        std::string name = e.path().filename().string();
+        if (name.size() < 5 || name.compare(0, 4, "node") != 0 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        std::ifstream list(e.path() / "cpulist");
+        std::string text;
+        std::getline(list, text);
+        NumaNode node{std::stoi(name.substr(4)), {}};
+        for (int c : parse_cpu_list(text)) {
+            if (c >= 0 && c < CPU_SETSIZE && CPU_ISSET(c, &allowed)) node.cpus.push_back(c);
+        }
+        if (!node.cpus.empty()) nodes.push_back(std::move(node));
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+    if (nodes.empty()) {
+        NumaNode node{0, {}};
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &allowed)) node.cpus.push_back(c);
+        }
+        if (!node.cpus.empty()) nodes.push_back(std::move(node));
+    }
+#endif
+    return nodes;
+}
+
+// Pin the calling thread to `cpu`. Best effort: if it fails, the thread stays where
+// the scheduler put it.
+static void pin_current_thread([[maybe_unused]] int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+// Where the workers of a chunked run execute; worker t scans chunk t. Pinned runs
+// hand consecutive chunks to the same node, in proportion to its CPU count, so each
+// node's workers cover one contiguous range of the input.
+struct Placement
+{
+    struct Group
+    {
+        int node = -1;          // NUMA node id, or -1 for unpinned workers
+        unsigned first = 0;     // The group is workers [first, first + cpus.size())
+        std::vector<int> cpus;  // CPU of each worker, or -1 when unpinned
+    };
+    std::vector<Group> groups;  // Empty when the run was not split across workers
+
+    bool pinned() const { return !groups.empty() && groups[0].node >= 0; }
+
+    unsigned workers() const {
+        unsigned n = 0;
+        for (const Group& g : groups) n += static_cast<unsigned>(g.cpus.size());
+        return n;
+    }
+
+    int cpu(unsigned worker) const {
+        for (const Group& g : groups) {
+            if (worker - g.first < g.cpus.size()) return g.cpus[worker - g.first];
+        }
+        return -1;
+    }
+};
+
+static Placement place_workers(unsigned nthreads, bool numa) {
+    Placement pl;
+    std::vector<NumaNode> nodes;
+    if (numa) nodes = numa_nodes();
+    if (nodes.empty()) {
+        pl.groups.push_back(Placement::Group{-1, 0, std::vector<int>(nthreads, -1)});
+        return pl;
+    }
+    std::vector<std::pair<int, int>> cpus;   // (node id, CPU), node by node
+    for (const NumaNode& n : nodes) {
+        for (int c : n.cpus) cpus.emplace_back(n.id, c);
+    }
+    for (unsigned t = 0; t < nthreads; ++t) {
+        auto [node, cpu] = cpus[std::size_t(t) * cpus.size() / nthreads];
+        if (pl.groups.empty() || pl.groups.back().node != node) pl.groups.push_back(Placement::Group{node, t, {}});
+        pl.groups.back().cpus.push_back(cpu);
+    }
+    return pl;
+}
+
+// "0-3,8" for the CPUs {0, 1, 2, 3, 8}; duplicates (oversubscribed CPUs) are listed once.
+static std::string format_cpu_list(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    std::string out;
+    for (std::size_t i = 0; i < cpus.size();) {
+        std::size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+        if (!out.empty()) out += ',';
+        out += std::to_string(cpus[i]);
+        if (j > i) out += '-' + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+// What the device did in a --gpu run.
+struct DeviceUse
+{
+    std::string name;              // Empty if no device was used
+    std::uint64_t chunks = 0;
+    std::uint64_t bytes_in = 0;    // Copied to the device
+    std::uint64_t candidates = 0;  // Words copied back for the top-K
+};
+
+// Wall and CPU time accumulated per named stage, in first-seen order.
+struct Profile
+{
+    struct Stage
+    {
+        const char* name;
+        double wall = 0;
+        double cpu = 0;
+    };
+    std::vector<Stage> stages;
+    PerfCounters counters;
+    Placement placement;   // Workers of a chunked (--threads) run
+    DeviceUse device;      // --gpu
+    std::uint64_t expected_unique = 0;      // --expected-unique: the size reserved for
+    const char* expected_source = nullptr;  // "hint" or "sample" (null: not pre-sized)
+
+    void add(const char* name, double wall, double cpu) {
+        for (Stage& s : stages) {
+            if (std::strcmp(s.name, name) == 0) {
+                s.wall += wall;
+                s.cpu += cpu;
+                return;
+            }
+        }
+        stages.push_back(Stage{name, wall, cpu});
+    }
+
+    double wall(const char* name) const {
+        for (const Stage& s : stages) {
+            if (std::strcmp(s.name, name) == 0) return s.wall;
+        }
+        return 0;
+    }
+};
+
+// Splits a sequence of work into consecutive stages: lap(name) charges the time since
+// the previous lap to `name`. A null Profile makes every call a no-op.
+class StageTimer
+{
+public:
+    explicit StageTimer(Profile* prof) : prof_(prof) {
+        if (prof_) reset();
+    }
+
+    void lap(const char* stage) {
+        if (!prof_) return;
+        auto now = std::chrono::steady_clock::now();
+        double cpu = process_cpu_seconds();
+        prof_->add(stage, std::chrono::duration<double>(now - wall_).count(), cpu - cpu_);
+        wall_ = now;
+        cpu_ = cpu;
+    }
+
+    void reset() {
+        wall_ = std::chrono::steady_clock::now();
+        cpu_ = process_cpu_seconds();
+    }
+
+private:
+    Profile* prof_;
+    std::chrono::steady_clock::time_point wall_;
+    double cpu_ = 0;
+};
+
+// Size of the reusable buffer used when the input cannot be memory-mapped.
+static constexpr std::size_t kReadBufferSize = 1 << 20; // 1 MB
+
+// Smallest byte range worth handing to a separate thread.
+static constexpr std::size_t kMinChunkSize = 1 << 20; // 1 MB
+
+// ---- Buffer ring ---------------------------------------------------------------
+
+// A fixed pool of reusable buffers handed from one producer thread to one consumer:
+// the producer fills free buffers and publishes them in order, the consumer drains them
+// and gives them back. Both stages overlap while neither allocates per buffer.
+class BufferRing
+{
+public:
+    // A fixed slice of the ring's storage.
+    struct Slice
+    {
+        char* p = nullptr;
+        std::size_t n = 0;
+        char* data() const { return p; }
+        std::size_t size() const { return n; }
+    };
+
+    struct Buffer
+    {
+        Slice data;
+        std::size_t size = 0;      // Valid bytes in `data`
+    };
+
+    // Thrown inside the producer when the consumer gave up; the producer just unwinds.
+    struct Cancelled {};
+
+    // All buffers share one block, so the ring as a whole can get huge pages.
+    BufferRing(std::size_t count, std::size_t capacity) : storage_(count * capacity), buffers_(count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            buffers_[i].data = Slice{storage_.data() + i * capacity, capacity};
+            free_.push_back(&buffers_[i]);
+        }
+    }
+
+    // Producer: wait for an empty buffer.
+    Buffer* acquire() {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [&] { return !free_.empty() || cancelled_; });
+        if (cancelled_) throw Cancelled{};
+        Buffer* b = free_.front();
+        free_.pop_front();
+        b->size = 0;
+        return b;
+    }
+
+    // Producer: an empty buffer if one is free right now, else nullptr.
+    Buffer* try_acquire() {
+        std::lock_guard<std::mutex> lock(m_);
+        if (cancelled_) throw Cancelled{};
+        if (free_.empty()) return nullptr;
+        Buffer* b = free_.front();
+        free_.pop_front();
+        b->size = 0;
+        return b;
+    }
+
+    // Producer: hand a filled buffer to the consumer.
+    void publish(Buffer* b) {
+        std::lock_guard<std::mutex> lock(m_);
+        filled_.push_back(b);
+        cv_.notify_all();
+    }
+
+    // Producer: no more buffers will follow. `error` is rethrown to the consumer.
+    void close(std::exception_ptr error = nullptr) {
+        std::lock_guard<std::mutex> lock(m_);
+        closed_ = true;
+        error_ = error;
+        cv_.notify_all();
+    }
+
+    // Consumer: next filled buffer in publish order, or nullptr at the end of the stream.
+    Buffer* next() {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [&] { return !filled_.empty() || closed_; });
+        if (!filled_.empty()) {
+            Buffer* b = filled_.front();
+            filled_.pop_front();
+            return b;
+        }
+        if (error_) std::rethrow_exception(error_);
+        return nullptr;
+    }
+
+    // Return a drained (or unused) buffer to the pool.
+    void release(Buffer* b) {
+        std::lock_guard<std::mutex> lock(m_);
+        free_.push_back(b);
+        cv_.notify_all();
+    }
+
+    // Consumer: stop the producer early (e.g. on error).
+    void cancel() {
+        std::lock_guard<std::mutex> lock(m_);
+        cancelled_ = true;
+        cv_.notify_all();
+    }
+
+private:
+    LargeBlock storage_;
+    std::vector<Buffer> buffers_;
+    std::deque<Buffer*> free_, filled_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool closed_ = false;
+    bool cancelled_ = false;
+    std::exception_ptr error_;
+};
+
+// Run `produce(ring)` on a separate thread and feed every buffer it publishes to `tok`;
+// returns the number of bytes fed. Errors on either side stop both stages and are rethrown here.
+template <class Produce>
+static std::uint64_t consume_pipeline(BufferRing& ring, Tokenizer& tok, Produce&& produce) {
+    std::thread producer([&] {
+        try {
+            produce(ring);
+            ring.close();
+        } catch (const BufferRing::Cancelled&) {
+            ring.close();
+        } catch (...) {
+            ring.close(std::current_exception());
+        }
+    });
+    std::uint64_t fed = 0;
+    try {
+        while (BufferRing::Buffer* b = ring.next()) {
+            tok.feed(b->data.data(), b->size);
+            fed += b->size;
+            ring.release(b);
+        }
+    } catch (...) {
+        ring.cancel();
+        producer.join();
+        throw;
+    }
+    producer.join();
+    return fed;
+}
+
+// Buffers in flight between a decoder and the tokenizer.
+static constexpr std::size_t kRingBuffers = 4;
+
+// ---- Decompression ---------------------------------------------------------------
+
+enum class Codec
+{
+    None,
+    Gzip,   // Concatenated members are decoded in sequence
+    Zstd,   // One or more frames
+    Lz4     // LZ4 frame format
+};
+
+static const char* codec_name(Codec c) {
+    switch (c) {
+        case Codec::Gzip: return "gzip";
+        case Codec::Zstd: return "zstd";
+        case Codec::Lz4: return "lz4";
+        default: return "none";
+    }
+}
+
+// Identify a compressed stream by its magic bytes, whether or not its codec is built in.
+static Codec magic_codec(std::string_view head) {
+    auto starts = [&](std::initializer_list<unsigned char> magic) {
+        if (head.size() < magic.size()) return false;
+        std::size_t i = 0;
+        for (unsigned char m : magic) {
+            if (static_cast<unsigned char>(head[i++]) != m) return false;
+        }
+        return true;
+    };
+    if (starts({0x1F, 0x8B})) return Codec::Gzip;
+    if (starts({0x28, 0xB5, 0x2F, 0xFD})) return Codec::Zstd;
+    if (starts({0x04, 0x22, 0x4D, 0x18})) return Codec::Lz4;
+    return Codec::None;
+}
+
+// The build flags that add a decoder for `c`, or nullptr if it is built in.
+static const char* missing_codec_flags(Codec c) {
+    switch (c) {
+#if !defined(FILE_STATS_WITH_ZLIB)
+        case Codec::Gzip: return "-DFILE_STATS_WITH_ZLIB -lz";
+#endif
+#if !defined(FILE_STATS_WITH_ZSTD)
+        case Codec::Zstd: return "-DFILE_STATS_WITH_ZSTD -lzstd";
+#endif
+#if !defined(FILE_STATS_WITH_LZ4)
+        case Codec::Lz4: return "-DFILE_STATS_WITH_LZ4 -llz4";
+#endif
+        default: return nullptr;
+    }
+}
+
+// The codec to decode `head` with: only codecs built into this binary are detected, so
+// a plain file that happens to start like, say, gzip is still analyzed as it is.
+static Codec detect_codec(std::string_view head) {
+    Codec c = magic_codec(head);
+    return missing_codec_flags(c) ? Codec::None : c;
+}
+
+// Sequential chunks of the raw input: slices of the mapping, or successive reads. The
+// first bytes can be peeked (for magic detection) without being consumed.
+class ChunkReader
+{
+public:
+    explicit ChunkReader(InputFile& in) : in_(in) {}
+
+    std::string_view peek() {
+        if (in_.mapped()) return std::string_view(in_.data(), std::min<std::size_t>(in_.size(), 16));
+        if (!pending_) fill();
+        return std::string_view(buf_.data(), len_);
+    }
+
+    // Next chunk (empty at the end of input); valid until the next call.
+    std::string_view next() {
+        if (in_.mapped()) {
+            // Slices keep each decoder call's length well inside 32-bit APIs.
+            std::size_t n = std::min(in_.size() - pos_, kSlice);
+            std::string_view v(in_.data() + pos_, n);
+            pos_ += n;
+            total_ += n;
+            return v;
+        }
+        if (!pending_) fill();
+        pending_ = false;
+        total_ += len_ - used_;
+        return std::string_view(buf_.data() + used_, len_ - used_);
+    }
+
+    // Copy the next bytes of an unmapped input into `buf`, starting with any peeked ones.
+    std::size_t read_into(char* buf, std::size_t cap) {
+        if (!pending_) {
+            std::size_t n = in_.read_some(buf, cap);
+            total_ += n;
+            return n;
+        }
+        std::size_t n = std::min(cap, len_ - used_);
+        std::memcpy(buf, buf_.data() + used_, n);
+        used_ += n;
+        pending_ = used_ < len_;
+        total_ += n;
+        return n;
+    }
+
+    // Raw (compressed) bytes consumed so far.
+    std::uint64_t total() const { return total_; }
+
+private:
+    static constexpr std::size_t kSlice = std::size_t(1) << 24; // 16 MB
+
+    void fill() {
+        if (buf_.empty()) buf_.resize(kReadBufferSize);
+        len_ = in_.read_some(buf_.data(), buf_.size());
+        used_ = 0;
+        pending_ = true;
+    }
+
+    InputFile& in_;
+    std::vector<char> buf_;
+    std::size_t len_ = 0;
+    std::size_t used_ = 0;   // Bytes of buf_ already handed out by read_into()
+    bool pending_ = false;   // buf_ holds bytes that have not been returned yet
+    std::size_t pos_ = 0;
+    std::uint64_t total_ = 0;
+};
+
+// Decoder stage: decode everything from `src` into buffers published on `ring`.
+static void decompress_into(Codec codec, [[maybe_unused]] ChunkReader& src, BufferRing& ring) {
+    BufferRing::Buffer* out = ring.acquire();
+    [[maybe_unused]] auto flush_full = [&] {
+        if (out->size == out->data.size()) {
+            ring.publish(out);
+            out = ring.acquire();
+        }
+    };
+
+    if (codec == Codec::Gzip) {
+#if defined(FILE_STATS_WITH_ZLIB)
+        z_stream zs{};
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+        std::unique_ptr<z_stream, int (*)(z_streamp)> guard(&zs, inflateEnd);
+        bool in_member = true;     // Inside a gzip member that has not ended yet
+        for (std::string_view chunk = src.next(); !chunk.empty(); chunk = src.next()) {
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+            zs.avail_in = static_cast<uInt>(chunk.size());
+            while (zs.avail_in > 0) {
+                if (!in_member) {
+                    inflateReset(&zs);     // Concatenated member (as written by `cat a.gz b.gz`)
+                    in_member = true;
+                }
+                zs.next_out = reinterpret_cast<Bytef*>(out->data.data() + out->size);
+                zs.avail_out = static_cast<uInt>(out->data.size() - out->size);
+                int r = inflate(&zs, Z_NO_FLUSH);
+                out->size = out->data.size() - zs.avail_out;
+                if (r == Z_STREAM_END) {
+                    in_member = false;
+                } else if (r != Z_OK && r != Z_BUF_ERROR) {
+                    throw std::runtime_error(std::string("gzip: ") + (zs.msg ? zs.msg : "corrupt stream"));
+                }
+                flush_full();
+            }
+        }
+        if (in_member && zs.total_in > 0) throw std::runtime_error("gzip: unexpected end of stream");
+#endif
+    } else if (codec == Codec::Zstd) {
+#if defined(FILE_STATS_WITH_ZSTD)
+        std::unique_ptr<ZSTD_DStream, std::size_t (*)(ZSTD_DStream*)> ds(ZSTD_createDStream(), ZSTD_freeDStream);
+        if (!ds || ZSTD_isError(ZSTD_initDStream(ds.get()))) throw std::runtime_error("ZSTD_initDStream failed");
+        std::size_t pending = 0;   // Non-zero while a frame is incomplete
+        for (std::string_view chunk = src.next(); !chunk.empty(); chunk = src.next()) {
+            ZSTD_inBuffer in{chunk.data(), chunk.size(), 0};
+            while (in.pos < in.size) {
+                ZSTD_outBuffer o{out->data.data() + out->size, out->data.size() - out->size, 0};
+                pending = ZSTD_decompressStream(ds.get(), &o, &in);
+                if (ZSTD_isError(pending)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(pending));
+                out->size += o.pos;
+                flush_full();
+            }
+        }
+        // Drain output still buffered inside the decoder.
+        while (pending != 0) {
+            ZSTD_inBuffer in{nullptr, 0, 0};
+            ZSTD_outBuffer o{out->data.data() + out->size, out->data.size() - out->size, 0};
+            pending = ZSTD_decompressStream(ds.get(), &o, &in);
+            if (ZSTD_isError(pending)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(pending));
+            out->size += o.pos;
+            if (o.pos == 0 && pending != 0) throw std::runtime_error("zstd: unexpected end of stream");
+            flush_full();
+        }
+#endif
+    } else if (codec == Codec::Lz4) {
+#if defined(FILE_STATS_WITH_LZ4)
+        LZ4F_dctx* raw = nullptr;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&raw, LZ4F_VERSION))) {
+            throw std::runtime_error("LZ4F_createDecompressionContext failed");
+        }
+        std::unique_ptr<LZ4F_dctx, LZ4F_errorCode_t (*)(LZ4F_dctx*)> dctx(raw, LZ4F_freeDecompressionContext);
+        std::size_t hint = 1;      // 0 once a frame is fully decoded
+        for (std::string_view chunk = src.next(); !chunk.empty(); chunk = src.next()) {
+            const char* p = chunk.data();
+            std::size_t left = chunk.size();
+            while (left > 0) {
+                std::size_t dst = out->data.size() - out->size, used = left;
+                hint = LZ4F_decompress(dctx.get(), out->data.data() + out->size, &dst, p, &used, nullptr);
+                if (LZ4F_isError(hint)) throw std::runtime_error(std::string("lz4: ") + LZ4F_getErrorName(hint));
+                out->size += dst;
+                p += used;
+                left -= used;
+                flush_full();
+            }
+        }
+        // Drain output still buffered inside the decoder.
+        while (hint != 0) {
+            std::size_t dst = out->data.size() - out->size, used = 0;
+            hint = LZ4F_decompress(dctx.get(), out->data.data() + out->size, &dst, nullptr, &used, nullptr);
+            if (LZ4F_isError(hint)) throw std::runtime_error(std::string("lz4: ") + LZ4F_getErrorName(hint));
+            out->size += dst;
+            if (dst == 0 && hint != 0) throw std::runtime_error("lz4: unexpected end of stream");
+            flush_full();
+        }
+#endif
+    }
+    ring.publish(out);
+}
+
+// Decode a compressed input on a separate thread while the tokenizer consumes its output;
+// returns the number of decoded bytes.
+static std::uint64_t analyze_compressed(Codec codec, ChunkReader& src, Tokenizer& tok, Stats& st) {
+    BufferRing ring(kRingBuffers, kReadBufferSize);
+    std::uint64_t decoded = consume_pipeline(ring, tok, [&](BufferRing& r) { decompress_into(codec, src, r); });
+    st.codec = codec_name(codec);
+    st.compressed_bytes = src.total();
+    return decoded;
+}
+
+// ---- Read-ahead engines (--io) ----------------------------------------------------
+
+// Producer for --io=pread: fill ring buffers one after another, so the next reads run
+// while the tokenizer scans the previous buffers. Pipes and stdin fall back to read().
+static void pread_into(InputFile& in, ChunkReader& src, BufferRing& ring) {
+    for (std::uint64_t offset = 0;;) {
+        BufferRing::Buffer* b = ring.acquire();
+        b->size = in.seekable() ? in.read_at(b->data.data(), b->data.size(), offset)
+                                : src.read_into(b->data.data(), b->data.size());
+        if (b->size == 0) {
+            ring.release(b);
+            return;
+        }
+        offset += b->size;
+        ring.publish(b);
+    }
+}
+
+#if defined(FILE_STATS_WITH_URING) && defined(__linux__)
+// Producer for --io=uring: keep a read in flight for every free ring buffer and publish
+// buffers in file order as they complete. Short reads are resubmitted for the rest.
+static void uring_into(InputFile& in, BufferRing& ring, unsigned depth) {
+    io_uring uring;
+    int rc = io_uring_queue_init(depth, &uring, 0);
+    if (rc < 0) throw std::runtime_error(std::string("io_uring_queue_init: ") + std::strerror(-rc));
+    std::unique_ptr<io_uring, void (*)(io_uring*)> guard(&uring, io_uring_queue_exit);
+
+    struct Read
+    {
+        BufferRing::Buffer* buf;
+        std::uint64_t offset;
+        std::size_t want;      // Bytes this read covers; buf->size counts those arrived
+        bool done;
+    };
+    std::deque<Read> inflight;     // In file order; references stay valid across push/pop
+    unsigned pending = 0;          // Submitted reads without a completion yet
+    auto queue = [&](Read& r) {
+        io_uring_sqe* sqe = io_uring_get_sqe(&uring);
+        io_uring_prep_read(sqe, in.fd(), r.buf->data.data() + r.buf->size,
+                           static_cast<unsigned>(r.want - r.buf->size), r.offset + r.buf->size);
+        io_uring_sqe_set_data(sqe, &r);
+        ++pending;
+    };
+
+    std::uint64_t next = 0, end = in.file_size();
+    try {
+        for (;;) {
+            while (next < end && inflight.size() < depth) {
+                // Block only when nothing is in flight; otherwise completions come first.
+                BufferRing::Buffer* b = inflight.empty() ? ring.acquire() : ring.try_acquire();
+                if (!b) break;
+                std::size_t want = static_cast<std::size_t>(std::min<std::uint64_t>(b->data.size(), end - next));
+                inflight.push_back(Read{b, next, want, false});
+                queue(inflight.back());
+                next += want;
+            }
+            if (inflight.empty()) break;
+            io_uring_submit(&uring);
+            io_uring_cqe* cqe = nullptr;
+            rc = io_uring_wait_cqe(&uring, &cqe);
+            if (rc == -EINTR) continue;
+            if (rc < 0) throw std::runtime_error(std::string("io_uring_wait_cqe: ") + std::strerror(-rc));
+            Read& r = *static_cast<Read*>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            io_uring_cqe_seen(&uring, cqe);
+            --pending;
+            if (res == -EINTR || res == -EAGAIN) {
+                queue(r);
+                continue;
+            }
+            if (res < 0) throw std::runtime_error("Error reading input file: " + std::string(std::strerror(-res)));
+            r.buf->size += static_cast<std::size_t>(res);
+            if (res == 0) {
+                // The file shrank since fstat: stop at its new end.
+                r.want = r.buf->size;
+                end = std::min(end, r.offset + r.buf->size);
+            }
+            if (r.buf->size < r.want) queue(r);
+            else r.done = true;
+            while (!inflight.empty() && inflight.front().done) {
+                BufferRing::Buffer* b = inflight.front().buf;
+                inflight.pop_front();
+                if (b->size > 0) ring.publish(b);
+                else ring.release(b);
+            }
+        }
+    } catch (...) {
+        // The kernel may still write into the buffers; wait for every read to finish.
+        while (pending > 0) {
+            io_uring_cqe* cqe = nullptr;
+            if (io_uring_wait_cqe(&uring, &cqe) < 0) break;
+            io_uring_cqe_seen(&uring, cqe);
+            --pending;
+        }
+        throw;
+    }
+}
+#endif
+
+// Read an unmapped input through the selected engine while the tokenizer consumes it;
+// returns the number of bytes fed and records which engine served them in `st`.
+static std::uint64_t analyze_read_ahead(const Config& conf, InputFile& in, ChunkReader& src, Tokenizer& tok,
+                                        Stats& st) {
+    BufferRing ring(kRingBuffers, kReadBufferSize);
+#if defined(FILE_STATS_WITH_URING) && defined(__linux__)
+    if (conf.io == IoEngine::Uring && in.seekable()) {
+        st.bytes_source = ByteSource::Uring;
+        return consume_pipeline(ring, tok, [&](BufferRing& r) { uring_into(in, r, kRingBuffers); });
+    }
+#else
+    (void)conf;
+#endif
+    st.bytes_source = ByteSource::Pread;
+    return consume_pipeline(ring, tok, [&](BufferRing& r) { pread_into(in, src, r); });
+}
+
+// The first split point at or after `pos`: the next non-word byte, so no word straddles
+// two chunks. With --utf8, non-ASCII bytes are skipped too, so no split lands inside a
+// sequence. The result depends only on the bytes from `pos` on, so two scanners of
+// adjacent ranges agree on their shared end.
+static std::size_t word_boundary(const Config& conf, const char* data, std::size_t size, std::size_t pos) {
+    const bool* word = word_class(conf);
+    while (pos < size && (word[static_cast<unsigned char>(data[pos])] ||
+                          (conf.utf8 && static_cast<unsigned char>(data[pos]) >= 0x80))) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Cut a mapped buffer into `nthreads` roughly equal byte ranges at split points (see
+// word_boundary).
+static std::vector<std::size_t> split_bounds(const Config& conf, const char* data, std::size_t size,
+                                             unsigned nthreads) {
+    std::vector<std::size_t> bounds(nthreads + 1, size);
+    bounds[0] = 0;
+    for (unsigned t = 1; t < nthreads; ++t) {
+        bounds[t] = word_boundary(conf, data, size, std::max(bounds[t - 1], size / nthreads * t));
+    }
+    return bounds;
+}
+
+// HyperLogLog distinct counter: 2^12 one-byte registers, about 1.6% standard error.
+class HyperLogLog
+{
+public:
+    void add(std::uint64_t h) {
+        std::uint64_t rest = h >> kBits;
+        std::uint8_t rank = static_cast<std::uint8_t>(rest ? ctz64(rest) + 1 : 64 - kBits + 1);
+        std::uint8_t& r = regs_[h & (kRegisters - 1)];
+        if (rank > r) r = rank;
+    }
+
+    void merge(const HyperLogLog& o) {
+        for (std::size_t i = 0; i < kRegisters; ++i) regs_[i] = std::max(regs_[i], o.regs_[i]);
+    }
+
+    double estimate() const {
+        double sum = 0;
+        unsigned zeros = 0;
+        for (std::uint8_t r : regs_) {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        const double m = kRegisters;
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros > 0) e = m * std::log(m / zeros);   // Small range: linear counting
+        return e;
+    }
+
+private:
+    static constexpr unsigned kBits = 12;
+    static constexpr std::size_t kRegisters = std::size_t(1) << kBits;
+    std::array<std::uint8_t, kRegisters> regs_{};
+};
+
+// Distinct words expected in the first `bytes` of an input, by Heaps' law
+// V(n) = V(N) * (n / N)^beta, for --expected-unique.
+struct VocabularyModel
+{
+    double total = 0;           // Distinct words of the whole input (0: nothing known)
+    std::uint64_t bytes = 0;    // Size of the whole input (0: unknown, so every part gets `total`)
+    double beta = 0.6;          // A typical exponent for natural-language text
+    const char* source = nullptr;  // "hint" or "sample"
+
+    std::size_t at(std::uint64_t n) const {
+        if (bytes == 0 || n >= bytes) return static_cast<std::size_t>(total);
+        return static_cast<std::size_t>(total * std::pow(static_cast<double>(n) / bytes, beta));
+    }
+};
+
+// Sample windows read by the --expected-unique auto pre-pass: up to 4 MB of the input.
+static constexpr std::size_t kSampleWindows = 64;
+static constexpr std::size_t kSampleWindowBytes = 64 << 10;
+
+// Estimate the vocabulary of a mapped input from evenly spaced windows: HyperLogLog
+// counts the distinct words of every other window and of all windows, the two points
+// fit the Heaps exponent, and the law extrapolates to the whole input. Words are split
+// and case-folded like the tokenizer does for ASCII; other bytes of --utf8 input are
+// taken as they are, and the length and stopword filters are ignored, so the estimate
+// errs high. Inputs too small to need it are not sampled.
+static VocabularyModel sample_vocabulary(const Config& conf, const char* data, std::size_t size) {
+    VocabularyModel model;
+    const std::size_t windows = std::min(kSampleWindows, size / (kSampleWindowBytes * 4));
+    if (windows < 2) return model;
+    const bool* word = word_class(conf);
+    HyperLogLog half[2];
+    std::uint64_t sampled[2] = {0, 0};
+    std::string token;
+    for (std::size_t w = 0; w < windows; ++w) {
+        std::size_t pos = word_boundary(conf, data, size, size / windows * w);
+        std::size_t end = word_boundary(conf, data, size, std::min(size, pos + kSampleWindowBytes));
+        sampled[w & 1] += end - pos;
+        for (; pos < end; ++pos) {
+            unsigned char c = static_cast<unsigned char>(data[pos]);
+            if (word[c] || (conf.utf8 && c >= 0x80)) {
+                token.push_back(conf.case_sensitive ? static_cast<char>(c) : ascii_lower(c));
+            } else if (!token.empty()) {
+                half[w & 1].add(mix64(hash_bytes(token.data(), token.size())));
+                token.clear();
+            }
+        }
+        if (!token.empty()) half[w & 1].add(mix64(hash_bytes(token.data(), token.size())));
+        token.clear();
+    }
+    const double part = half[0].estimate();
+    half[0].merge(half[1]);
+    const double all = half[0].estimate();
+    const double grown = static_cast<double>(sampled[0] + sampled[1]) / std::max<std::uint64_t>(1, sampled[0]);
+    if (part >= 1 && all > part && grown > 1) model.beta = std::clamp(std::log(all / part) / std::log(grown), 0.1, 1.0);
+    model.bytes = size;
+    model.total = all * std::pow(static_cast<double>(size) / std::max<std::uint64_t>(1, sampled[0] + sampled[1]), model.beta);
+    model.total = std::min(model.total, static_cast<double>(size / 2 + 1));   // A word and a separator at least
+    model.source = "sample";
+    return model;
+}
+
+// The --expected-unique model for an input of `size` bytes (0 if unknown); `data` is its
+// mapping, or null if it is not mapped, which rules out sampling.
+static VocabularyModel vocabulary_model(const Config& conf, const char* data, std::size_t size) {
+    VocabularyModel model;
+    if (conf.count_only || conf.approx) return model;
+    if (conf.estimate_unique && data) return sample_vocabulary(conf, data, size);
+    if (conf.expected_unique > 0) {
+        model.total = static_cast<double>(conf.expected_unique);
+        model.bytes = size;
+        model.source = "hint";
+    }
+    return model;
+}
+
+// How a chunk of a split buffer starts and ends in terms of lines. Chunks are cut at word
+// boundaries, not newlines, so each chunk's tokenizer records the pieces of a line that
+// straddles a split point as separate lines; join_chunk_lines puts them back together.
+struct ChunkLines
+{
+    bool newline = false;     // The chunk contains a '\n'
+    std::uint64_t head = 0;   // Bytes before its first '\n'
+    std::uint64_t tail = 0;   // Bytes after its last '\n' (the tokenizer's open line)
+};
+
+static ChunkLines chunk_lines(const char* p, std::size_t n, const Tokenizer& tok) {
+    ChunkLines c;
+    const void* nl = std::memchr(p, '\n', n);
+    c.newline = nl != nullptr;
+    c.head = nl ? static_cast<std::uint64_t>(static_cast<const char*>(nl) - p) : n;
+    c.tail = tok.line_carry;
+    return c;
+}
+
+// Fix up `h` (the merged line lengths of all chunks, in order) for lines that span chunks,
+// including a final line without a newline, which no chunk has recorded.
+static void join_chunk_lines(LengthHistogram& h, const std::vector<ChunkLines>& chunks) {
+    std::uint64_t carry = 0;      // Open line so far, from earlier chunks
+    for (const ChunkLines& c : chunks) {
+        if (!c.newline) {
+            carry += c.head;
+            continue;
+        }
+        if (carry > 0) {
+            h.remove(c.head);
+            h.add(carry + c.head);
+        }
+        carry = c.tail;
+    }
+    if (carry > 0) h.add(carry);
+}
+
+// Tokenize a mapped buffer with several threads, one chunk per thread (see
+// split_bounds); each thread fills its own Stats and the results are merged.
+// Pinned workers fault in their own chunk and grow their tables on their own node;
+// each node's tables are then merged on that node before the nodes are merged here.
+static Stats analyze_parallel(const Config& conf, const char* data, std::size_t size, const Placement& pl,
+                              const VocabularyModel& vocab, StageTimer& timer) {
+    const unsigned nthreads = pl.workers();
+    std::vector<std::size_t> bounds = split_bounds(conf, data, size, nthreads);
+
+    std::vector<Stats> partial(nthreads);
+    std::vector<ChunkLines> chunks(nthreads);
+    std::vector<std::exception_ptr> errors(nthreads);
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    for (unsigned t = 0; t < nthreads; ++t) {
+        workers.emplace_back([&, t] {
+            try {
+                if (pl.pinned()) pin_current_thread(pl.cpu(t));
+                partial[t].freq.reserve(vocab.at(bounds[t + 1] - bounds[t]));
+                Tokenizer tok(conf, partial[t]);
+                tok.feed(data + bounds[t], bounds[t + 1] - bounds[t]);
+                tok.flush_token(); // Chunks end on a word boundary; lines are closed below
+                if (!conf.count_only) chunks[t] = chunk_lines(data + bounds[t], bounds[t + 1] - bounds[t], tok);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+    timer.lap("tokenize");
+
+    std::vector<unsigned> leaders;   // Workers whose Stats hold the merged result of a node
+    if (pl.groups.size() > 1) {
+        std::vector<std::thread> mergers;
+        mergers.reserve(pl.groups.size());
+        for (const Placement::Group& g : pl.groups) {
+            leaders.push_back(g.first);
+            mergers.emplace_back([&] {
+                try {
+                    pin_current_thread(g.cpus[0]);
+                    const unsigned last = static_cast<unsigned>(g.first + g.cpus.size());
+                    const std::size_t expected = vocab.at(bounds[last] - bounds[g.first]);
+                    for (unsigned t = g.first + 1; t < last; ++t) {
+                        merge_stats(partial[g.first], std::move(partial[t]), expected);
+                    }
+                } catch (...) {
+                    errors[g.first] = std::current_exception();
+                }
+            });
+        }
+        for (auto& m : mergers) m.join();
+        for (auto& e : errors) {
+            if (e) std::rethrow_exception(e);
+        }
+    } else {
+        for (unsigned t = 0; t < nthreads; ++t) leaders.push_back(t);
+    }
+    Stats st = std::move(partial[leaders[0]]);
+    for (std::size_t i = 1; i < leaders.size(); ++i) {
+        merge_stats(st, std::move(partial[leaders[i]]), vocab.at(size));
+    }
+    // Count a final line that lacks a trailing newline, exactly once.
+    if (size > 0 && data[size - 1] != '\n') ++st.lines;
+    if (!conf.count_only) join_chunk_lines(st.lengths.line, chunks);
+    timer.lap("merge");
+    return st;
+}
+
+// Input fed to a sharded worker between checks of its local table, and the local
+// table size at which its counts are pushed to the shared shards.
+static constexpr std::size_t kShardFeedBytes = 1 << 20; // 1 MB
+static constexpr std::size_t kShardFlushEntries = 1 << 15;
+
+// --table sharded: like analyze_parallel, but no serial merge at the end. Words are
+// partitioned by the top bits of their hash into shared shards, 8 or more per thread,
+// each behind its own lock. Every worker counts into a small local table and
+// periodically pushes it out, one lock acquisition per shard, so the merge
+// work is spread over all threads while they tokenize.
+static Stats analyze_sharded(const Config& conf, const char* data, std::size_t size, const Placement& pl,
+                             const VocabularyModel& vocab, StageTimer& timer) {
+    const unsigned nthreads = pl.workers();
+    std::vector<std::size_t> bounds = split_bounds(conf, data, size, nthreads);
+    unsigned shard_bits = 4;
+    while ((1u << shard_bits) < nthreads * 8) ++shard_bits;
+    const std::size_t nshards = std::size_t(1) << shard_bits;
+    std::vector<WordTable> shards(nshards);
+    for (WordTable& sh : shards) sh.reserve(vocab.at(size) / nshards);
+    std::unique_ptr<std::mutex[]> locks(new std::mutex[nshards]);
+
+    std::vector<Stats> partial(nthreads);
+    std::vector<ChunkLines> chunks(nthreads);
+    std::vector<std::uint64_t> local_rehashes(nthreads, 0);
+    std::vector<std::exception_ptr> errors(nthreads);
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    for (unsigned t = 0; t < nthreads; ++t) {
+        workers.emplace_back([&, t] {
+            try {
+                if (pl.pinned()) pin_current_thread(pl.cpu(t));
+                Stats& local = partial[t];
+                Tokenizer tok(conf, local);
+                std::vector<std::vector<std::pair<std::string_view, std::uint64_t>>> buckets(nshards);
+                auto push = [&] {
+                    for (const auto& entry : local.freq) {
+                        buckets[hash_bytes(entry.first.data(), entry.first.size()) >> (64 - shard_bits)].push_back(entry);
+                    }
+                    for (std::size_t k = 0; k < nshards; ++k) {
+                        std::size_t sh = (k + t) & (nshards - 1);   // Workers start on different shards
+                        if (buckets[sh].empty()) continue;
+                        std::lock_guard<std::mutex> lock(locks[sh]);
+                        for (const auto& [w, c] : buckets[sh]) shards[sh][w] += c;
+                        buckets[sh].clear();
+                    }
+                    local_rehashes[t] += local.freq.rehashes();
+                    local.freq.clear();   // Keeps its capacity for the next batch
+                };
+                for (std::size_t pos = bounds[t], end = bounds[t + 1]; pos < end;) {
+                    std::size_t n = std::min(kShardFeedBytes, end - pos);
+                    tok.feed(data + pos, n);
+                    pos += n;
+                    if (local.freq.size() >= kShardFlushEntries) push();
+                }
+                tok.flush_token(); // Chunks end on a word boundary; lines are closed below
+                chunks[t] = chunk_lines(data + bounds[t], bounds[t + 1] - bounds[t], tok);
+                push();
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+    timer.lap("tokenize");
+
+    Stats st;
+    for (unsigned t = 0; t < nthreads; ++t) {
+        st.lines += partial[t].lines;
+        st.words += partial[t].words;
+        st.lengths.merge(partial[t].lengths);
+        st.freq.add_rehashes(local_rehashes[t]);
+    }
+    st.shards = std::move(shards);
+    // Count a final line that lacks a trailing newline, exactly once.
+    if (size > 0 && data[size - 1] != '\n') ++st.lines;
+    join_chunk_lines(st.lengths.line, chunks);
+    timer.lap("merge");
+    return st;
+}
+
+// ---- GPU offload (--gpu) ------------------------------------------------------------
+//
+// The device (file_stats_cuda.cu) tokenizes and counts the mapped input and keeps the
+// word table; lines, words, both length histograms and the distinct count come back,
+// plus every word counted at least as often as the K-th most frequent one. `freq` holds
+// those candidates with their exact counts, so top_k() ranks them as it would the full
+// table, ties included.
+
+// True if the device tokenizes `conf` like the host does; a --word-chars set containing
+// '\n' changes how lines are counted, which the device does not implement.
+static bool gpu_tokenizes(const Config& conf) {
+    return conf.gpu && !word_class(conf)[static_cast<unsigned char>('\n')];
+}
+
+#if defined(FILE_STATS_WITH_CUDA)
+static_assert(file_stats::cuda::kLengthSubBits == LengthHistogram::kSubBits &&
+                  file_stats::cuda::kLengthBuckets == LengthHistogram::kBuckets,
+              "file_stats_cuda.h must bin lengths like LengthHistogram");
+
+static void copy_histogram(LengthHistogram& into, const file_stats::cuda::Histogram& from) {
+    std::copy(std::begin(from.counts), std::end(from.counts), into.counts.begin());
+    into.sum = from.sum;
+    into.max = from.max;
+}
+
+static file_stats::cuda::Rules gpu_rules(const Config& conf) {
+    file_stats::cuda::Rules rules;
+    const bool* word = word_class(conf);
+    for (unsigned c = 0; c < 256; ++c) {
+        rules.word[c] = word[c];
+        rules.store[c] = static_cast<unsigned char>(conf.case_sensitive ? c : kByteTables.lower[c]);
+    }
+    rules.count_only = conf.count_only;
+    if (const TokenRules* f = token_filter(conf)) {
+        rules.min_len = static_cast<std::uint32_t>(std::min<std::size_t>(f->min_len, UINT32_MAX));
+        rules.max_len = static_cast<std::uint32_t>(std::min<std::size_t>(f->max_len, UINT32_MAX));
+    }
+    return rules;
+}
+
+// True if the device can take this input: no word spans a whole device chunk.
+static bool gpu_fits(const Config& conf, const char* data, std::size_t size) {
+    return file_stats::cuda::fits(data, size, gpu_rules(conf));
+}
+
+static Stats analyze_gpu(const Config& conf, const char* data, std::size_t size, const VocabularyModel& vocab,
+                         Profile* prof) {
+    file_stats::cuda::Result r = file_stats::cuda::analyze(data, size, gpu_rules(conf), conf.topN, vocab.at(size));
+
+    Stats st;
+    st.lines = r.lines;
+    st.words = r.words;
+    if (!conf.count_only) {
+        copy_histogram(st.lengths.line, r.line_lengths);
+        copy_histogram(st.lengths.word, r.word_lengths);
+    }
+    st.freq.reserve(r.candidates.size());
+    for (const auto& [w, c] : r.candidates) st.freq[w] += c;
+    st.device_words = r.distinct - r.candidates.size();
+    st.freq.add_rehashes(r.table_growths);
+    if (prof) prof->device = DeviceUse{r.device, r.chunks, r.bytes_in, r.candidates.size()};
+    return st;
+}
+#else
+static bool gpu_fits(const Config&, const char*, std::size_t) {
+    return true;
+}
+
+static Stats analyze_gpu(const Config&, const char*, std::size_t, const VocabularyModel&, Profile*) {
+    throw std::runtime_error("--gpu needs a build with -DFILE_STATS_WITH_CUDA");
+}
+#endif
+
+// Read the file once: count lines/words/bytes and build the frequency table.
+// With a Profile, time is charged to the open, read, tokenize and merge stages.
+static Stats analyze_file(const Config& conf, const std::string& path, Profile* prof = nullptr) {
+    StageTimer timer(prof);
+    Stats st;
+    if (conf.approx && !conf.count_only) {
+        // Fewer counters than K would report garbage counts, so do not stretch the budget.
+        std::size_t capacity = SpaceSaving::capacity_for(conf.memory_budget);
+        if (capacity < conf.topN) {
+            throw std::runtime_error("--memory " + std::to_string(conf.memory_budget) + " holds " + std::to_string(capacity) +
+                                     " counters of " + std::to_string(SpaceSaving::kBytesPerCounter) +
+                                     " bytes, fewer than the " + std::to_string(conf.topN) + " of --approx-top");
+        }
+        st.sketch = std::make_unique<SpaceSaving>(capacity);
+    }
+    if (conf.ngram) st.ngrams = std::make_unique<NgramCounts>(conf.ngram);
+
+    InputFile in(path, conf.io == IoEngine::Mmap);
+    ChunkReader src(in);
+    Codec codec = Codec::None;
+    if (conf.decompress) {
+        std::string_view head = src.peek();
+        codec = detect_codec(head);
+        if (const char* flags = missing_codec_flags(magic_codec(head))) {
+            std::cerr << "Warning: " << display_name(path) << " starts like " << codec_name(magic_codec(head))
+                      << " data, but file_stats was built without " << codec_name(magic_codec(head))
+                      << " support; analyzing the raw bytes (rebuild with " << flags << " to decode it)\n";
+        }
+    }
+    timer.lap("open");
+    const VocabularyModel vocab =
+        vocabulary_model(conf, codec == Codec::None && in.mapped() ? in.data() : nullptr, in.mapped() ? in.size() : 0);
+    if (conf.estimate_unique) timer.lap("sample");
+    if (prof && vocab.source) {
+        prof->expected_unique = vocab.at(in.size());
+        prof->expected_source = vocab.source;
+    }
+    std::uint64_t streamed = 0;   // Bytes delivered through read_some(), --io or the decoder
+    unsigned nthreads = static_cast<unsigned>(
+        std::min<std::size_t>(conf.threads, std::max<std::size_t>(1, in.size() / kMinChunkSize)));
+    if (codec == Codec::None && in.mapped() && gpu_tokenizes(conf) && gpu_fits(conf, in.data(), in.size())) {
+        // The host waits for the device, so the device's time is the tokenize stage.
+        st = analyze_gpu(conf, in.data(), in.size(), vocab, prof);
+        timer.lap("tokenize");
+    } else if (codec == Codec::None && in.mapped() && nthreads > 1) {
+        Placement pl = place_workers(nthreads, conf.numa);
+        st = conf.table == TableBackend::Sharded && !conf.count_only
+                 ? analyze_sharded(conf, in.data(), in.size(), pl, vocab, timer)
+                 : analyze_parallel(conf, in.data(), in.size(), pl, vocab, timer);
+        if (prof) prof->placement = std::move(pl);
+    } else {
+        st.freq.reserve(vocab.at(in.size()));
+        Tokenizer tok(conf, st);
+        if (codec != Codec::None) {
+            // Decoding overlaps tokenizing, so its time is part of the tokenize stage.
+            streamed = analyze_compressed(codec, src, tok, st);
+        } else if (in.mapped()) {
+            // Zero-copy: scan the mapped bytes directly.
+            tok.feed(in.data(), in.size());
+        } else if (conf.io != IoEngine::Mmap) {
+            // Reads overlap tokenizing, so their time is part of the tokenize stage.
+            streamed = analyze_read_ahead(conf, in, src, tok, st);
+        } else {
+            for (;;) {
+                std::string_view chunk = src.next();
+                timer.lap("read");
+                if (chunk.empty()) break;
+                tok.feed(chunk.data(), chunk.size());
+                timer.lap("tokenize");
+                streamed += chunk.size();
+            }
+        }
+        tok.finish();
+        timer.lap("tokenize");
+    }
+
+    // Bytes are counted by the same pass that tokenized them; there is no second read.
+    if (codec != Codec::None) {
+        st.bytes = streamed;
+        st.bytes_source = ByteSource::Decompressed;
+    } else if (in.mapped()) {
+        st.bytes = in.size();
+        st.bytes_source = ByteSource::Mapped;
+    } else {
+        st.bytes = streamed;
+    }
+
+    return st;
+}
+
+// ---- Incremental state (--state) ---------------------------------------------------
+//
+// File layout (integers are LEB128 varints unless noted):
+//   magic "FSIDX002" (8 bytes) | flags | device | inode | offset | prefix_hash (8 bytes LE)
+//   | lines | words | line_open | prev_word | token_len token | line_carry
+//   | line lengths | word lengths | entries | entries x (word_len word count)
+// where each length histogram is: sum | max | buckets B | B x (bucket_index count).
+// `offset` is the number of bytes already scanned; lines/words (and the histograms) exclude
+// the open line and the partial token, which the next run completes. The state is discarded if the file's
+// identity or configuration changed, if it is now shorter than `offset`, or if its first
+// bytes no longer hash to `prefix_hash` (truncated and rewritten in place).
+
+static constexpr char kStateMagic[8] = {'F', 'S', 'I', 'D', 'X', '0', '0', '2'};
+static constexpr std::size_t kStatePrefixBytes = 4096;
+
+static void put_varint(std::string& out, std::uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+// Bounds-checked cursor over a serialized buffer; every getter fails instead of overrunning.
+struct ByteReader
+{
+    const char* p;
+    const char* end;
+
+    bool varint(std::uint64_t& v) {
+        v = 0;
+        for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+            unsigned char b = static_cast<unsigned char>(*p++);
+            v |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool bytes(std::size_t n, std::string_view& out) {
+        if (static_cast<std::size_t>(end - p) < n) return false;
+        out = std::string_view(p, n);
+        p += n;
+        return true;
+    }
+};
+
+// Only the non-empty buckets are stored.
+static void put_histogram(std::string& out, const LengthHistogram& h) {
+    put_varint(out, h.sum);
+    put_varint(out, h.max);
+    unsigned used = 0;
+    for (std::uint64_t c : h.counts) used += c != 0;
+    put_varint(out, used);
+    for (unsigned b = 0; b < LengthHistogram::kBuckets; ++b) {
+        if (h.counts[b] == 0) continue;
+        put_varint(out, b);
+        put_varint(out, h.counts[b]);
+    }
+}
+
+static bool get_histogram(ByteReader& in, LengthHistogram& h) {
+    std::uint64_t used;
+    if (!in.varint(h.sum) || !in.varint(h.max) || !in.varint(used)) return false;
+    for (std::uint64_t i = 0; i < used; ++i) {
+        std::uint64_t b, c;
+        if (!in.varint(b) || !in.varint(c) || b >= LengthHistogram::kBuckets) return false;
+        h.counts[b] += c;
+    }
+    return true;
+}
+
+// Configuration bits that change what the saved counts mean.
+static std::uint64_t state_flags(const Config& conf) {
+    return (conf.case_sensitive ? 1u : 0u) | (conf.count_only ? 2u : 0u) | (conf.utf8 ? 4u : 0u) |
+           (conf.rules ? conf.rules->fingerprint() << 8 : 0);
+}
+
+struct ScanState
+{
+    std::uint64_t flags = 0;
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::uint64_t offset = 0;
+    std::uint64_t prefix_hash = 0;
+};
+
+static void save_state(const std::string& path, const ScanState& ss, const Stats& st, const Tokenizer& tok) {
+    std::string out(kStateMagic, sizeof(kStateMagic));
+    put_varint(out, ss.flags);
+    put_varint(out, ss.device);
+    put_varint(out, ss.inode);
+    put_varint(out, ss.offset);
+    for (unsigned i = 0; i < 8; ++i) out.push_back(static_cast<char>(ss.prefix_hash >> (8 * i)));
+    put_varint(out, st.lines);
+    put_varint(out, st.words);
+    put_varint(out, tok.line_open);
+    put_varint(out, tok.prev_word);
+    put_varint(out, tok.token.size());
+    out += tok.token;
+    // An incomplete UTF-8 sequence at the end is rescanned, so it is not part of the line yet.
+    put_varint(out, tok.line_carry - tok.pending_bytes());
+    put_histogram(out, st.lengths.line);
+    put_histogram(out, st.lengths.word);
+    put_varint(out, st.freq.size());
+    for (const auto& [w, c] : st.freq) {
+        put_varint(out, w.size());
+        out.append(w.data(), w.size());
+        put_varint(out, c);
+    }
+
+    // Write to a temporary file and rename it over the old state, so a crash never
+    // leaves a half-written index behind.
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.write(out.data(), static_cast<std::streamsize>(out.size()))) {
+            throw std::runtime_error("Cannot write state file: " + tmp);
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        throw std::runtime_error("Cannot replace state file " + path + ": " + ec.message());
+    }
+}
+
+// Load a saved state into `ss`, `st` and `tok`. Returns false (leaving them untouched)
+// if the file is missing or malformed.
+static bool load_state(const std::string& path, ScanState& ss, Stats& st, Tokenizer& tok) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    std::string buf((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (buf.size() < sizeof(kStateMagic) + 8 || buf.compare(0, sizeof(kStateMagic), kStateMagic, sizeof(kStateMagic)) != 0) {
+        return false;
+    }
+
+    ByteReader in{buf.data() + sizeof(kStateMagic), buf.data() + buf.size()};
+    ScanState s;
+    Stats loaded;
+    std::uint64_t line_open, prev_word, token_len, line_carry, entries;
+    std::string_view hash_bytes_le, token;
+    if (!in.varint(s.flags) || !in.varint(s.device) || !in.varint(s.inode) || !in.varint(s.offset) ||
+        !in.bytes(8, hash_bytes_le) || !in.varint(loaded.lines) || !in.varint(loaded.words) ||
+        !in.varint(line_open) || !in.varint(prev_word) || !in.varint(token_len) || !in.bytes(token_len, token) ||
+        !in.varint(line_carry) || !get_histogram(in, loaded.lengths.line) || !get_histogram(in, loaded.lengths.word) ||
+        !in.varint(entries)) {
+        return false;
+    }
+    for (unsigned i = 0; i < 8; ++i) {
+        s.prefix_hash |= static_cast<std::uint64_t>(static_cast<unsigned char>(hash_bytes_le[i])) << (8 * i);
+    }
+    loaded.freq.reserve(static_cast<std::size_t>(std::min<std::uint64_t>(entries, buf.size())));
+    for (std::uint64_t i = 0; i < entries; ++i) {
+        std::uint64_t len, count;
+        std::string_view w;
+        if (!in.varint(len) || !in.bytes(len, w) || !in.varint(count)) return false;
+        loaded.freq[w] += count;
+    }
+
+    ss = s;
+    st = std::move(loaded);
+    tok.reset();
+    tok.token.assign(token.data(), token.size());
+    tok.line_open = line_open != 0;
+    tok.prev_word = prev_word != 0;
+    tok.line_carry = line_carry;
+    return true;
+}
+
+// Incremental analysis: resume from the state at conf.state_path (if it still describes
+// this file), scan only the bytes appended since, then save the new state. `note`
+// receives a one-line description of what happened.
+[[maybe_unused]] static Stats analyze_incremental(const Config& conf, const std::string& path, std::string& note, Profile* prof) {
+    StageTimer timer(prof);
+    Stats st;
+    Tokenizer tok(conf, st);
+    auto in = std::make_unique<InputFile>(path);
+    if (conf.decompress && in->mapped() &&
+        detect_codec(std::string_view(in->data(), std::min<std::size_t>(in->size(), 16))) != Codec::None) {
+        throw std::runtime_error("--state does not support compressed input: " + path);
+    }
+    timer.lap("open");
+
+    ScanState ss;
+    bool resumed = load_state(conf.state_path, ss, st, tok);
+    if (!resumed) {
+        note = "new index";
+    } else if (ss.flags != state_flags(conf)) {
+        note = "rebuilt (options changed)";
+    } else if (ss.device != in->device() || ss.inode != in->inode()) {
+        note = "rebuilt (file replaced)";
+    } else {
+        note.clear();
+    }
+    if (!note.empty()) {
+        st = Stats();
+        tok.reset();
+        ss.offset = 0;
+    }
+    timer.lap("load");
+
+    std::string prefix;             // First kStatePrefixBytes bytes of the file
+    std::uint64_t total = 0;        // Bytes of the file seen by this run, skipped or scanned
+    if (in->mapped()) {
+        const std::size_t size = in->size();
+        prefix.assign(in->data(), std::min(size, kStatePrefixBytes));
+        std::size_t check = static_cast<std::size_t>(std::min<std::uint64_t>(ss.offset, kStatePrefixBytes));
+        if (note.empty() && (size < ss.offset || hash_bytes(in->data(), check) != ss.prefix_hash)) {
+            note = size < ss.offset ? "rebuilt (file truncated)" : "rebuilt (file rewritten)";
+            st = Stats();
+            tok.reset();
+            ss.offset = 0;
+        }
+        tok.feed(in->data() + ss.offset, size - static_cast<std::size_t>(ss.offset));
+        total = size;
+        st.bytes_source = ByteSource::Mapped;
+    } else {
+        // Unmappable file: read and discard the already-scanned bytes, checking the prefix
+        // on the way. If the check fails, reopen and rescan from the start.
+        std::vector<char> buf(kReadBufferSize);
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            std::uint64_t skip = ss.offset;
+            total = 0;
+            prefix.clear();
+            bool ok = true;
+            while (std::size_t n = in->read_some(buf.data(), buf.size())) {
+                timer.lap("read");
+                if (prefix.size() < kStatePrefixBytes) prefix.append(buf.data(), std::min(n, kStatePrefixBytes - prefix.size()));
+                std::size_t drop = static_cast<std::size_t>(std::min<std::uint64_t>(skip, n));
+                skip -= drop;
+                total += n;
+                if (drop > 0 && skip == 0 &&
+                    hash_bytes(prefix.data(), std::min<std::size_t>(ss.offset, prefix.size())) != ss.prefix_hash) {
+                    ok = false;
+                    note = "rebuilt (file rewritten)";
+                    break;
+                }
+                tok.feed(buf.data() + drop, n - drop);
+                timer.lap("tokenize");
+            }
+            if (ok && skip > 0) {
+                ok = false;
+                note = "rebuilt (file truncated)";
+            }
+            if (ok) break;
+            st = Stats();
+            tok.reset();
+            ss.offset = 0;
+            in = std::make_unique<InputFile>(path);
+        }
+        st.bytes_source = ByteSource::Streamed;
+    }
+    timer.lap("tokenize");
+    st.bytes = total;
+    if (note.empty()) {
+        note = "resumed at byte " + std::to_string(ss.offset) + " (" + std::to_string(total - ss.offset) + " new bytes)";
+    }
+
+    // Save before finishing: the open line and partial word are carried, not counted.
+    ScanState next;
+    next.flags = state_flags(conf);
+    next.device = in->device();
+    next.inode = in->inode();
+    // An incomplete UTF-8 sequence at the end is scanned again by the next run.
+    next.offset = total - tok.pending_bytes();
+    next.prefix_hash = hash_bytes(prefix.data(), static_cast<std::size_t>(std::min<std::uint64_t>(next.offset, prefix.size())));
+    save_state(conf.state_path, next, st, tok);
+    timer.lap("save");
+
+    tok.finish();
+    return st;
+}
+
+[[maybe_unused]] static Stats analyze_file(const Config& conf, Profile* prof = nullptr) {
+    return analyze_file(conf, conf.input_path, prof);
+}
+
+// Ranked (word, count) list; the words are views into the table they were selected from.
+using TopList = std::vector<std::pair<std::string_view, std::uint64_t>>;
+
+// Ranking order for top-K: higher count first, then lexicographic by word.
+static inline bool ranks_before(const TopList::value_type& a, const TopList::value_type& b) {
+    if (a.second != b.second) return a.second > b.second;
+    return a.first < b.first;
+}
+
+// Return the top-K (word, count) pairs by frequency (desc), breaking ties by word (asc).
+// A bounded heap of K views is kept, worst candidate at the front, so selection is
+// O(n log K) and no key is copied; the views stay valid as long as `freq` does.
+// The result is built in `heap`, whose capacity is reused.
+static void top_k(const WordTable& freq, std::size_t k, TopList& heap) {
+    heap.clear();
+    if (k == 0) return;
+    heap.reserve(std::min(k, freq.size()));
+    for (const auto& entry : freq) {
+        if (heap.size() < k) {
+            heap.push_back(entry);
+            std::push_heap(heap.begin(), heap.end(), ranks_before);
+        } else if (ranks_before(entry, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), ranks_before);
+            heap.back() = entry;
+            std::push_heap(heap.begin(), heap.end(), ranks_before);
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), ranks_before);
+}
+
+static TopList top_k(const WordTable& freq, std::size_t k) {
+    TopList heap;
+    top_k(freq, k, heap);
+    return heap;
+}
+
+// Top-K of a whole result. Shards hold disjoint words, so the global top-K is among the
+// per-shard top-Ks, which are selected by up to `threads` threads and then combined.
+[[maybe_unused]] static TopList top_k(const Stats& st, std::size_t k, unsigned threads) {
+    if (st.shards.empty()) return top_k(st.freq, k);
+    std::vector<TopList> part(st.shards.size());
+    unsigned n = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, part.size())));
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < n; ++t) {
+        workers.emplace_back([&, t] {
+            for (std::size_t sh = t; sh < part.size(); sh += n) part[sh] = top_k(st.shards[sh], k);
+        });
+    }
+    for (auto& w : workers) w.join();
+    TopList all;
+    for (const TopList& p : part) all.insert(all.end(), p.begin(), p.end());
+    std::size_t keep = std::min(k, all.size());
+    std::partial_sort(all.begin(), all.begin() + static_cast<std::ptrdiff_t>(keep), all.end(), ranks_before);
+    all.resize(keep);
+    return all;
+}
+
+// Top n-grams decoded to text: their words joined by single spaces.
+using NgramList = std::vector<std::pair<std::string, std::uint64_t>>;
+
+// The text of an n-gram: its words joined by single spaces.
+template <class Key>
+static std::string ngram_text(const NgramCounts& ng, const Key& key) {
+    std::string text;
+    for (unsigned shift = 32 * (ng.n - 1);; shift -= 32) {
+        text += ng.words[ngram_id(key, shift)];
+        if (shift == 0) return text;
+        text += ' ';
+    }
+}
+
+// Ranking order for top n-grams: higher count first, then by text. The words are
+// compared one by one without joining them; where one is a prefix of the other, the
+// byte after it in the text is the ' ' separator (or the end), which is compared with
+// the longer word's next byte. Only if that byte is ' ' too (--word-chars can allow it)
+// are the texts joined.
+template <class Key>
+static bool ngram_ranks_before(const NgramCounts& ng, const typename NgramTable<Key>::Slot& a,
+                               const typename NgramTable<Key>::Slot& b) {
+    if (a.count != b.count) return a.count > b.count;
+    for (unsigned shift = 32 * (ng.n - 1);; shift -= 32) {
+        std::string_view wa = ng.words[ngram_id(a.key, shift)];
+        std::string_view wb = ng.words[ngram_id(b.key, shift)];
+        if (wa == wb) {
+            if (shift == 0) return false;
+            continue;
+        }
+        std::size_t m = std::min(wa.size(), wb.size());
+        if (int c = wa.substr(0, m).compare(wb.substr(0, m))) return c < 0;
+        if (shift == 0) return wa.size() < wb.size();   // The shorter text ends first
+        unsigned char next = static_cast<unsigned char>(wa.size() < wb.size() ? wb[m] : wa[m]);
+        if (next != ' ') return (wa.size() < wb.size()) == (' ' < next);
+        return ngram_text(ng, a.key) < ngram_text(ng, b.key);
+    }
+}
+
+// Bounded-heap selection as in top_k, over packed keys; only the K winners are decoded.
+template <class Key>
+static NgramList top_ngrams(const NgramCounts& ng, const NgramTable<Key>& table, std::size_t k) {
+    using Slot = typename NgramTable<Key>::Slot;
+    auto before = [&](const Slot& a, const Slot& b) { return ngram_ranks_before<Key>(ng, a, b); };
+    std::vector<Slot> heap;
+    heap.reserve(std::min(k, table.size()));
+    if (k > 0) {
+        for (const Slot& s : table.slots()) {
+            if (s.count == 0) continue;
+            if (heap.size() < k) {
+                heap.push_back(s);
+                std::push_heap(heap.begin(), heap.end(), before);
+            } else if (before(s, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), before);
+                heap.back() = s;
+                std::push_heap(heap.begin(), heap.end(), before);
+            }
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), before);
+
+    NgramList out;
+    out.reserve(heap.size());
+    for (const Slot& s : heap) out.emplace_back(ngram_text(ng, s.key), s.count);
+    return out;
+}
+
+[[maybe_unused]] static NgramList top_ngrams(const NgramCounts& ng, std::size_t k) {
+    return ng.n == 2 ? top_ngrams(ng, ng.pairs, k) : top_ngrams(ng, ng.wide, k);
+}
+
+// "bigrams", "trigrams" or "4-grams".
+static std::string ngram_name(unsigned n) {
+    return n == 2 ? "bigrams" : n == 3 ? "trigrams" : std::to_string(n) + "-grams";
+}
+
+// ---- Library API (file_stats.h) -------------------------------------------------
+
+namespace file_stats
+{
+
+struct Analyzer::Impl
+{
+    Config conf;
+    Stats st;
+    Tokenizer tok;
+
+    static Config make_config(const Options& o) {
+        Config c;
+        c.case_sensitive = o.case_sensitive;
+        c.utf8 = o.utf8;
+        c.count_only = o.count_only;
+        c.simd = o.simd;
+        return c;
+    }
+
+    explicit Impl(const Options& o) : conf(make_config(o)), tok(conf, st) {}
+};
+
+Analyzer::Analyzer(const Options& options) : impl_(std::make_unique<Impl>(options)) {}
+Analyzer::~Analyzer() = default;
+Analyzer::Analyzer(Analyzer&&) noexcept = default;
+Analyzer& Analyzer::operator=(Analyzer&&) noexcept = default;
+
+void Analyzer::feed(const char* data, std::size_t size) {
+    impl_->tok.feed(data, size);
+    impl_->st.bytes += size;
+}
+
+void Analyzer::finish() {
+    impl_->tok.finish();
+}
+
+void Analyzer::reset() {
+    Stats& st = impl_->st;
+    st.lines = st.words = st.bytes = 0;
+    st.lengths = Lengths();
+    st.freq.clear();
+    impl_->tok.reset();
+}
+
+std::uint64_t Analyzer::lines() const { return impl_->st.lines; }
+std::uint64_t Analyzer::words() const { return impl_->st.words; }
+std::uint64_t Analyzer::bytes() const { return impl_->st.bytes; }
+std::size_t Analyzer::distinct() const { return impl_->st.freq.size(); }
+
+void Analyzer::top(std::size_t k, std::vector<WordCount>& out) const {
+    top_k(impl_->st.freq, k, out);
+}
+
+void Analyzer::for_each(const std::function<void(std::string_view, std::uint64_t)>& fn) const {
+    for (const auto& [w, c] : impl_->st.freq) fn(w, c);
+}
+
+} // namespace file_stats
+
+// Produce an ISO 8601 UTC timestamp string (e.g., "2025-09-22T17:03:00Z").
+static std::string iso8601_utc_now() {
+    using namespace std::chrono;
+    auto now = system_clock::now();
+    auto t = system_clock::to_time_t(now);
+    std::tm tm{};
+#if defined(_WIN32)
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    std::ostringstream oss;
+    oss << std::put_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
+    return oss.str();
+}
+
+// A JSON string body, escaped as it is written (see JsonWriter).
+struct JsonEscaped
+{
+    std::string_view text;
+};
+
+// Buffered JSON output: text accumulates in one preallocated buffer that is written
+// to the file in large blocks. Integers are formatted with std::to_chars and strings
+// are escaped in place, so no per-value temporaries are created.
+class JsonWriter
+{
+public:
+    // With `append`, records are added to the end of an existing file.
+    explicit JsonWriter(const std::string& path, bool append = false)
+        : path_(path), out_(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc)) {
+        if (!out_) {
+            throw std::runtime_error("Cannot write JSON file: " + path);
+        }
+        buf_.reserve(kBufferSize + kSlack);
+    }
+
+    ~JsonWriter() {
+        if (out_.is_open()) {
+            out_.write(buf_.data(), static_cast<std::streamsize>(buf_.size()));
+        }
+    }
+
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    JsonWriter& operator<<(std::string_view text) {
+        buf_.append(text.data(), text.size());
+        return spill();
+    }
+
+    JsonWriter& operator<<(const char* text) { return *this << std::string_view(text); }
+
+    JsonWriter& operator<<(char c) {
+        buf_.push_back(c);
+        return spill();
+    }
+
+    template <class T, std::enable_if_t<std::is_integral_v<T>, int> = 0>
+    JsonWriter& operator<<(T v) {
+        char tmp[24];
+        auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        buf_.append(tmp, static_cast<std::size_t>(res.ptr - tmp));
+        return spill();
+    }
+
+    // Same text as std::ostream's default formatting (%g, six significant digits).
+    JsonWriter& operator<<(double v) {
+        char tmp[32];
+        int n = std::snprintf(tmp, sizeof(tmp), "%g", v);
+        buf_.append(tmp, static_cast<std::size_t>(n));
+        return spill();
+    }
+
+    // Escape quotes, backslashes and control chars; clean runs are copied in one piece.
+    JsonWriter& operator<<(JsonEscaped e) {
+        std::string_view s = e.text;
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < s.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            buf_.append(s.data() + run, i - run);
+            run = i + 1;
+            switch (c) {
+                case '"': buf_ += "\\\""; break;
+                case '\\': buf_ += "\\\\"; break;
+                case '\b': buf_ += "\\b"; break;
+                case '\f': buf_ += "\\f"; break;
+                case '\n': buf_ += "\\n"; break;
+                case '\r': buf_ += "\\r"; break;
+                case '\t': buf_ += "\\t"; break;
+                default: { // Other control characters → \u00XX
+                    static const char kHex[] = "0123456789abcdef";
+                    char u[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 15]};
+                    buf_.append(u, sizeof(u));
+                }
+            }
+        }
+        buf_.append(s.data() + run, s.size() - run);
+        return spill();
+    }
+
+    // Write out everything buffered and report any I/O error.
+    void close() {
+        out_.write(buf_.data(), static_cast<std::streamsize>(buf_.size()));
+        buf_.clear();
+        out_.close();
+        if (!out_) throw std::runtime_error("Error writing JSON file: " + path_);
+    }
+
+private:
+    static constexpr std::size_t kBufferSize = 1 << 20; // 1 MB
+    static constexpr std::size_t kSlack = 4096;         // Room for one value past the flush mark
+
+    JsonWriter& spill() {
+        if (buf_.size() >= kBufferSize) {
+            out_.write(buf_.data(), static_cast<std::streamsize>(buf_.size()));
+            buf_.clear();
+        }
+        return *this;
+    }
+
+    std::string path_;
+    std::ofstream out_;
+    std::string buf_;
+};
+
+// Write the elements of a "top_words" array, one object per line at `indent`.
+static void write_top_words(JsonWriter& out, const TopList& top, const std::vector<std::uint64_t>& top_error,
+                            const char* indent) {
+    for (std::size_t i = 0; i < top.size(); ++i) {
+        out << indent << "{ \"word\": \"" << JsonEscaped{top[i].first} << "\", \"count\": " << top[i].second;
+        if (!top_error.empty()) out << ", \"error\": " << top_error[i];
+        out << " }";
+        if (i + 1 < top.size()) out << ",";
+        out << "\n";
+    }
+}
+
+// NDJSON form of write_top_words: one record per line.
+static void write_top_words_ndjson(JsonWriter& out, const TopList& top, const std::vector<std::uint64_t>& top_error) {
+    for (std::size_t i = 0; i < top.size(); ++i) {
+        out << "{\"type\": \"word\", \"rank\": " << i + 1 << ", \"word\": \"" << JsonEscaped{top[i].first}
+            << "\", \"count\": " << top[i].second;
+        if (!top_error.empty()) out << ", \"error\": " << top_error[i];
+        out << "}\n";
+    }
+}
+
+// Write the elements of a "top_ngrams" array (or, with `nd`, one "ngram" record per line).
+static void write_top_ngrams(JsonWriter& out, const NgramList& top, bool nd) {
+    for (std::size_t i = 0; i < top.size(); ++i) {
+        if (nd) {
+            out << "{\"type\": \"ngram\", \"rank\": " << i + 1 << ", \"ngram\": \"" << JsonEscaped{top[i].first}
+                << "\", \"count\": " << top[i].second << "}\n";
+        } else {
+            out << "    { \"ngram\": \"" << JsonEscaped{top[i].first} << "\", \"count\": " << top[i].second << " }"
+                << (i + 1 < top.size() ? ",\n" : "\n");
+        }
+    }
+}
+
+// Write `"line_length": {...}, "word_length": {...}` (on one line, no trailing comma).
+static void write_lengths_json(JsonWriter& out, const LengthSummary& line, const LengthSummary& word) {
+    const char* names[2] = {"line_length", "word_length"};
+    const LengthSummary* sums[2] = {&line, &word};
+    for (int i = 0; i < 2; ++i) {
+        const LengthSummary& s = *sums[i];
+        out << (i ? ", " : "") << "\"" << names[i] << "\": { \"count\": " << s.count << ", \"mean\": " << s.mean
+            << ", \"p50\": " << s.p50 << ", \"p90\": " << s.p90 << ", \"p99\": " << s.p99 << ", \"max\": " << s.max
+            << " }";
+    }
+}
+
+// Write the "profile" object (without trailing comma or newline) at two-space indent.
+// The "profile" member of the JSON report; `pretty` false keeps it on one line (NDJSON).
+static void write_profile_json(JsonWriter& out, const Profile& prof, const Stats& st, const char* kernel,
+                               bool pretty = true) {
+    double scan = prof.wall("open") + prof.wall("read") + prof.wall("tokenize") + prof.wall("merge");
+    if (!prof.device.name.empty()) kernel = "cuda";
+    const char* sep = pretty ? ",\n    " : ", ";
+    out << (pretty ? "  \"profile\": {\n    " : "\"profile\": {");
+    out << "\"stages\": [";
+    for (std::size_t i = 0; i < prof.stages.size(); ++i) {
+        const Profile::Stage& s = prof.stages[i];
+        out << (i ? ", " : "") << "{ \"name\": \"" << s.name << "\", \"wall_s\": " << s.wall << ", \"cpu_s\": " << s.cpu << " }";
+    }
+    out << "]" << sep;
+    out << "\"bytes_per_sec\": " << (scan > 0 ? st.bytes / scan : 0.0) << sep;
+    out << "\"tokens\": " << st.words << sep;
+    out << "\"distinct\": " << distinct_words(st) << sep;
+    out << "\"rehashes\": " << table_rehashes(st) << sep;
+    out << "\"peak_rss_bytes\": " << peak_rss_bytes() << sep;
+    out << "\"kernel\": \"" << kernel << "\"" << sep;
+    if (prof.expected_source) {
+        out << "\"expected_unique\": { \"words\": " << prof.expected_unique << ", \"source\": \"" << prof.expected_source
+            << "\" }" << sep;
+    }
+    const HugePageUsage huge = huge_page_usage();
+    out << "\"huge_pages\": { \"mode\": \"" << huge_pages_name(g_huge_pages) << "\", \"large_bytes\": "
+        << g_large_allocs.live.load() << ", \"peak_large_bytes\": " << g_large_allocs.peak.load();
+    if (huge.known) out << ", \"transparent_bytes\": " << huge.transparent << ", \"hugetlb_bytes\": " << huge.hugetlb;
+    else out << ", \"transparent_bytes\": null, \"hugetlb_bytes\": null";
+    out << " }" << sep;
+    if (!prof.device.name.empty()) {
+        const DeviceUse& d = prof.device;
+        out << "\"device\": { \"name\": \"" << JsonEscaped{d.name} << "\", \"chunks\": " << d.chunks << ", \"bytes_in\": " << d.bytes_in << ", \"candidates\": " << d.candidates
+            << " }" << sep;
+    }
+    if (prof.placement.workers() > 0) {
+        const Placement& pl = prof.placement;
+        out << "\"placement\": { \"workers\": " << pl.workers() << ", \"pinned\": " << (pl.pinned() ? "true" : "false");
+        if (pl.pinned()) {
+            out << ", \"nodes\": [";
+            for (std::size_t i = 0; i < pl.groups.size(); ++i) {
+                const Placement::Group& g = pl.groups[i];
+                out << (i ? ", " : "") << "{ \"node\": " << g.node << ", \"workers\": " << g.cpus.size()
+                    << ", \"cpus\": \"" << format_cpu_list(g.cpus) << "\" }";
+            }
+            out << "]";
+        }
+        out << " }" << sep;
+    }
+    out << "\"counters\": {";
+    for (int i = 0; i < PerfCounters::kCount; ++i) {
+        out << (i ? ", " : " ") << "\"" << PerfCounters::kNames[i] << "\": ";
+        if (prof.counters.valid(i)) out << prof.counters.value(i);
+        else out << "null";
+    }
+    out << " }";
+    out << (pretty ? "\n  }" : "}");
+}
+
+// Serialize the Stats and top words to a JSON file.
+// `top_error` holds the per-word error bounds in approximate mode and is empty otherwise.
+// With --ndjson the same members go on one "summary" line, followed by one "word"
+// line per top word (and one "ngram" line per top n-gram).
+static void write_json(const Config& conf, const Stats& st, const TopList& top,
+                       const std::vector<std::uint64_t>& top_error, const Profile* prof = nullptr,
+                       const NgramList& top_ngrams = NgramList()) {
+    JsonWriter out(conf.json_path);
+    const bool nd = conf.ndjson;
+    const char* open = nd ? "" : "  ";        // Before each member
+    const char* next = nd ? ", " : ",\n";     // Between members
+
+    out << (nd ? "{\"type\": \"summary\", " : "{\n");
+    out << open << "\"tool\": \"file-stats\"" << next;
+    out << open << "\"timestamp\": \"" << iso8601_utc_now() << "\"" << next;
+    out << open << "\"input_path\": \"" << JsonEscaped{conf.input_path} << "\"" << next;
+    out << open << "\"lines\": " << st.lines << next;
+    out << open << "\"words\": " << st.words << next;
+    out << open << "\"bytes\": " << st.bytes << next;
+    out << open << "\"bytes_source\": \"" << byte_source_name(st.bytes_source) << "\"" << next;
+    if (st.codec) {
+        out << open << "\"codec\": \"" << st.codec << "\"" << next;
+        out << open << "\"compressed_bytes\": " << st.compressed_bytes << next;
+    }
+    if (!conf.count_only) {
+        out << open;
+        write_lengths_json(out, summarize(st.lengths.line), summarize(st.lengths.word));
+        out << next;
+    }
+    out << open << "\"case_sensitive\": " << (conf.case_sensitive ? "true" : "false");
+    if (st.sketch) {
+        out << next << open << "\"approximate\": { \"algorithm\": \"space-saving\", \"counters\": "
+            << st.sketch->capacity() << ", \"min_count\": " << st.sketch->min_count() << " }";
+    }
+    if (st.ngrams) out << next << open << "\"ngram\": " << st.ngrams->n;
+    if (!nd) {
+        out << next << open << "\"top_words\": [\n";
+        write_top_words(out, top, top_error, "    ");
+        out << "  ]";
+        if (st.ngrams) {
+            out << next << open << "\"top_ngrams\": [\n";
+            write_top_ngrams(out, top_ngrams, false);
+            out << "  ]";
+        }
+    }
+    if (prof) {
+        out << next;
+        write_profile_json(out, *prof, st, conf.simd ? scan_kernel().name : "scalar", !nd);
+    }
+    out << (nd ? "}\n" : "\n}\n");
+    if (nd) {
+        write_top_words_ndjson(out, top, top_error);
+        write_top_ngrams(out, top_ngrams, true);
+    }
+    out.close();
+}
+
+// Print the Lines/Words/Bytes block of the human-readable report.
+static void print_counts(const Stats& st) {
+    std::cout << "Lines:  " << st.lines << "\n";
+    std::cout << "Words:  " << st.words << "\n";
+    std::cout << "Bytes:  " << st.bytes << " (" << byte_source_name(st.bytes_source);
+    if (st.codec) std::cout << " " << st.codec << ", " << st.compressed_bytes << " compressed";
+    std::cout << ")\n";
+}
+
+// Print the "Top N words" block of the human-readable report (nothing in counts-only mode).
+static void print_top(const Config& conf, const TopList& top, const std::vector<std::uint64_t>& top_error) {
+    if (conf.count_only) return;
+    std::cout << "Top " << top.size() << " words"
+              << (conf.case_sensitive ? " (case-sensitive)" : " (case-insensitive)")
+              << (conf.approx ? " (approximate: true count in [count - error, count])" : "")
+              << ":\n";
+
+    for (std::size_t i = 0; i < top.size(); ++i) {
+        std::cout << "  " << std::setw(8) << top[i].second << "  " << top[i].first;
+        if (!top_error.empty()) std::cout << "  (error " << top_error[i] << ")";
+        std::cout << "\n";
+    }
+}
+
+// Print the "Top N bigrams" (etc.) block of the human-readable report.
+[[maybe_unused]] static void print_top_ngrams(const Config& conf, const NgramList& top) {
+    std::cout << "Top " << top.size() << " " << ngram_name(conf.ngram)
+              << (conf.case_sensitive ? " (case-sensitive)" : " (case-insensitive)") << ":\n";
+    for (const auto& [text, count] : top) {
+        std::cout << "  " << std::setw(8) << count << "  " << text << "\n";
+    }
+}
+
+// Print the --profile section of the human-readable report.
+static void print_profile(const Profile& prof, const Stats& st, const char* kernel) {
+    double scan = prof.wall("open") + prof.wall("read") + prof.wall("tokenize") + prof.wall("merge");
+    if (!prof.device.name.empty()) kernel = "cuda";
+    std::cout << "\nProfile:\n";
+    std::cout << "  " << std::left << std::setw(10) << "stage" << std::right << std::setw(11) << "wall_s"
+              << std::setw(11) << "cpu_s" << "\n";
+    for (const Profile::Stage& s : prof.stages) {
+        std::cout << "  " << std::left << std::setw(10) << s.name << std::right << std::fixed << std::setprecision(6)
+                  << std::setw(11) << s.wall << std::setw(11) << s.cpu << "\n";
+    }
+    std::cout << std::setprecision(1);
+    std::cout << "  Throughput:    " << (scan > 0 ? st.bytes / scan / 1e6 : 0.0) << " MB/s (" << kernel << " kernel)\n";
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << std::setprecision(6);
+    std::cout << "  Tokens:        " << st.words << " (" << distinct_words(st) << " distinct, "
+              << table_rehashes(st) << " rehashes)\n";
+    std::cout << "  Peak RSS:      " << peak_rss_bytes() / 1024 << " KB\n";
+    if (prof.expected_source) {
+        std::cout << "  Pre-sized:     " << prof.expected_unique << " distinct words expected ("
+                  << (std::strcmp(prof.expected_source, "sample") == 0 ? "HyperLogLog sample" : "--expected-unique")
+                  << ")\n";
+    }
+    const HugePageUsage huge = huge_page_usage();
+    std::cout << "  Huge pages:    " << huge_pages_name(g_huge_pages) << ", ";
+    if (huge.known) {
+        std::cout << (huge.transparent + huge.hugetlb) / 1024 << " KB obtained";
+        if (huge.hugetlb) std::cout << " (" << huge.hugetlb / 1024 << " KB hugetlb)";
+    } else {
+        std::cout << "obtained size unknown";
+    }
+    std::cout << " of " << g_large_allocs.live / 1024 << " KB in large blocks (peak " << g_large_allocs.peak / 1024
+              << " KB)\n";
+    if (!prof.device.name.empty()) {
+        const DeviceUse& d = prof.device;
+        std::cout << "  Device:        " << d.name << ", " << d.chunks << " chunk" << (d.chunks == 1 ? "" : "s") << ", "
+                  << d.bytes_in / 1024 << " KB in, " << d.candidates << " top-K candidates out\n";
+    }
+    if (prof.placement.workers() > 0) {
+        const Placement& pl = prof.placement;
+        std::cout << "  Placement:     " << pl.workers() << " workers";
+        if (pl.pinned()) {
+            std::cout << " pinned on " << pl.groups.size() << " NUMA node" << (pl.groups.size() > 1 ? "s" : "") << " (";
+            for (std::size_t i = 0; i < pl.groups.size(); ++i) {
+                const Placement::Group& g = pl.groups[i];
+                std::cout << (i ? "; " : "") << "node " << g.node << ": " << g.cpus.size() << " on CPUs "
+                          << format_cpu_list(g.cpus);
+            }
+            std::cout << ")\n";
+        } else {
+            std::cout << ", unpinned\n";
+        }
+    }
+    for (int i = 0; i < PerfCounters::kCount; ++i) {
+        std::cout << "  " << std::left << std::setw(15) << (std::string(PerfCounters::kNames[i]) + ":") << std::right;
+        if (prof.counters.valid(i)) std::cout << prof.counters.value(i) << "\n";
+        else std::cout << "unavailable\n";
+    }
+}
+
+// ---- Frequency snapshots -------------------------------------------------------
+//
+// A snapshot is a complete word table laid out for direct use from an mmap: all
+// integers are native 64-bit words, and entries are sorted by word (bytewise), so
+// merging snapshots is a streaming k-way merge with no parsing or hashing.
+//   header:  magic "FSSNAP01" | byte_order | entries N | lines | words | bytes | flags | blob_bytes
+//   offsets: N + 1 word start offsets into the blob (offsets[N] == blob_bytes)
+//   counts:  N counts
+//   blob:    the concatenated word bytes
+
+static constexpr char kSnapshotMagic[8] = {'F', 'S', 'S', 'N', 'A', 'P', '0', '1'};
+static constexpr std::uint64_t kSnapshotByteOrder = 0x0102030405060708ull;
+static constexpr std::size_t kSnapshotHeaderWords = 8;   // Including the magic
+
+static inline std::uint64_t load_u64(const char* p) {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Write a snapshot from (word, count) entries already sorted by word.
+template <class Entries>
+static void write_snapshot_sorted(const std::string& path, const Entries& entries, std::uint64_t lines,
+                                  std::uint64_t words, std::uint64_t bytes, bool case_sensitive) {
+    std::vector<std::uint64_t> head(kSnapshotHeaderWords - 1);
+    std::vector<std::uint64_t> offsets, counts;
+    offsets.reserve(entries.size() + 1);
+    counts.reserve(entries.size());
+    std::uint64_t blob = 0;
+    for (const auto& e : entries) {
+        offsets.push_back(blob);
+        counts.push_back(e.second);
+        blob += e.first.size();
+    }
+    offsets.push_back(blob);
+    head = {kSnapshotByteOrder, counts.size(), lines, words, bytes, case_sensitive ? 1u : 0u, blob};
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Cannot write snapshot: " + path);
+    }
+    out.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+    out.write(reinterpret_cast<const char*>(head.data()), static_cast<std::streamsize>(head.size() * 8));
+    out.write(reinterpret_cast<const char*>(offsets.data()), static_cast<std::streamsize>(offsets.size() * 8));
+    out.write(reinterpret_cast<const char*>(counts.data()), static_cast<std::streamsize>(counts.size() * 8));
+    for (const auto& e : entries) out.write(e.first.data(), static_cast<std::streamsize>(e.first.size()));
+    if (!out) {
+        throw std::runtime_error("Cannot write snapshot: " + path);
+    }
+}
+
+static void write_snapshot(const std::string& path, const Stats& st, bool case_sensitive) {
+    TopList entries(st.freq.begin(), st.freq.end());
+    for (const WordTable& t : st.shards) entries.insert(entries.end(), t.begin(), t.end());
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    write_snapshot_sorted(path, entries, st.lines, st.words, st.bytes, case_sensitive);
+}
+
+// Read-only view of a snapshot file, memory-mapped when possible.
+class Snapshot
+{
+public:
+    explicit Snapshot(const std::string& path) : path_(path), file_(path) {
+        if (file_.mapped()) {
+            base_ = file_.data();
+            size_ = file_.size();
+        } else {
+            // Not mappable (e.g. a pipe): fall back to a private copy.
+            std::vector<char> chunk(kReadBufferSize);
+            while (std::size_t n = file_.read_some(chunk.data(), chunk.size())) copy_.insert(copy_.end(), chunk.begin(), chunk.begin() + n);
+            base_ = copy_.data();
+            size_ = copy_.size();
+        }
+        const std::size_t head = kSnapshotHeaderWords * 8;
+        if (size_ < head || std::memcmp(base_, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+            load_u64(base_ + 8) != kSnapshotByteOrder) {
+            throw std::runtime_error("Not a file_stats snapshot (or wrong byte order): " + path);
+        }
+        entries_ = load_u64(base_ + 16);
+        lines_ = load_u64(base_ + 24);
+        words_ = load_u64(base_ + 32);
+        bytes_ = load_u64(base_ + 40);
+        case_sensitive_ = load_u64(base_ + 48) & 1;
+        std::uint64_t blob = load_u64(base_ + 56);
+        offsets_ = base_ + head;
+        counts_ = offsets_ + (entries_ + 1) * 8;
+        blob_ = counts_ + entries_ * 8;
+        if (entries_ > size_ / 16 || static_cast<std::size_t>(blob_ - base_) > size_ ||
+            blob != size_ - static_cast<std::size_t>(blob_ - base_) || load_u64(offsets_) != 0 ||
+            load_u64(offsets_ + entries_ * 8) != blob) {
+            throw std::runtime_error("Corrupt snapshot: " + path);
+        }
+        // word() and kway_merge trust every entry, so check them all once here: offsets
+        // never decrease (hence stay within the blob) and words are strictly ascending.
+        for (std::size_t i = 0; i < entries_; ++i) {
+            if (load_u64(offsets_ + i * 8 + 8) < load_u64(offsets_ + i * 8) || (i > 0 && word(i - 1) >= word(i))) {
+                throw std::runtime_error("Corrupt snapshot: " + path);
+            }
+        }
+    }
+
+    std::size_t size() const { return static_cast<std::size_t>(entries_); }
+    std::string_view word(std::size_t i) const {
+        std::uint64_t b = load_u64(offsets_ + i * 8), e = load_u64(offsets_ + i * 8 + 8);
+        return std::string_view(blob_ + b, static_cast<std::size_t>(e - b));
+    }
+    std::uint64_t count(std::size_t i) const { return load_u64(counts_ + i * 8); }
+    std::uint64_t lines() const { return lines_; }
+    std::uint64_t words() const { return words_; }
+    std::uint64_t bytes() const { return bytes_; }
+    bool case_sensitive() const { return case_sensitive_; }
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    InputFile file_;
+    std::vector<char> copy_;
+    const char* base_ = nullptr;
+    std::size_t size_ = 0;
+    const char* offsets_ = nullptr;
+    const char* counts_ = nullptr;
+    const char* blob_ = nullptr;
+    std::uint64_t entries_ = 0, lines_ = 0, words_ = 0, bytes_ = 0;
+    bool case_sensitive_ = false;
+};
+
+// Fold sorted (word, count) streams into one ascending stream of distinct words with summed
+// counts; `emit(word, count)` is called once per distinct word. A min-heap holds one
+// cursor per input, ordered by its current word.
+template <class Emit>
+static void kway_merge(const std::vector<std::unique_ptr<Snapshot>>& snaps, Emit&& emit) {
+    using Cursor = std::pair<std::size_t, std::size_t>;  // (snapshot, entry)
+    auto later = [&](const Cursor& a, const Cursor& b) {
+        return snaps[a.first]->word(a.second) > snaps[b.first]->word(b.second);
+    };
+    std::vector<Cursor> heap;
+    for (std::size_t s = 0; s < snaps.size(); ++s) {
+        if (snaps[s]->size() > 0) heap.emplace_back(s, 0);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (!heap.empty()) {
+        std::string_view w = snaps[heap.front().first]->word(heap.front().second);
+        std::uint64_t total = 0;
+        while (!heap.empty() && snaps[heap.front().first]->word(heap.front().second) == w) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Cursor& c = heap.back();
+            total += snaps[c.first]->count(c.second);
+            if (++c.second < snaps[c.first]->size()) {
+                std::push_heap(heap.begin(), heap.end(), later);
+            } else {
+                heap.pop_back();
+            }
+        }
+        emit(w, total);
+    }
+}
+
+// `file_stats merge a.snap b.snap ...`: k-way merge of snapshots into one top-K.
+[[maybe_unused]] static int run_merge(int argc, char** argv) {
+    std::vector<std::string> inputs;
+    std::size_t topN = 20;
+    std::string json_path, out_snapshot;
+    bool ndjson = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--help" || a == "-h") {
+            print_help(argv[0]);
+            return 0;
+        } else if (a == "--top" && i + 1 < argc) {
+            topN = std::stoul(argv[++i]);
+        } else if (a == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (a == "--ndjson") {
+            ndjson = true;
+        } else if (a == "--snapshot" && i + 1 < argc) {
+            out_snapshot = argv[++i];
+        } else if (a[0] != '-') {
+            inputs.push_back(a);
+        } else {
+            std::cerr << "Unknown argument: " << a << "\n";
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+    if (inputs.empty()) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    try {
+        std::vector<std::unique_ptr<Snapshot>> snaps;
+        Stats st;
+        for (const std::string& path : inputs) {
+            snaps.push_back(std::make_unique<Snapshot>(path));
+            if (snaps.back()->case_sensitive() != snaps.front()->case_sensitive()) {
+                throw std::runtime_error("Cannot merge case-sensitive and case-insensitive snapshots: " + path);
+            }
+            st.lines += snaps.back()->lines();
+            st.words += snaps.back()->words();
+            st.bytes += snaps.back()->bytes();
+        }
+
+        // Same bounded-heap selection as top_k, fed by the merged stream.
+        TopList top, merged;
+        std::uint64_t distinct = 0;
+        kway_merge(snaps, [&](std::string_view w, std::uint64_t c) {
+            ++distinct;
+            if (!out_snapshot.empty()) merged.emplace_back(w, c);
+            if (topN == 0) return;
+            TopList::value_type e(w, c);
+            if (top.size() < topN) {
+                top.push_back(e);
+                std::push_heap(top.begin(), top.end(), ranks_before);
+            } else if (ranks_before(e, top.front())) {
+                std::pop_heap(top.begin(), top.end(), ranks_before);
+                top.back() = e;
+                std::push_heap(top.begin(), top.end(), ranks_before);
+            }
+        });
+        std::sort_heap(top.begin(), top.end(), ranks_before);
+
+        Config conf;
+        conf.topN = topN;
+        conf.count_only = topN == 0;
+        conf.case_sensitive = snaps.front()->case_sensitive();
+        std::cout << "Merged: " << snaps.size() << " snapshots, " << distinct << " distinct words\n";
+        std::cout << "Lines:  " << st.lines << "\n";
+        std::cout << "Words:  " << st.words << "\n";
+        std::cout << "Bytes:  " << st.bytes << "\n";
+        print_top(conf, top, {});
+
+        if (!out_snapshot.empty()) {
+            write_snapshot_sorted(out_snapshot, merged, st.lines, st.words, st.bytes, conf.case_sensitive);
+            std::cout << "\nSnapshot written to: " << out_snapshot << "\n";
+        }
+        if (!json_path.empty()) {
+            JsonWriter out(json_path);
+            const char* open = ndjson ? "" : "  ";
+            const char* next = ndjson ? ", " : ",\n";
+            out << (ndjson ? "{\"type\": \"summary\", " : "{\n");
+            out << open << "\"tool\": \"file-stats\"" << next;
+            out << open << "\"timestamp\": \"" << iso8601_utc_now() << "\"" << next;
+            out << open << "\"inputs\": [";
+            for (std::size_t i = 0; i < inputs.size(); ++i) out << (i ? ", " : "") << "\"" << JsonEscaped{inputs[i]} << "\"";
+            out << "]" << next;
+            out << open << "\"lines\": " << st.lines << next;
+            out << open << "\"words\": " << st.words << next;
+            out << open << "\"bytes\": " << st.bytes << next;
+            out << open << "\"distinct\": " << distinct << next;
+            out << open << "\"case_sensitive\": " << (conf.case_sensitive ? "true" : "false");
+            if (ndjson) {
+                out << "}\n";
+                write_top_words_ndjson(out, top, {});
+            } else {
+                out << next << open << "\"top_words\": [\n";
+                write_top_words(out, top, {}, "    ");
+                out << "  ]\n";
+                out << "}\n";
+            }
+            out.close();
+            std::cout << "\nJSON written to: " << json_path << "\n";
+        }
+        return 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 2;
+    }
+}
+
+// ---- Batch mode ----------------------------------------------------------------
+
+// A fixed set of task indices spread over per-worker deques. A worker pops from the
+// back of its own deque and, once that is empty, steals from the front of the others,
+// so a worker stuck on one huge file does not hold up the tasks queued behind it.
+class WorkStealingQueues
+{
+public:
+    explicit WorkStealingQueues(unsigned nworkers) : queues_(nworkers) {}
+
+    void push(unsigned worker, std::size_t task) {
+        std::lock_guard<std::mutex> lock(queues_[worker].m);
+        queues_[worker].tasks.push_back(task);
+    }
+
+    // Fetch the next task for `worker`. Returns false once every queue is empty.
+    bool pop(unsigned worker, std::size_t& task) {
+        {
+            Queue& q = queues_[worker];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (!q.tasks.empty()) {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+                return true;
+            }
+        }
+        for (std::size_t k = 1; k < queues_.size(); ++k) {
+            Queue& victim = queues_[(worker + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.m);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex m;
+        std::deque<std::size_t> tasks;
+    };
+    std::vector<Queue> queues_;
+};
+
+// Outcome for one file in batch mode. The per-file top-K is copied out so the file's
+// frequency table can be released (or merged) as soon as the file is done.
+struct FileResult
+{
+    std::uint64_t lines = 0;
+    std::uint64_t words = 0;
+    std::uint64_t bytes = 0;
+    ByteSource bytes_source = ByteSource::Streamed;
+    const char* codec = nullptr;
+    std::uint64_t compressed_bytes = 0;
+    LengthSummary line_length;
+    LengthSummary word_length;
+    std::vector<std::pair<std::string, std::uint64_t>> top;
+    std::string error;        // Non-empty if the file could not be analyzed
+};
+
+// Small files are grouped into one task until it holds this many bytes or files, so
+// that scheduling cost stays negligible next to the analysis itself.
+static constexpr std::uint64_t kBatchTaskBytes = 4 << 20; // 4 MB
+static constexpr std::size_t kBatchTaskFiles = 256;
+
+// Expand the command-line inputs, the --files-from list and (with --recursive) every
+// directory into the list of files to analyze. Directory contents are sorted by path.
+static std::vector<std::string> collect_inputs(const Config& conf) {
+    std::vector<std::string> paths = conf.inputs;
+    if (!conf.files_from.empty()) {
+        std::ifstream list_file;
+        if (!is_stdin_path(conf.files_from)) {
+            list_file.open(conf.files_from);
+            if (!list_file) {
+                throw std::runtime_error("Cannot open file list: " + conf.files_from);
+            }
+        }
+        std::istream& list = is_stdin_path(conf.files_from) ? std::cin : list_file;
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) paths.push_back(line);
+        }
+    }
+
+    std::vector<std::string> files;
+    for (const std::string& p : paths) {
+        std::error_code ec;
+        if (is_stdin_path(p) || !std::filesystem::is_directory(p, ec)) {
+            files.push_back(p);      // Missing files are reported per file later
+            continue;
+        }
+        if (!conf.recursive) {
+            throw std::runtime_error(p + " is a directory (use --recursive)");
+        }
+        std::vector<std::string> found;
+        auto opts = std::filesystem::directory_options::skip_permission_denied;
+        for (auto it = std::filesystem::recursive_directory_iterator(p, opts, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file(ec)) found.push_back(it->path().string());
+        }
+        if (ec) {
+            throw std::runtime_error("Cannot read directory " + p + ": " + ec.message());
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+static TopList as_top_list(const std::vector<std::pair<std::string, std::uint64_t>>& v) {
+    return TopList(v.begin(), v.end());
+}
+
+// With --ndjson: a "summary" line, one "file" line per input, a "total" line, and
+// then one "word" line per merged top word.
+static void write_batch_json(const Config& conf, const std::vector<std::string>& files,
+                             const std::vector<FileResult>& results, const Stats& total, const TopList& merged_top) {
+    JsonWriter out(conf.json_path);
+    const bool nd = conf.ndjson;
+
+    if (nd) {
+        out << "{\"type\": \"summary\", \"tool\": \"file-stats\", \"timestamp\": \"" << iso8601_utc_now()
+            << "\", \"case_sensitive\": " << (conf.case_sensitive ? "true" : "false") << "}\n";
+    } else {
+        out << "{\n";
+        out << "  \"tool\": \"file-stats\",\n";
+        out << "  \"timestamp\": \"" << iso8601_utc_now() << "\",\n";
+        out << "  \"case_sensitive\": " << (conf.case_sensitive ? "true" : "false") << ",\n";
+        out << "  \"files\": [\n";
+    }
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const FileResult& r = results[i];
+        out << (nd ? "{\"type\": \"file\", " : "    { ") << "\"input_path\": \"" << JsonEscaped{files[i]} << "\", ";
+        if (!r.error.empty()) {
+            out << "\"error\": \"" << JsonEscaped{r.error} << "\" }";
+        } else {
+            out << "\"lines\": " << r.lines << ", \"words\": " << r.words << ", \"bytes\": " << r.bytes
+                << ", \"bytes_source\": \"" << byte_source_name(r.bytes_source) << "\"";
+            if (r.codec) out << ", \"codec\": \"" << r.codec << "\", \"compressed_bytes\": " << r.compressed_bytes;
+            if (!conf.count_only) {
+                out << ", ";
+                write_lengths_json(out, r.line_length, r.word_length);
+            }
+            if (!conf.merge && !conf.count_only) {
+                if (nd) {
+                    out << ", \"top_words\": [";
+                    for (std::size_t k = 0; k < r.top.size(); ++k) {
+                        out << (k ? ", " : "") << "{\"word\": \"" << JsonEscaped{r.top[k].first}
+                            << "\", \"count\": " << r.top[k].second << "}";
+                    }
+                    out << "]";
+                } else {
+                    out << ", \"top_words\": [\n";
+                    write_top_words(out, as_top_list(r.top), {}, "        ");
+                    out << "      ]";
+                }
+            }
+            out << " }";
+        }
+        out << (nd ? "\n" : i + 1 < files.size() ? ",\n" : "\n");
+    }
+    if (nd) {
+        out << "{\"type\": \"total\", \"files\": " << files.size() << ", \"lines\": " << total.lines
+            << ", \"words\": " << total.words << ", \"bytes\": " << total.bytes;
+        if (!conf.count_only) {
+            out << ", ";
+            write_lengths_json(out, summarize(total.lengths.line), summarize(total.lengths.word));
+        }
+        out << "}\n";
+        write_top_words_ndjson(out, merged_top, {});
+    } else {
+        out << "  ],\n";
+        out << "  \"total\": { \"files\": " << files.size() << ", \"lines\": " << total.lines
+            << ", \"words\": " << total.words << ", \"bytes\": " << total.bytes;
+        if (!conf.count_only) {
+            out << ", ";
+            write_lengths_json(out, summarize(total.lengths.line), summarize(total.lengths.word));
+        }
+        out << " },\n";
+        out << "  \"top_words\": [\n";
+        write_top_words(out, merged_top, {}, "    ");
+        out << "  ]\n";
+        out << "}\n";
+    }
+    out.close();
+}
+
+// The per-file table of a merged batch report; files that failed are reported on stderr.
+static void print_file_rows(const std::vector<std::string>& files, const std::vector<FileResult>& results) {
+    std::cout << "      lines       words         bytes  file\n";
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const FileResult& r = results[i];
+        if (!r.error.empty()) {
+            std::cerr << "Error: " << r.error << "\n";
+            continue;
+        }
+        std::cout << std::setw(11) << r.lines << " " << std::setw(11) << r.words << " " << std::setw(13)
+                  << r.bytes << "  " << display_name(files[i]) << "\n";
+    }
+}
+
+// Analyze many files on a pool of conf.threads workers. Each file is tokenized by one
+// worker (no intra-file splitting); with --merge every worker also folds its files'
+// tables into a private accumulator, and the accumulators are merged at the end.
+[[maybe_unused]] static int run_batch(const Config& conf, Profile* prof) {
+    StageTimer timer(prof);
+    const std::vector<std::string> files = collect_inputs(conf);
+    std::vector<FileResult> results(files.size());
+
+    // Contiguous runs of files form tasks: one big file alone, small files batched.
+    std::vector<std::pair<std::size_t, std::size_t>> tasks;   // [first, last) file index
+    for (std::size_t i = 0; i < files.size();) {
+        std::size_t first = i;
+        std::uint64_t bytes = 0;
+        while (i < files.size() && bytes < kBatchTaskBytes && i - first < kBatchTaskFiles) {
+            std::error_code ec;
+            std::uintmax_t sz = is_stdin_path(files[i]) ? 0 : std::filesystem::file_size(files[i], ec);
+            bytes += ec ? 0 : sz;
+            ++i;
+        }
+        tasks.emplace_back(first, i);
+    }
+
+    Config fconf = conf;
+    fconf.threads = 1;
+    fconf.expected_unique = 0;   // A hint describes one input; --expected-unique auto samples each file
+    const unsigned nworkers = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(conf.threads, tasks.size())));
+    WorkStealingQueues queues(nworkers);
+    for (std::size_t t = 0; t < tasks.size(); ++t) {
+        queues.push(static_cast<unsigned>(t % nworkers), t);
+    }
+
+    std::vector<WordTable> partial(conf.merge ? nworkers : 0);
+    std::vector<Lengths> lengths(nworkers);
+    std::vector<std::exception_ptr> errors(nworkers);
+    auto work = [&](unsigned w) {
+        try {
+            std::size_t t;
+            while (queues.pop(w, t)) {
+                for (std::size_t f = tasks[t].first; f < tasks[t].second; ++f) {
+                    FileResult& r = results[f];
+                    try {
+                        Stats st = analyze_file(fconf, files[f]);
+                        r.lines = st.lines;
+                        r.words = st.words;
+                        r.bytes = st.bytes;
+                        r.bytes_source = st.bytes_source;
+                        r.codec = st.codec;
+                        r.compressed_bytes = st.compressed_bytes;
+                        if (conf.count_only) continue;
+                        r.line_length = summarize(st.lengths.line);
+                        r.word_length = summarize(st.lengths.word);
+                        lengths[w].merge(st.lengths);
+                        if (conf.merge) {
+                            merge_freq(partial[w], std::move(st.freq));
+                        } else {
+                            for (const auto& [word, c] : top_k(st.freq, conf.topN)) r.top.emplace_back(word, c);
+                        }
+                    } catch (const std::runtime_error& ex) {
+                        r.error = ex.what();  // I/O problem with this file: report it, keep going
+                    }
+                }
+            }
+        } catch (...) {
+            errors[w] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned w = 1; w < nworkers; ++w) workers.emplace_back(work, w);
+    work(0);
+    for (auto& th : workers) th.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+    timer.lap("analyze");
+
+    Stats total;
+    int failed = 0;
+    for (const FileResult& r : results) {
+        failed += !r.error.empty();
+        total.lines += r.lines;
+        total.words += r.words;
+        total.bytes += r.bytes;
+    }
+    for (auto& t : partial) merge_freq(total.freq, std::move(t));
+    for (const Lengths& l : lengths) total.lengths.merge(l);
+    timer.lap("merge");
+    TopList merged_top;
+    if (conf.merge && !conf.count_only) merged_top = top_k(total.freq, conf.topN);
+    timer.lap("top_k");
+
+    // Human-readable report: one block per file, or a table plus the merged top-K.
+    if (conf.merge) print_file_rows(files, results);
+    for (std::size_t i = 0; i < files.size() && !conf.merge; ++i) {
+        const FileResult& r = results[i];
+        if (!r.error.empty()) {
+            std::cerr << "Error: " << r.error << "\n";
+            continue;
+        }
+        Stats st;
+        st.lines = r.lines;
+        st.words = r.words;
+        st.bytes = r.bytes;
+        st.bytes_source = r.bytes_source;
+        st.codec = r.codec;
+        st.compressed_bytes = r.compressed_bytes;
+        std::cout << "File:   " << display_name(files[i]) << "\n";
+        print_counts(st);
+        print_top(conf, as_top_list(r.top), {});
+        std::cout << "\n";
+    }
+    if (conf.merge) std::cout << "\n";
+    std::cout << "Total:  " << files.size() << " files" << (failed ? " (" + std::to_string(failed) + " failed)" : "") << "\n";
+    std::cout << "Lines:  " << total.lines << "\n";
+    std::cout << "Words:  " << total.words << "\n";
+    std::cout << "Bytes:  " << total.bytes << "\n";
+    if (conf.merge) print_top(conf, merged_top, {});
+
+    if (!conf.snapshot_path.empty()) {
+        write_snapshot(conf.snapshot_path, total, conf.case_sensitive);
+        std::cout << "\nSnapshot written to: " << conf.snapshot_path << "\n";
+    }
+
+    if (!conf.json_path.empty()) {
+        write_batch_json(conf, files, results, total, merged_top);
+        std::cout << "\nJSON written to: " << conf.json_path << "\n";
+    }
+    if (prof) {
+        timer.lap("report");
+        prof->counters.stop();
+        print_profile(*prof, total, conf.simd ? scan_kernel().name : "scalar");
+    }
+    return failed ? 2 : 0;
+}
+
+// ---- Distributed mode (--workers, worker) ---------------------------------------------
+//
+// `file_stats worker --listen PORT` serves one coordinator connection at a time. A
+// coordinator is any run given --workers: it plans its inputs into tasks (whole files,
+// or byte ranges of large uncompressed files) and sends each worker its share together
+// with the tokenizer options. A worker analyzes its tasks on --threads threads, returns
+// the counts and length histograms of every task, and keeps its merged word table until
+// the connection closes, to answer the top-K rounds:
+//   --reduce full  each worker ships its whole table and the coordinator merges them;
+//   --reduce tput  TPUT, exact in three rounds: every worker's local top-K; then every
+//                  word counted at least T = ceil(tau1 / workers) times, where tau1 is
+//                  the K-th best partial sum of round one; then the exact counts of the
+//                  words whose upper bound still reaches the K-th best partial sum.
+// A message is a type byte, the payload length (8 bytes, little-endian) and the payload,
+// whose integers are varints. Word lists are sorted and front-coded (see put_entries).
+//
+// A worker reads any file its user can read on behalf of whoever connects, so a bare
+// --listen PORT binds the loopback interface only, and a Job must carry the shared
+// secret in FILE_STATS_TOKEN when the worker has one. Worker requests are capped at
+// kMaxRequestBytes, and a coordinator that stays silent (kJobTimeoutSeconds before its
+// Job, --idle-timeout after it) is dropped so that the next one can be served.
+
+#if !defined(_WIN32)
+
+enum class Msg : char
+{
+    Job = 'J',      // Coordinator: tokenizer options and tasks
+    Results = 'R',  // Worker: one result per task, then its distinct word count
+    Full = 'F',     // Coordinator: ship the whole table
+    Top = 'T',      // Coordinator: ship the local top K
+    Above = 'A',    // Coordinator: ship every word counted at least T times
+    Counts = 'C',   // Coordinator: the counts of these words
+    Entries = 'E',  // Worker: a word list, answering Full, Top or Above
+    Values = 'V',   // Worker: counts, answering Counts
+    Error = 'X'     // Worker: the request failed; the payload is the message
+};
+
+static constexpr std::uint64_t kMaxRequestBytes = std::uint64_t(1) << 30;
+static constexpr unsigned kJobTimeoutSeconds = 30;
+
+// The shared secret of a distributed run (empty if FILE_STATS_TOKEN is not set).
+static std::string worker_token() {
+    const char* t = std::getenv("FILE_STATS_TOKEN");
+    return t ? t : "";
+}
+
+// A connected TCP stream of framed messages. SIGPIPE must be ignored by the caller.
+class Connection
+{
+public:
+    explicit Connection(int fd) : fd_(fd) {
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    ~Connection() { ::close(fd_); }
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    void send(Msg type, const std::string& payload) {
+        char head[9];
+        head[0] = static_cast<char>(type);
+        for (int i = 0; i < 8; ++i) head[1 + i] = static_cast<char>(std::uint64_t(payload.size()) >> (8 * i));
+        write_all(head, sizeof(head));
+        write_all(payload.data(), payload.size());
+    }
+
+    // The next message; false if the peer closed the connection between messages. The
+    // payload grows with the bytes that actually arrive, so a bogus length cannot make
+    // it allocate up front; longer than `max_payload` is an error.
+    bool receive(Msg& type, std::string& payload, std::uint64_t max_payload = SIZE_MAX) {
+        char head[9];
+        if (!read_all(head, sizeof(head), true)) return false;
+        std::uint64_t n = 0;
+        for (int i = 0; i < 8; ++i) n |= std::uint64_t(static_cast<unsigned char>(head[1 + i])) << (8 * i);
+        type = static_cast<Msg>(head[0]);
+        if (n > max_payload) {
+            throw std::runtime_error("Message of " + std::to_string(n) + " bytes exceeds the limit of " +
+                                     std::to_string(max_payload));
+        }
+        payload.clear();
+        while (payload.size() < n) {
+            std::size_t at = payload.size();
+            std::size_t step = static_cast<std::size_t>(std::min<std::uint64_t>(n - at, std::max(at, kReadBufferSize)));
+            payload.resize(at + step);
+            read_all(payload.data() + at, step, false);
+        }
+        return true;
+    }
+
+    // Fail reads that wait longer than `seconds` for data (0: wait forever).
+    void set_receive_timeout(unsigned seconds) {
+        timeval tv{static_cast<time_t>(seconds), 0};
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+private:
+    void write_all(const char* p, std::size_t n) {
+        while (n > 0) {
+            ssize_t w = ::send(fd_, p, n, 0);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Network write failed: ") + std::strerror(errno));
+            }
+            p += w;
+            n -= static_cast<std::size_t>(w);
+        }
+    }
+
+    bool read_all(char* p, std::size_t n, bool eof_ok) {
+        for (std::size_t got = 0; got < n;) {
+            ssize_t r = ::recv(fd_, p + got, n - got, 0);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) throw std::runtime_error("Network read timed out");
+                throw std::runtime_error(std::string("Network read failed: ") + std::strerror(errno));
+            }
+            if (r == 0) {
+                if (eof_ok && got == 0) return false;
+                throw std::runtime_error("Connection closed mid-message");
+            }
+            got += static_cast<std::size_t>(r);
+        }
+        return true;
+    }
+
+    int fd_;
+};
+
+// Split "host:port", "[v6-address]:port" or a bare port (empty host: any interface
+// for a listener, the local host for a client).
+static std::pair<std::string, std::string> split_host_port(const std::string& address) {
+    std::size_t colon = address.rfind(':');
+    if (colon == std::string::npos) return {"", address};
+    std::string host = address.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    return {host, address.substr(colon + 1)};
+}
+
+// Resolve `address` and run `use` on each candidate until it returns a socket (>= 0).
+template <class Use>
+static int with_addresses(const std::string& address, bool passive, Use&& use) {
+    auto [host, port] = split_host_port(address);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* found = nullptr;
+    int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+    if (rc != 0) throw std::runtime_error("Cannot resolve " + address + ": " + gai_strerror(rc));
+    int fd = -1;
+    int err = 0;
+    for (addrinfo* ai = found; ai && fd < 0; ai = ai->ai_next) {
+        fd = use(ai);
+        if (fd < 0) err = errno;
+    }
+    freeaddrinfo(found);
+    if (fd < 0) errno = err;
+    return fd;
+}
+
+static std::unique_ptr<Connection> dial(const std::string& address) {
+    int fd = with_addresses(address, false, [](const addrinfo* ai) {
+        int s = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s >= 0 && ::connect(s, ai->ai_addr, ai->ai_addrlen) != 0) {
+            int err = errno;
+            ::close(s);
+            errno = err;
+            s = -1;
+        }
+        return s;
+    });
+    if (fd < 0) throw std::runtime_error("Cannot connect to " + address + ": " + std::strerror(errno));
+    return std::make_unique<Connection>(fd);
+}
+
+// A listening socket for `address`; `port` receives the port actually bound.
+static int listen_on(const std::string& address, unsigned& port) {
+    int fd = with_addresses(address, true, [](const addrinfo* ai) {
+        int s = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        int one = 1;
+        if (s >= 0) setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (s >= 0 && (::bind(s, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(s, 16) != 0)) {
+            int err = errno;
+            ::close(s);
+            errno = err;
+            s = -1;
+        }
+        return s;
+    });
+    if (fd < 0) throw std::runtime_error("Cannot listen on " + address + ": " + std::strerror(errno));
+    sockaddr_storage ss{};
+    socklen_t len = sizeof(ss);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &len);
+    port = ntohs(ss.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&ss)->sin6_port
+                                          : reinterpret_cast<sockaddr_in*>(&ss)->sin_port);
+    return fd;
+}
+
+static void put_string(std::string& out, std::string_view s) {
+    put_varint(out, s.size());
+    out.append(s);
+}
+
+static std::runtime_error bad_message() { return std::runtime_error("Malformed message in distributed mode"); }
+
+static std::uint64_t get_varint(ByteReader& in) {
+    std::uint64_t v;
+    if (!in.varint(v)) throw bad_message();
+    return v;
+}
+
+static std::string get_string(ByteReader& in) {
+    std::string_view s;
+    if (!in.bytes(static_cast<std::size_t>(get_varint(in)), s)) throw bad_message();
+    return std::string(s);
+}
+
+// A word list: the count, then per entry (sorted by word) the length of the prefix
+// shared with the previous word, the rest of the word and its count.
+static void put_entries(std::string& out, TopList entries) {
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    put_varint(out, entries.size());
+    std::string_view prev;
+    for (const auto& [w, c] : entries) {
+        std::size_t shared = 0;
+        while (shared < prev.size() && shared < w.size() && prev[shared] == w[shared]) ++shared;
+        put_varint(out, shared);
+        put_string(out, w.substr(shared));
+        put_varint(out, c);
+        prev = w;
+    }
+}
+
+// Call fn(word, count) for each entry of a list written by put_entries; returns the count.
+template <class Fn>
+static std::uint64_t get_entries(ByteReader& in, Fn&& fn) {
+    std::uint64_t n = get_varint(in);
+    std::string word;
+    for (std::uint64_t i = 0; i < n; ++i) {
+        std::uint64_t shared = get_varint(in);
+        std::string_view rest;
+        if (shared > word.size() || !in.bytes(static_cast<std::size_t>(get_varint(in)), rest)) throw bad_message();
+        word.resize(static_cast<std::size_t>(shared));
+        word.append(rest);
+        fn(std::string_view(word), get_varint(in));
+    }
+    return n;
+}
+
+// One unit of work: a whole file, or the nominal byte range [begin, end) of one.
+struct Task
+{
+    std::string path;
+    bool range = false;
+    std::uint64_t begin = 0;
+    std::uint64_t end = 0;       // UINT64_MAX: to the end of the file
+    std::uint64_t size = 0;      // Planned bytes, for load balancing
+};
+
+struct TaskResult
+{
+    std::string error;           // Non-empty if the task failed
+    std::uint64_t lines = 0;
+    std::uint64_t words = 0;
+    std::uint64_t bytes = 0;
+    ByteSource bytes_source = ByteSource::Mapped;
+    Codec codec = Codec::None;
+    std::uint64_t compressed_bytes = 0;
+    ChunkLines chunk;            // Ranges only: how the range starts and ends in lines
+    Lengths lengths;
+};
+
+// Scan the bytes of `path` from the split point at or after `begin` to the split point
+// at or after `end` (see word_boundary), as one chunk of a split file: pieces of lines
+// cut by the range ends are left to join_chunk_lines, and only the range that ends the
+// file counts an unterminated last line.
+static Stats analyze_range(const Config& conf, const Task& task, ChunkLines& chunk) {
+    InputFile in(task.path, true);
+    if (!in.mapped()) throw std::runtime_error("Cannot map " + task.path + " to analyze a byte range");
+    const char* data = in.data();
+    const std::size_t size = in.size();
+    std::size_t to = task.end >= size ? size : word_boundary(conf, data, size, static_cast<std::size_t>(task.end));
+    std::size_t from = task.begin == 0 ? 0 : word_boundary(conf, data, size, static_cast<std::size_t>(
+                                                                                 std::min<std::uint64_t>(task.begin, size)));
+    from = std::min(from, to);
+    Stats st;
+    Tokenizer tok(conf, st);
+    tok.feed(data + from, to - from);
+    tok.flush_token(); // Ranges end on a word boundary; lines are closed by the coordinator
+    if (!conf.count_only) chunk = chunk_lines(data + from, to - from, tok);
+    if (to == size && size > 0 && data[size - 1] != '\n') ++st.lines;
+    st.bytes = to - from;
+    st.bytes_source = ByteSource::Mapped;
+    return st;
+}
+
+// Runs `tasks` on `nthreads` threads, like run_batch with --merge: the word tables of all
+// tasks are summed into `freq`.
+static std::vector<TaskResult> run_tasks(const Config& conf, const std::vector<Task>& tasks, unsigned nthreads,
+                                         WordTable& freq) {
+    std::vector<TaskResult> results(tasks.size());
+    nthreads = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(nthreads, tasks.size())));
+    WorkStealingQueues queues(nthreads);
+    for (std::size_t t = 0; t < tasks.size(); ++t) queues.push(static_cast<unsigned>(t % nthreads), t);
+    std::vector<WordTable> partial(nthreads);
+    std::vector<std::exception_ptr> errors(nthreads);
+    auto work = [&](unsigned w) {
+        try {
+            std::size_t t;
+            while (queues.pop(w, t)) {
+                TaskResult& r = results[t];
+                try {
+                    Stats st = tasks[t].range ? analyze_range(conf, tasks[t], r.chunk) : analyze_file(conf, tasks[t].path);
+                    r.lines = st.lines;
+                    r.words = st.words;
+                    r.bytes = st.bytes;
+                    r.bytes_source = st.bytes_source;
+                    for (Codec c : {Codec::Gzip, Codec::Zstd, Codec::Lz4}) {
+                        if (st.codec && std::strcmp(st.codec, codec_name(c)) == 0) r.codec = c;
+                    }
+                    r.compressed_bytes = st.compressed_bytes;
+                    r.lengths = st.lengths;
+                    merge_freq(partial[w], std::move(st.freq));
+                } catch (const std::runtime_error& ex) {
+                    r.error = ex.what();  // I/O problem with this task: report it, keep going
+                }
+            }
+        } catch (...) {
+            errors[w] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned w = 1; w < nthreads; ++w) threads.emplace_back(work, w);
+    work(0);
+    for (auto& th : threads) th.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+    for (auto& t : partial) merge_freq(freq, std::move(t));
+    return results;
+}
+
+static void put_result(std::string& out, const TaskResult& r) {
+    put_string(out, r.error);
+    if (!r.error.empty()) return;
+    for (std::uint64_t v : {r.lines, r.words, r.bytes, std::uint64_t(r.bytes_source), std::uint64_t(r.codec),
+                            r.compressed_bytes, std::uint64_t(r.chunk.newline), r.chunk.head, r.chunk.tail}) {
+        put_varint(out, v);
+    }
+    put_histogram(out, r.lengths.line);
+    put_histogram(out, r.lengths.word);
+}
+
+static TaskResult get_result(ByteReader& in) {
+    TaskResult r;
+    r.error = get_string(in);
+    if (!r.error.empty()) return r;
+    r.lines = get_varint(in);
+    r.words = get_varint(in);
+    r.bytes = get_varint(in);
+    r.bytes_source = static_cast<ByteSource>(get_varint(in));
+    r.codec = static_cast<Codec>(get_varint(in));
+    r.compressed_bytes = get_varint(in);
+    r.chunk.newline = get_varint(in) != 0;
+    r.chunk.head = get_varint(in);
+    r.chunk.tail = get_varint(in);
+    if (!get_histogram(in, r.lengths.line) || !get_histogram(in, r.lengths.word)) throw bad_message();
+    return r;
+}
+
+// Apply the tokenizer options of a Job, as written by worker_args(). Anything else is
+// refused: a coordinator must not reach --help, --json or the other options that act on
+// the worker's own machine. Throws on an unknown option or a bad value; never exits.
+static void parse_job_args(const std::vector<std::string>& args, Config& conf) {
+    auto bad = [](const std::string& what) { return std::runtime_error("Invalid option from the coordinator: " + what); };
+    auto number = [&](const std::string& text) {
+        std::size_t used = 0;
+        unsigned long long v = 0;
+        try {
+            v = std::stoull(text, &used);
+        } catch (const std::exception&) {
+            throw bad(text);
+        }
+        if (used != text.size() || text[0] == '-') throw bad(text);
+        return static_cast<std::size_t>(v);
+    };
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        bool has_value = i + 1 < args.size();
+        if (a == "--case-sensitive") {
+            conf.case_sensitive = true;
+        } else if (a == "--utf8") {
+            conf.utf8 = true;
+        } else if (a == "--counts-only") {
+            conf.count_only = true;
+        } else if (a == "--no-simd") {
+            conf.simd = false;
+        } else if (a == "--no-decompress") {
+            conf.decompress = false;
+        } else if (a == "--io=mmap") {
+            conf.io = IoEngine::Mmap;
+        } else if (a == "--io=pread") {
+            conf.io = IoEngine::Pread;
+        } else if (a == "--io=uring") {
+#if !(defined(FILE_STATS_WITH_URING) && defined(__linux__))
+            throw std::runtime_error("--io=uring needs a worker built with -DFILE_STATS_WITH_URING -luring");
+#endif
+            conf.io = IoEngine::Uring;
+        } else if (a == "--word-chars" && has_value) {
+            conf.word_chars = args[++i];
+        } else if (a == "--min-len" && has_value) {
+            conf.min_len = number(args[++i]);
+        } else if (a == "--max-len" && has_value) {
+            conf.max_len = number(args[++i]);
+        } else if (a == "--stopwords" && has_value) {
+            conf.stopwords_path = args[++i];
+        } else {
+            throw bad(a);
+        }
+    }
+    if (conf.max_len != 0 && conf.max_len < conf.min_len) throw bad("--max-len below --min-len");
+}
+
+// Answer one coordinator connection: a Job, then any number of top-K requests.
+static void serve_coordinator(Connection& conn, unsigned nthreads, unsigned idle_timeout) {
+    Config conf;
+    WordTable freq;
+    bool have_job = false;
+    std::string kth_word;               // The last entry shipped for Top, which Above skips up to
+    std::uint64_t kth_count = 0;
+    bool sent_top = false;
+
+    const std::string token = worker_token();
+    Msg type;
+    std::string in, out;
+    conn.set_receive_timeout(kJobTimeoutSeconds);
+    while (conn.receive(type, in, kMaxRequestBytes)) {
+        ByteReader r{in.data(), in.data() + in.size()};
+        out.clear();
+        if (!have_job) {
+            // Until a Job with the right token arrives, anything else ends the connection.
+            if (type != Msg::Job) throw std::runtime_error("Expected a job from the coordinator");
+            if (get_string(r) != token) {
+                conn.send(Msg::Error, "Authentication failed: FILE_STATS_TOKEN differs from the worker's");
+                throw std::runtime_error("Rejected a coordinator with a different FILE_STATS_TOKEN");
+            }
+            conn.set_receive_timeout(idle_timeout);
+        }
+        try {
+            if (type == Msg::Job) {
+                if (have_job) throw std::runtime_error("A connection carries one job");
+                std::vector<std::string> args;
+                for (std::uint64_t n = get_varint(r); n > 0; --n) args.push_back(get_string(r));
+                parse_job_args(args, conf);
+                conf.rules = make_rules(conf);
+                // Each task takes at least one byte, so a larger count is not worth allocating.
+                std::uint64_t ntasks = get_varint(r);
+                if (ntasks > static_cast<std::uint64_t>(r.end - r.p)) throw bad_message();
+                std::vector<Task> tasks(static_cast<std::size_t>(ntasks));
+                for (Task& t : tasks) {
+                    t.path = get_string(r);
+                    t.range = get_varint(r) != 0;
+                    t.begin = get_varint(r);
+                    t.end = get_varint(r);
+                }
+                have_job = true;
+                std::vector<TaskResult> results = run_tasks(conf, tasks, nthreads, freq);
+                for (const TaskResult& res : results) put_result(out, res);
+                put_varint(out, freq.size());
+                conn.send(Msg::Results, out);
+                continue;
+            }
+            if (type == Msg::Full) {
+                put_entries(out, TopList(freq.begin(), freq.end()));
+            } else if (type == Msg::Top) {
+                TopList top = top_k(freq, static_cast<std::size_t>(get_varint(r)));
+                sent_top = !top.empty();
+                if (sent_top) {
+                    kth_word = std::string(top.back().first);
+                    kth_count = top.back().second;
+                }
+                put_entries(out, top);
+            } else if (type == Msg::Above) {
+                std::uint64_t t = get_varint(r);
+                const TopList::value_type kth(kth_word, kth_count);
+                TopList above;
+                for (const auto& e : freq) {
+                    if (e.second >= t && !(sent_top && !ranks_before(kth, e))) above.push_back(e);
+                }
+                put_entries(out, above);
+            } else if (type == Msg::Counts) {
+                std::string values;
+                get_entries(r, [&](std::string_view w, std::uint64_t) {
+                    const std::uint64_t* c = freq.find(w);
+                    put_varint(values, c ? *c : 0);
+                });
+                conn.send(Msg::Values, values);
+                continue;
+            } else {
+                throw std::runtime_error("Unexpected message type");
+            }
+            conn.send(Msg::Entries, out);
+        } catch (const std::exception& ex) {
+            conn.send(Msg::Error, ex.what());
+        }
+    }
+}
+
+// `file_stats worker --listen [HOST:]PORT [--threads N] [--idle-timeout SPAN]`: serve
+// coordinators until killed.
+[[maybe_unused]] static int run_worker(int argc, char** argv) {
+    std::string address;
+    unsigned nthreads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned idle_timeout = 600;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string a = argv[i];
+            if (a == "--help" || a == "-h") {
+                print_help(argv[0]);
+                return 0;
+            } else if (a == "--listen" && i + 1 < argc) {
+                address = argv[++i];
+            } else if (a == "--threads" && i + 1 < argc) {
+                nthreads = static_cast<unsigned>(std::stoul(argv[++i]));
+                if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+            } else if (a == "--idle-timeout" && i + 1 < argc) {
+                idle_timeout = parse_seconds(argv[++i]);
+            } else {
+                std::cerr << "Unknown argument: " << a << "\n";
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Invalid number or duration\n";
+        print_help(argv[0]);
+        return 1;
+    }
+    if (address.empty()) {
+        print_help(argv[0]);
+        return 1;
+    }
+    if (address.find(':') == std::string::npos) address = "127.0.0.1:" + address;   // Bare port: loopback only
+
+    try {
+        std::signal(SIGPIPE, SIG_IGN);
+        unsigned port = 0;
+        int fd = listen_on(address, port);
+        auto [host, unused] = split_host_port(address);
+        if (worker_token().empty() && host != "127.0.0.1" && host != "::1" && host != "localhost") {
+            std::cerr << "Warning: listening on " << (host.empty() ? "every interface" : host)
+                      << " without FILE_STATS_TOKEN: anyone who can connect can read the files this user can "
+                         "read\n";
+        }
+        std::cout << "Listening on " << (host.empty() ? "*" : host) << " port " << port << " with " << nthreads
+                  << " threads" << std::endl;
+        for (;;) {
+            int c = ::accept(fd, nullptr, nullptr);
+            if (c < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+            }
+            Connection conn(c);
+            try {
+                serve_coordinator(conn, nthreads, idle_timeout);
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << "\n";   // Drop this coordinator, keep serving
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 2;
+    }
+}
+
+// The coordinator's view of one worker.
+struct RemoteWorker
+{
+    std::string address;
+    std::unique_ptr<Connection> conn;
+    std::vector<std::size_t> tasks;   // Indices into the plan
+    std::uint64_t load = 0;           // Planned bytes
+    std::uint64_t distinct = 0;       // Size of its word table
+
+    std::string request(Msg type, const std::string& payload, Msg expect) {
+        conn->send(type, payload);
+        Msg got;
+        std::string reply;
+        if (!conn->receive(got, reply)) throw std::runtime_error("Connection closed");
+        if (got == Msg::Error) throw std::runtime_error(reply);
+        if (got != expect) throw bad_message();
+        return reply;
+    }
+};
+
+// Run fn(worker, index) on every worker at once; errors name the worker.
+template <class Fn>
+static void on_each_worker(std::vector<RemoteWorker>& workers, Fn&& fn) {
+    std::vector<std::exception_ptr> errors(workers.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        threads.emplace_back([&, i] {
+            try {
+                fn(workers[i], i);
+            } catch (const std::exception& ex) {
+                errors[i] = std::make_exception_ptr(std::runtime_error("worker " + workers[i].address + ": " + ex.what()));
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+}
+
+// The tokenizer options of `conf`, as command-line arguments for the workers.
+static std::vector<std::string> worker_args(const Config& conf) {
+    std::vector<std::string> args;
+    if (conf.case_sensitive) args.push_back("--case-sensitive");
+    if (conf.utf8) args.push_back("--utf8");
+    if (conf.count_only) args.push_back("--counts-only");
+    if (!conf.simd) args.push_back("--no-simd");
+    if (!conf.decompress) args.push_back("--no-decompress");
+    if (conf.io == IoEngine::Pread) args.push_back("--io=pread");
+    if (conf.io == IoEngine::Uring) args.push_back("--io=uring");
+    if (!conf.word_chars.empty()) args.insert(args.end(), {"--word-chars", conf.word_chars});
+    if (conf.min_len) args.insert(args.end(), {"--min-len", std::to_string(conf.min_len)});
+    if (conf.max_len) args.insert(args.end(), {"--max-len", std::to_string(conf.max_len)});
+    if (!conf.stopwords_path.empty()) args.insert(args.end(), {"--stopwords", conf.stopwords_path});
+    return args;
+}
+
+// Cut the inputs into tasks: uncompressed regular files larger than --range-size (at
+// least kMinChunkSize) become equal byte ranges, everything else one whole-file task. `file_tasks[f]` lists the
+// tasks of file f in file order.
+static std::vector<Task> plan_tasks(const Config& conf, const std::vector<std::string>& files,
+                                    std::vector<std::vector<std::size_t>>& file_tasks) {
+    const std::uint64_t range_size = std::max<std::uint64_t>(conf.range_size, kMinChunkSize);
+    std::vector<Task> tasks;
+    file_tasks.assign(files.size(), {});
+    for (std::size_t f = 0; f < files.size(); ++f) {
+        std::error_code ec;
+        std::uint64_t size = std::filesystem::is_regular_file(files[f], ec) ? std::filesystem::file_size(files[f], ec) : 0;
+        if (ec) size = 0;
+        std::uint64_t pieces = 1;
+        if (size > range_size) {
+            char head[4] = {};
+            std::ifstream peek(files[f], std::ios::binary);
+            peek.read(head, sizeof(head));
+            if (!conf.decompress || detect_codec(std::string_view(head, static_cast<std::size_t>(peek.gcount()))) == Codec::None) {
+                pieces = (size + range_size - 1) / range_size;
+            }
+        }
+        for (std::uint64_t k = 0; k < pieces; ++k) {
+            Task t;
+            t.path = files[f];
+            t.range = pieces > 1;
+            t.begin = size / pieces * k;
+            t.end = k + 1 == pieces ? UINT64_MAX : size / pieces * (k + 1);
+            t.size = pieces > 1 ? std::min(t.end, size) - t.begin : size;
+            file_tasks[f].push_back(tasks.size());
+            tasks.push_back(std::move(t));
+        }
+    }
+    return tasks;
+}
+
+// The k-th largest count of `table`, or 0 if it holds fewer than k words.
+static std::uint64_t kth_count(const WordTable& table, std::size_t k) {
+    if (k == 0 || table.size() < k) return 0;
+    std::vector<std::uint64_t> counts;
+    counts.reserve(table.size());
+    for (const auto& e : table) counts.push_back(e.second);
+    std::nth_element(counts.begin(), counts.begin() + (k - 1), counts.end(), std::greater<std::uint64_t>());
+    return counts[k - 1];
+}
+
+// Exact top-K of the sum of the workers' tables by TPUT (see the section comment).
+// `exact` receives the true totals of the final candidates; `shipped` counts the entries
+// and counts the workers sent.
+static TopList reduce_tput(std::vector<RemoteWorker>& workers, std::size_t k, WordTable& exact,
+                           std::uint64_t& shipped) {
+    const std::uint64_t m = workers.size();
+    WordTable partial;     // Sum of the counts reported so far
+    WordTable reporters;   // Number of workers that reported each word
+    std::vector<std::string> replies(workers.size());
+    auto add_replies = [&] {
+        for (const std::string& reply : replies) {
+            ByteReader in{reply.data(), reply.data() + reply.size()};
+            shipped += get_entries(in, [&](std::string_view w, std::uint64_t c) {
+                partial[w] += c;
+                ++reporters[w];
+            });
+        }
+    };
+
+    // Round 1: local top-K lists give partial sums; the K-th best one bounds the answer.
+    std::string request;
+    put_varint(request, k);
+    on_each_worker(workers, [&](RemoteWorker& w, std::size_t i) { replies[i] = w.request(Msg::Top, request, Msg::Entries); });
+    add_replies();
+    const std::uint64_t threshold = std::max<std::uint64_t>(1, (kth_count(partial, k) + m - 1) / m);
+
+    // Round 2: a word below the threshold on every worker sums to less than tau1.
+    request.clear();
+    put_varint(request, threshold);
+    on_each_worker(workers, [&](RemoteWorker& w, std::size_t i) { replies[i] = w.request(Msg::Above, request, Msg::Entries); });
+    add_replies();
+
+    // Round 3: a worker that did not report a word has fewer than `threshold` of it, so
+    // only words whose upper bound reaches the K-th best partial sum can be in the top-K.
+    const std::uint64_t tau2 = kth_count(partial, k);
+    TopList candidates;
+    for (const auto& [w, c] : partial) {
+        const std::uint64_t* seen = reporters.find(w);
+        if (c + (m - *seen) * (threshold - 1) >= tau2) candidates.emplace_back(w, 0);
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    request.clear();
+    put_entries(request, candidates);
+    on_each_worker(workers, [&](RemoteWorker& w, std::size_t i) { replies[i] = w.request(Msg::Counts, request, Msg::Values); });
+    for (const std::string& reply : replies) {
+        ByteReader in{reply.data(), reply.data() + reply.size()};
+        for (auto& e : candidates) e.second += get_varint(in);
+        shipped += candidates.size();
+    }
+    for (const auto& [w, c] : candidates) exact[w] = c;
+    return top_k(exact, k);
+}
+
+// A run with --workers: plan, hand the tasks to the workers, combine their results.
+[[maybe_unused]] static int run_coordinator(const Config& conf, Profile* prof) {
+    StageTimer timer(prof);
+    std::signal(SIGPIPE, SIG_IGN);
+    const std::vector<std::string> files = collect_inputs(conf);
+    std::vector<std::vector<std::size_t>> file_tasks;
+    const std::vector<Task> tasks = plan_tasks(conf, files, file_tasks);
+
+    // Largest task first, each to the least loaded worker.
+    std::vector<RemoteWorker> workers(conf.workers.size());
+    for (std::size_t i = 0; i < workers.size(); ++i) workers[i].address = conf.workers[i];
+    std::vector<std::size_t> order(tasks.size());
+    for (std::size_t t = 0; t < order.size(); ++t) order[t] = t;
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return tasks[a].size > tasks[b].size; });
+    for (std::size_t t : order) {
+        RemoteWorker& w = *std::min_element(workers.begin(), workers.end(),
+                                            [](const RemoteWorker& a, const RemoteWorker& b) { return a.load < b.load; });
+        w.tasks.push_back(t);
+        w.load += tasks[t].size;
+    }
+    timer.lap("plan");
+
+    std::vector<TaskResult> results(tasks.size());
+    const std::vector<std::string> args = worker_args(conf);
+    on_each_worker(workers, [&](RemoteWorker& w, std::size_t) {
+        w.conn = dial(w.address);
+        std::sort(w.tasks.begin(), w.tasks.end());
+        std::string job;
+        put_string(job, worker_token());
+        put_varint(job, args.size());
+        for (const std::string& a : args) put_string(job, a);
+        put_varint(job, w.tasks.size());
+        for (std::size_t t : w.tasks) {
+            put_string(job, tasks[t].path);
+            put_varint(job, tasks[t].range);
+            put_varint(job, tasks[t].begin);
+            put_varint(job, tasks[t].end);
+        }
+        std::string reply = w.request(Msg::Job, job, Msg::Results);
+        ByteReader in{reply.data(), reply.data() + reply.size()};
+        for (std::size_t t : w.tasks) results[t] = get_result(in);
+        w.distinct = get_varint(in);
+    });
+    timer.lap("analyze");
+
+    // Per file: add up its tasks, and rejoin the lines that were cut at range ends.
+    std::vector<FileResult> file_results(files.size());
+    Stats total;
+    int failed = 0;
+    for (std::size_t f = 0; f < files.size(); ++f) {
+        FileResult& fr = file_results[f];
+        Lengths lengths;
+        std::vector<ChunkLines> chunks;
+        for (std::size_t t : file_tasks[f]) {
+            const TaskResult& r = results[t];
+            if (!r.error.empty()) {
+                if (fr.error.empty()) fr.error = r.error;
+                continue;
+            }
+            fr.lines += r.lines;
+            fr.words += r.words;
+            fr.bytes += r.bytes;
+            fr.bytes_source = r.bytes_source;
+            fr.codec = r.codec == Codec::None ? nullptr : codec_name(r.codec);
+            fr.compressed_bytes = r.compressed_bytes;
+            lengths.merge(r.lengths);
+            chunks.push_back(r.chunk);
+        }
+        if (!fr.error.empty()) {
+            std::string error = std::move(fr.error);
+            fr = FileResult{};
+            fr.error = std::move(error);
+            ++failed;
+            continue;
+        }
+        if (tasks[file_tasks[f].front()].range && !conf.count_only) join_chunk_lines(lengths.line, chunks);
+        fr.line_length = summarize(lengths.line);
+        fr.word_length = summarize(lengths.word);
+        total.lines += fr.lines;
+        total.words += fr.words;
+        total.bytes += fr.bytes;
+        total.lengths.merge(lengths);
+    }
+
+    TopList top;
+    WordTable exact;                      // --reduce tput: totals of the final candidates
+    std::uint64_t shipped = 0;
+    std::uint64_t held = 0;
+    for (const RemoteWorker& w : workers) held += w.distinct;
+    // TPUT ships at least K entries per worker in round one and again in round three;
+    // once that nears the size of the tables themselves, shipping them whole is cheaper.
+    const bool full = conf.reduce == Reduce::Full || std::uint64_t(conf.topN) * workers.size() * 3 >= held;
+    if (!conf.count_only && full) {
+        std::vector<std::string> replies(workers.size());
+        on_each_worker(workers, [&](RemoteWorker& w, std::size_t i) { replies[i] = w.request(Msg::Full, "", Msg::Entries); });
+        for (const std::string& reply : replies) {
+            ByteReader in{reply.data(), reply.data() + reply.size()};
+            shipped += get_entries(in, [&](std::string_view w, std::uint64_t c) { total.freq[w] += c; });
+        }
+        top = top_k(total.freq, conf.topN);
+    } else if (!conf.count_only) {
+        top = reduce_tput(workers, conf.topN, exact, shipped);
+    }
+    timer.lap("reduce");
+
+    Config rconf = conf;
+    rconf.merge = true;
+    print_file_rows(files, file_results);
+    std::cout << "\nTotal:  " << files.size() << " files" << (failed ? " (" + std::to_string(failed) + " failed)" : "")
+              << ", " << tasks.size() << " tasks on " << workers.size() << " worker" << (workers.size() > 1 ? "s" : "")
+              << "\n";
+    std::cout << "Lines:  " << total.lines << "\n";
+    std::cout << "Words:  " << total.words << "\n";
+    std::cout << "Bytes:  " << total.bytes << "\n";
+    if (!conf.count_only) {
+        std::cout << "Reduce: " << (full ? "full" : "tput") << ", " << shipped
+                  << " entries shipped (worker tables hold " << held << ")\n";
+    }
+    print_top(conf, top, {});
+
+    if (!conf.snapshot_path.empty()) {
+        write_snapshot(conf.snapshot_path, total, conf.case_sensitive);
+        std::cout << "\nSnapshot written to: " << conf.snapshot_path << "\n";
+    }
+    if (!conf.json_path.empty()) {
+        write_batch_json(rconf, files, file_results, total, top);
+        std::cout << "\nJSON written to: " << conf.json_path << "\n";
+    }
+    if (prof) {
+        timer.lap("report");
+        prof->counters.stop();
+        print_profile(*prof, total, conf.simd ? scan_kernel().name : "scalar");
+    }
+    return failed ? 2 : 0;
+}
+
+#endif // !_WIN32
+
+// ---- Follow mode (--follow) ----------------------------------------------------
+//
+// The file is tailed from its current end. Every --interval, the bytes that arrived
+// since the last report are closed off as one slot of a sliding window; with
+// --window-bytes a slot also closes after each 1/kWindowByteSlots of the window. The
+// window table is the running sum of a ring of slot tables: a new slot is added in
+// and the oldest is subtracted out, so a report is one top-K over the window's words
+// and no input is ever scanned twice.
+
+#if !defined(_WIN32)
+
+// A byte window is kept to within this fraction of its size.
+static constexpr std::uint64_t kWindowByteSlots = 16;
+
+// Counts gathered between two slot boundaries.
+struct WindowSlot
+{
+    WordTable freq;
+    std::uint64_t lines = 0;
+    std::uint64_t words = 0;
+    std::uint64_t bytes = 0;
+};
+
+class SlidingWindow
+{
+public:
+    // A window of the `max_slots` most recent slots (time windows), or of the fewest
+    // most recent slots that hold at least `max_bytes` bytes (byte windows); 0 = no limit.
+    SlidingWindow(std::size_t max_slots, std::uint64_t max_bytes) : max_slots_(max_slots), max_bytes_(max_bytes) {}
+
+    void push(WindowSlot&& slot) {
+        add(slot);
+        ring_.push_back(std::move(slot));
+        while ((max_slots_ && ring_.size() > max_slots_) ||
+               (max_bytes_ && bytes_ - ring_.front().bytes >= max_bytes_)) {
+            subtract(ring_.front());
+            ring_.pop_front();
+        }
+    }
+
+    // Word counts over the window. Words that left it may remain with a count of 0.
+    const WordTable& freq() const { return freq_; }
+    std::uint64_t lines() const { return lines_; }
+    std::uint64_t words() const { return words_; }
+    std::uint64_t bytes() const { return bytes_; }
+    std::size_t slots() const { return ring_.size(); }
+
+private:
+    // Rebuild the table once this many words, and most of it, are dead (count 0).
+    static constexpr std::size_t kCompactMin = 1 << 12;
+
+    void add(const WindowSlot& s) {
+        for (const auto& [w, c] : s.freq) {
+            std::size_t before = freq_.size();
+            std::uint64_t& v = freq_[w];
+            if (v == 0 && freq_.size() == before) --dead_;   // Revived
+            v += c;
+        }
+        lines_ += s.lines;
+        words_ += s.words;
+        bytes_ += s.bytes;
+    }
+
+    void subtract(const WindowSlot& s) {
+        for (const auto& [w, c] : s.freq) {
+            std::uint64_t& v = freq_[w];   // Present: the slot was added in earlier
+            v -= c;
+            dead_ += v == 0;
+        }
+        lines_ -= s.lines;
+        words_ -= s.words;
+        bytes_ -= s.bytes;
+        if (dead_ >= kCompactMin && dead_ * 2 > freq_.size()) {
+            WordTable live;
+            live.reserve(freq_.size() - dead_);
+            for (const auto& [w, c] : freq_) {
+                if (c) live[w] = c;
+            }
+            freq_ = std::move(live);
+            dead_ = 0;
+        }
+    }
+
+    std::size_t max_slots_;
+    std::uint64_t max_bytes_;
+    std::deque<WindowSlot> ring_;
+    WordTable freq_;           // Sum of the slots in ring_
+    std::size_t dead_ = 0;     // Entries of freq_ whose count is 0
+    std::uint64_t lines_ = 0;
+    std::uint64_t words_ = 0;
+    std::uint64_t bytes_ = 0;
+};
+
+// Wakes the follow loop when the watched file changes: inotify on Linux, kqueue on
+// macOS and the BSDs. Elsewhere, or while the file is missing, it polls.
+class FileWatcher
+{
+public:
+    FileWatcher() {
+#if defined(__linux__)
+        fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(FILE_STATS_KQUEUE)
+        fd_ = ::kqueue();
+#endif
+    }
+
+    ~FileWatcher() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    // Watch `path`, opened as `file_fd`, instead of any previously watched file.
+    void watch([[maybe_unused]] const std::string& path, [[maybe_unused]] int file_fd) {
+        if (fd_ < 0) return;
+#if defined(__linux__)
+        if (watching_) ::inotify_rm_watch(fd_, wd_);
+        wd_ = ::inotify_add_watch(fd_, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+        watching_ = wd_ >= 0;
+#elif defined(FILE_STATS_KQUEUE)
+        // The previous file's event is dropped when its descriptor is closed. Zeroed
+        // first: FreeBSD's struct kevent has ext[] fields that older EV_SETs leave alone.
+        struct kevent ev{};
+        EV_SET(&ev, file_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, nullptr);
+        watching_ = ::kevent(fd_, &ev, 1, nullptr, 0, nullptr) == 0;
+#endif
+    }
+
+    // Block until the file may have changed, `timeout_ms` passes or a signal arrives.
+    void wait(int timeout_ms) {
+        if (watching_) {
+#if defined(__linux__)
+            pollfd p{fd_, POLLIN, 0};
+            if (::poll(&p, 1, timeout_ms) > 0) {
+                alignas(inotify_event) char events[4096];
+                while (::read(fd_, events, sizeof(events)) > 0) {
+                }
+            }
+            return;
+#elif defined(FILE_STATS_KQUEUE)
+            struct kevent ev{};
+            timespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+            ::kevent(fd_, nullptr, 0, &ev, 1, &ts);
+            return;
+#endif
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min(timeout_ms, kPollMs)));
+    }
+
+    const char* mechanism() const {
+        if (!watching_) return "polling";
+#if defined(__linux__)
+        return "inotify";
+#else
+        return "kqueue";
+#endif
+    }
+
+private:
+    static constexpr int kPollMs = 250;
+
+    int fd_ = -1;              // inotify instance or kqueue
+    [[maybe_unused]] int wd_ = -1;  // inotify watch descriptor
+    bool watching_ = false;
+};
+
+static volatile std::sig_atomic_t g_follow_stop = 0;
+
+static void on_follow_signal(int) {
+    g_follow_stop = 1;
+}
+
+// Write the window report to conf.json_path: replaced on every report, or with
+// --ndjson one "window" record appended per report (the file is truncated first).
+static void write_window_json(const Config& conf, const SlidingWindow& window, const TopList& top, bool first) {
+    const bool nd = conf.ndjson;
+    const std::string path = nd ? conf.json_path : conf.json_path + ".tmp";
+    {
+        JsonWriter out(path, nd && !first);
+        const char* open = nd ? "" : "  ";
+        const char* next = nd ? ", " : ",\n";
+        out << (nd ? "{\"type\": \"window\", " : "{\n");
+        out << open << "\"tool\": \"file-stats\"" << next;
+        out << open << "\"timestamp\": \"" << iso8601_utc_now() << "\"" << next;
+        out << open << "\"input_path\": \"" << JsonEscaped{conf.input_path} << "\"" << next;
+        if (conf.window_bytes) out << open << "\"window_bytes\": " << conf.window_bytes << next;
+        else out << open << "\"window_seconds\": " << conf.window_seconds << next;
+        out << open << "\"slots\": " << window.slots() << next;
+        out << open << "\"lines\": " << window.lines() << next;
+        out << open << "\"words\": " << window.words() << next;
+        out << open << "\"bytes\": " << window.bytes() << next;
+        out << open << "\"case_sensitive\": " << (conf.case_sensitive ? "true" : "false");
+        if (nd) {
+            out << ", \"top_words\": [";
+            for (std::size_t k = 0; k < top.size(); ++k) {
+                out << (k ? ", " : "") << "{\"word\": \"" << JsonEscaped{top[k].first} << "\", \"count\": " << top[k].second << "}";
+            }
+            out << "]}\n";
+        } else {
+            out << next << open << "\"top_words\": [\n";
+            write_top_words(out, top, {}, "    ");
+            out << "  ]\n}\n";
+        }
+        out.close();
+    }
+    if (!nd) {
+        std::error_code ec;
+        std::filesystem::rename(path, conf.json_path, ec);
+        if (ec) {
+            throw std::runtime_error("Cannot replace JSON file " + conf.json_path + ": " + ec.message());
+        }
+    }
+}
+
+// --follow: tail conf.input_path until SIGINT/SIGTERM, reporting the sliding window every
+// conf.interval_seconds. Truncation (copytruncate) restarts at the new beginning of the
+// file; a file replaced under the same name (rename and create) is drained, then the new
+// file is followed from its start.
+[[maybe_unused]] static int run_follow(const Config& conf) {
+    using Clock = std::chrono::steady_clock;
+    const auto interval = std::chrono::seconds(conf.interval_seconds);
+    const std::uint64_t slot_bytes =
+        conf.window_bytes ? std::max<std::uint64_t>(1, conf.window_bytes / kWindowByteSlots) : 0;
+    SlidingWindow window(conf.window_bytes ? 0 : (conf.window_seconds + conf.interval_seconds - 1) / conf.interval_seconds,
+                         conf.window_bytes);
+
+    Stats st;                  // Counts of the open slot
+    Tokenizer tok(conf, st);
+    auto in = std::make_unique<InputFile>(conf.input_path, false);
+    if (!in->seekable()) {
+        throw std::runtime_error("--follow needs a regular file: " + conf.input_path);
+    }
+    std::uint64_t offset = in->file_size();   // Like tail -f, start at the current end
+    FileWatcher watcher;
+    watcher.watch(conf.input_path, in->fd());
+    std::signal(SIGINT, on_follow_signal);
+    std::signal(SIGTERM, on_follow_signal);
+
+    const std::string span = conf.window_bytes ? std::to_string(conf.window_bytes) + " bytes"
+                                               : std::to_string(conf.window_seconds) + "s";
+    std::cout << "Following " << conf.input_path << " from byte " << offset << " (" << watcher.mechanism()
+              << "): window " << span << ", report every " << conf.interval_seconds << "s\n"
+              << std::flush;
+
+    std::vector<char> buf(kReadBufferSize);
+    auto close_slot = [&] {
+        WindowSlot slot;
+        slot.freq = std::move(st.freq);
+        slot.lines = st.lines;
+        slot.words = st.words;
+        slot.bytes = st.bytes;
+        st.freq = WordTable();
+        st.lines = st.words = st.bytes = 0;
+        window.push(std::move(slot));
+    };
+    auto drain = [&] {
+        for (;;) {
+            std::size_t want = buf.size();
+            if (slot_bytes) want = static_cast<std::size_t>(std::min<std::uint64_t>(want, slot_bytes - st.bytes));
+            std::size_t n = in->read_at(buf.data(), want, offset);
+            if (n == 0) return;
+            tok.feed(buf.data(), n);
+            offset += n;
+            st.bytes += n;
+            if (slot_bytes && st.bytes >= slot_bytes) close_slot();
+        }
+    };
+    auto check_rotation = [&] {
+        struct stat sb{};
+        if (::fstat(in->fd(), &sb) == 0 && static_cast<std::uint64_t>(sb.st_size) < offset) {
+            tok.reset();           // Truncated in place: the partial word is gone
+            offset = 0;
+            return;
+        }
+        if (::stat(conf.input_path.c_str(), &sb) != 0 ||
+            (static_cast<std::uint64_t>(sb.st_dev) == in->device() && static_cast<std::uint64_t>(sb.st_ino) == in->inode())) {
+            return;                // Same file, or renamed away and not recreated yet
+        }
+        drain();
+        tok.finish();              // The old file's last word and line end here
+        try {
+            in = std::make_unique<InputFile>(conf.input_path, false);
+        } catch (const std::runtime_error&) {
+            return;                // Gone again; the next wake-up retries
+        }
+        offset = 0;
+        watcher.watch(conf.input_path, in->fd());
+        drain();
+    };
+    bool first = true;
+    auto report = [&] {
+        close_slot();
+        TopList top;
+        if (!conf.count_only) {
+            top = top_k(window.freq(), conf.topN);
+            while (!top.empty() && top.back().second == 0) top.pop_back();   // Words gone from the window
+        }
+        std::cout << "\n[" << iso8601_utc_now() << "] Window: last " << span << " (" << window.slots() << " slots)\n";
+        std::cout << "Lines:  " << window.lines() << "\n";
+        std::cout << "Words:  " << window.words() << "\n";
+        std::cout << "Bytes:  " << window.bytes() << "\n";
+        print_top(conf, top, {});
+        std::cout << std::flush;
+        if (!conf.json_path.empty()) write_window_json(conf, window, top, first);
+        first = false;
+    };
+
+    auto next_report = Clock::now() + interval;
+    while (!g_follow_stop) {
+        drain();
+        check_rotation();
+        auto now = Clock::now();
+        if (now >= next_report) {
+            report();
+            next_report += interval;
+            if (next_report <= now) next_report = now + interval;   // Fell behind: skip missed reports
+            continue;
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(next_report - now).count();
+        watcher.wait(static_cast<int>(std::max<long long>(1, ms)));
+    }
+    return 0;
+}
+
+#endif // !_WIN32
+
+// ---- Benchmark harness ---------------------------------------------------------
+
+// Parameters of the `bench` subcommand and of its synthetic corpus.
+struct BenchConfig
+{
+    std::size_t size = std::size_t(64) << 20;  // Corpus size in bytes
+    std::size_t vocab = 100000;   // Distinct words in the vocabulary
+    double zipf = 1.0;            // Zipf exponent of word popularity (0 = uniform)
+    std::size_t line_len = 80;    // Mean line length in bytes
+    std::size_t word_len = 6;     // Mean word length in bytes
+    std::uint64_t seed = 42;      // PRNG seed; the same seed yields the same corpus
+    unsigned repeat = 3;          // Runs per stage; the fastest is reported
+    std::size_t topN = 20;        // K used for the top-K stage
+    bool json = false;            // Emit one JSON object instead of a table
+    std::string save_path;        // If non-empty, also write the corpus here
+    bool verify = false;          // Check every engine against golden counts first
+    struct Limit
+    {
+        std::string stage;
+        double value;
+        bool per_token;           // A --max-ns-per-token ceiling, else a --min-mbps floor
+    };
+    std::vector<Limit> limits;    // Thresholds that fail the run when missed
+    std::string baseline;         // If non-empty, stage timings to hold the run to
+    double tolerance = 0.5;       // Allowed slowdown against the baseline, as a fraction
+    std::string record_path;      // If non-empty, write this run's timings here as a baseline
+};
+
+// Stages timed by `bench`, in report order, and the figures each one reports.
+struct BenchStage
+{
+    const char* name;
+    bool mbps;
+    bool ns_per_token;
+};
+static constexpr BenchStage kBenchStages[] = {{"io", true, false},       {"tokenize", true, true},
+                                              {"hash_insert", false, true}, {"analyze", true, true},
+                                              {"top_k", false, true},    {"json", false, false}};
+
+static void print_bench_help(const char* exe) {
+    std::cout   << "File Stats - Benchmark harness\n\n"
+                << "Usage:\n"
+                << "  " << exe << " bench [--size SIZE] [--vocab N] [--zipf S] [--line-len N] [--word-len N]\n"
+                << "                [--seed N] [--repeat N] [--top N] [--format text|json] [--save corpus.txt]\n"
+                << "                [--verify] [--min-mbps STAGE=N]... [--max-ns-per-token STAGE=N]...\n"
+                << "                [--baseline FILE] [--tolerance PCT] [--record-baseline FILE]\n\n"
+                << "Options:\n"
+                << "  --size SIZE        Corpus size, e.g. 64M or 1G (default: 64M)\n"
+                << "  --vocab N          Distinct words in the vocabulary (default: 100000)\n"
+                << "  --zipf S           Zipf skew of word popularity, 0 = uniform (default: 1.0)\n"
+                << "  --line-len N       Mean line length in bytes (default: 80)\n"
+                << "  --word-len N       Mean word length in bytes (default: 6)\n"
+                << "  --seed N           Corpus PRNG seed (default: 42)\n"
+                << "  --repeat N         Runs per stage, fastest reported (default: 3)\n"
+                << "  --top N            K for the top-K stage (default: 20)\n"
+                << "  --format FMT       text (default) or json (one object on stdout)\n"
+                << "  --save PATH        Also write the generated corpus to PATH\n"
+                << "  --verify           First check every engine against golden counts on edge-case\n"
+                << "                     corpora (CRLF, no final newline, giant lines, binary, empty)\n"
+                << "  --min-mbps STAGE=N Fail (exit 1) if STAGE runs below N MB/s\n"
+                << "  --max-ns-per-token STAGE=N\n"
+                << "                     Fail (exit 1) if STAGE takes more than N ns per token\n"
+                << "  --baseline FILE    Fail (exit 1) if a stage is slower than in FILE by more than the\n"
+                << "                     tolerance; record FILE on the same machine\n"
+                << "  --tolerance PCT    Allowed slowdown against the baseline in percent (default: 50)\n"
+                << "  --record-baseline FILE\n"
+                << "                     Write this run's timings to FILE for later --baseline runs\n"
+                << "Stages: io, tokenize, hash_insert, analyze, top_k, json\n";
+}
+
+// Parse a STAGE=N threshold of --min-mbps or --max-ns-per-token.
+static bool parse_bench_limit(const std::string& arg, bool per_token, BenchConfig& bc) {
+    std::size_t eq = arg.find('=');
+    std::string stage = arg.substr(0, eq);
+    bool known = false;
+    for (const BenchStage& s : kBenchStages) known |= stage == s.name && (per_token ? s.ns_per_token : s.mbps);
+    if (eq == std::string::npos || !known) {
+        std::cerr << "Expected STAGE=N with a stage that reports " << (per_token ? "ns/token" : "MB/s") << ", got: " << arg
+                  << "\n";
+        return false;
+    }
+    std::string number = arg.substr(eq + 1);
+    std::size_t used = 0;
+    double value = 0;
+    try {
+        value = std::stod(number, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != number.size() || !(value >= 0)) {
+        std::cerr << "Expected a non-negative number after " << stage << "=, got: " << arg << "\n";
+        return false;
+    }
+    bc.limits.push_back({stage, value, per_token});
+    return true;
+}
+
+static bool parse_bench_args(int argc, char** argv, BenchConfig& bc) {
+    int i = 2;
+    try {
+        for (; i < argc; ++i) {
+            std::string a = argv[i];
+            if (a == "--help" || a == "-h") {
+                print_bench_help(argv[0]);
+                std::exit(0);
+            } else if (a == "--size" && i + 1 < argc) {
+                bc.size = parse_size(argv[++i]);
+            } else if (a == "--vocab" && i + 1 < argc) {
+                bc.vocab = std::max<std::size_t>(1, std::stoul(argv[++i]));
+            } else if (a == "--zipf" && i + 1 < argc) {
+                bc.zipf = std::stod(argv[++i]);
+            } else if (a == "--line-len" && i + 1 < argc) {
+                bc.line_len = std::max<std::size_t>(1, std::stoul(argv[++i]));
+            } else if (a == "--word-len" && i + 1 < argc) {
+                bc.word_len = std::max<std::size_t>(1, std::stoul(argv[++i]));
+            } else if (a == "--seed" && i + 1 < argc) {
+                bc.seed = std::stoull(argv[++i]);
+            } else if (a == "--repeat" && i + 1 < argc) {
+                bc.repeat = std::max(1u, static_cast<unsigned>(std::stoul(argv[++i])));
+            } else if (a == "--top" && i + 1 < argc) {
+                bc.topN = std::stoul(argv[++i]);
+            } else if (a == "--format" && i + 1 < argc) {
+                std::string f = argv[++i];
+                if (f != "text" && f != "json") {
+                    std::cerr << "Unknown format: " << f << "\n";
+                    return false;
+                }
+                bc.json = f == "json";
+            } else if (a == "--save" && i + 1 < argc) {
+                bc.save_path = argv[++i];
+            } else if (a == "--verify") {
+                bc.verify = true;
+            } else if (a == "--min-mbps" && i + 1 < argc) {
+                if (!parse_bench_limit(argv[++i], false, bc)) return false;
+            } else if (a == "--max-ns-per-token" && i + 1 < argc) {
+                if (!parse_bench_limit(argv[++i], true, bc)) return false;
+            } else if (a == "--baseline" && i + 1 < argc) {
+                bc.baseline = argv[++i];
+            } else if (a == "--tolerance" && i + 1 < argc) {
+                std::size_t used = 0;
+                bc.tolerance = std::stod(argv[++i], &used) / 100;
+                if (argv[i][used] != '\0' || !(bc.tolerance >= 0)) throw std::invalid_argument(argv[i]);
+            } else if (a == "--record-baseline" && i + 1 < argc) {
+                bc.record_path = argv[++i];
+            } else {
+                std::cerr << "Unknown argument: " << a << "\n";
+                return false;
+            }
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Invalid value for " << argv[i - 1] << ": " << argv[i] << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Build a synthetic corpus: `vocab` random alphanumeric words (lengths uniform around
+// word_len, ~10% capitalized to exercise case folding) drawn with Zipf(zipf) popularity
+// and packed into lines of roughly line_len bytes.
+static std::string generate_corpus(const BenchConfig& bc) {
+    std::mt19937_64 rng(bc.seed);
+    static const char kAlphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::uniform_int_distribution<std::size_t> letter(0, 25), alnum(0, sizeof(kAlphabet) - 2);
+    std::uniform_int_distribution<std::size_t> wlen(1, 2 * bc.word_len - 1);
+    std::vector<std::string> words(bc.vocab);
+    for (auto& w : words) {
+        std::size_t n = wlen(rng);
+        w.push_back(kAlphabet[letter(rng)]);
+        while (w.size() < n) w.push_back(kAlphabet[alnum(rng)]);
+        if (rng() % 10 == 0) w[0] = static_cast<char>(w[0] - 'a' + 'A');
+    }
+
+    // Inverse-CDF sampling over the Zipf weights 1/rank^s.
+    std::vector<double> cdf(bc.vocab);
+    double total = 0;
+    for (std::size_t r = 0; r < bc.vocab; ++r) {
+        total += 1.0 / std::pow(static_cast<double>(r + 1), bc.zipf);
+        cdf[r] = total;
+    }
+    std::uniform_real_distribution<double> pick(0, total);
+    std::uniform_int_distribution<std::size_t> llen(bc.line_len / 2 + 1, bc.line_len + bc.line_len / 2);
+
+    std::string out;
+    out.reserve(bc.size + 2 * bc.word_len + 2);
+    while (out.size() < bc.size) {
+        std::size_t target = out.size() + llen(rng);
+        bool first = true;
+        while (out.size() < target) {
+            if (!first) out.push_back(' ');
+            std::size_t r = std::lower_bound(cdf.begin(), cdf.end(), pick(rng)) - cdf.begin();
+            out += words[std::min(r, bc.vocab - 1)];
+            first = false;
+        }
+        out.push_back('\n');
+    }
+    return out;
+}
+
+// Best-of-N wall time of one stage, in seconds.
+template <class Fn>
+static double time_best(unsigned repeat, Fn&& fn) {
+    double best = 0;
+    for (unsigned r = 0; r < repeat; ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        fn();
+        double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (r == 0 || dt < best) best = dt;
+    }
+    return best;
+}
+
+struct BenchResult
+{
+    const char* stage;
+    double seconds;
+    std::uint64_t bytes;    // Bytes processed (0 if throughput is not meaningful)
+    std::uint64_t tokens;   // Tokens processed (0 if per-token cost is not meaningful)
+};
+
+// ---- bench baselines -----------------------------------------------------------------
+// A baseline file holds the fastest time of each stage from an earlier run:
+//
+//   # comment
+//   corpus size=67108864 vocab=100000 zipf=1 line_len=80 word_len=6 seed=42
+//   kernel avx2
+//   io 0.005871
+//   ...
+//
+// Timings only compare on the same corpus and scan kernel; otherwise the check is skipped.
+
+struct BenchBaseline
+{
+    std::string corpus;
+    std::string kernel;
+    std::vector<std::pair<std::string, double>> seconds;   // Stage -> fastest time
+};
+
+static std::string bench_corpus_key(const BenchConfig& bc) {
+    std::ostringstream key;
+    key << "size=" << bc.size << " vocab=" << bc.vocab << " zipf=" << bc.zipf << " line_len=" << bc.line_len
+        << " word_len=" << bc.word_len << " seed=" << bc.seed;
+    return key.str();
+}
+
+static BenchBaseline read_bench_baseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("Cannot open bench baseline: " + path);
+    BenchBaseline b;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::size_t sp = line.find(' ');
+        std::string key = line.substr(0, sp), rest = sp == std::string::npos ? "" : line.substr(sp + 1);
+        if (key == "corpus") {
+            b.corpus = rest;
+        } else if (key == "kernel") {
+            b.kernel = rest;
+        } else {
+            std::size_t used = 0;
+            double t = -1;
+            try {
+                t = std::stod(rest, &used);
+            } catch (const std::exception&) {
+            }
+            if (rest.empty() || used != rest.size() || !(t > 0)) throw std::runtime_error("Malformed bench baseline line in " + path + ": " + line);
+            b.seconds.emplace_back(key, t);
+        }
+    }
+    if (b.corpus.empty() || b.kernel.empty()) throw std::runtime_error("Malformed bench baseline: " + path);
+    return b;
+}
+
+static void write_bench_baseline(const std::string& path, const BenchConfig& bc,
+                                 const std::vector<BenchResult>& results) {
+    std::ofstream out(path, std::ios::trunc);
+    out << "# file_stats bench baseline: fastest seconds per stage of " << bc.repeat << " runs.\n"
+        << "# Recorded with: file_stats bench --record-baseline " << path << "\n"
+        << "corpus " << bench_corpus_key(bc) << "\n"
+        << "kernel " << scan_kernel().name << "\n";
+    for (const BenchResult& r : results) out << r.stage << " " << std::setprecision(6) << r.seconds << "\n";
+    if (!out.flush()) throw std::runtime_error("Cannot write bench baseline: " + path);
+}
+
+// ---- bench --verify ------------------------------------------------------------------
+//
+// Every engine is checked against golden results from a deliberately naive reference: a
+// byte loop over the ASCII word chars counting words into a std::unordered_map and exact
+// lengths into std::maps. It shares no code with the tokenizer, the scan kernels, the
+// word tables, LengthHistogram or the top-K ranking. Exact engines must agree on bytes,
+// lines, words, the distinct count and the top-K, and their length histograms must hold
+// the exact lengths as documented; --approx-top must stay within the Space-Saving bounds.
+
+struct Golden
+{
+    std::uint64_t lines = 0;
+    std::uint64_t words = 0;
+    std::map<std::uint64_t, std::uint64_t> line_lengths;   // Length -> occurrences
+    std::map<std::uint64_t, std::uint64_t> word_lengths;
+    std::unordered_map<std::string, std::uint64_t> counts;
+};
+
+static Golden golden_counts(std::string_view data) {
+    Golden g;
+    std::string word;
+    std::uint64_t line = 0;
+    auto end_word = [&] {
+        if (word.empty()) return;
+        ++g.words;
+        ++g.word_lengths[word.size()];
+        ++g.counts[word];
+        word.clear();
+    };
+    for (char ch : data) {
+        unsigned char c = static_cast<unsigned char>(ch);
+        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) {
+            word.push_back(ch);
+        } else if (c >= 'A' && c <= 'Z') {
+            word.push_back(static_cast<char>(c - 'A' + 'a'));
+        } else {
+            end_word();
+        }
+        if (c == '\n') {
+            ++g.lines;
+            ++g.line_lengths[line];
+            line = 0;
+        } else {
+            ++line;
+        }
+    }
+    end_word();
+    if (!data.empty() && data.back() != '\n') {
+        ++g.lines;
+        ++g.line_lengths[line];
+    }
+    return g;
+}
+
+// The k most frequent words: count descending, then bytewise by word.
+static TopList golden_top(const Golden& g, std::size_t k) {
+    std::vector<std::pair<const std::string*, std::uint64_t>> all;
+    for (const auto& [w, c] : g.counts) all.emplace_back(&w, c);
+    std::sort(all.begin(), all.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : *a.first < *b.first;
+    });
+    TopList top;
+    for (std::size_t i = 0; i < std::min(k, all.size()); ++i) top.emplace_back(*all[i].first, all[i].second);
+    return top;
+}
+
+// Words in messages are cut short; one of the corpora is a single 3 MB word.
+static std::string_view shown(std::string_view w) { return w.substr(0, 32); }
+
+// How `h` fails to hold the exact `lengths`, or "". The layout is checked as documented
+// rather than through LengthHistogram::bucket(): lengths below 16 have a bucket each, and
+// length v with highest set bit p >= 4 is in bucket 16 + 8 (p - 4) + the three bits below
+// bit p. Percentiles must be exact below 16, otherwise at most 1/8 above the true one.
+static std::string verify_lengths(const char* what, const LengthHistogram& h,
+                                  const std::map<std::uint64_t, std::uint64_t>& lengths) {
+    std::ostringstream why;
+    std::uint64_t n = 0, sum = 0, max = 0;
+    std::map<unsigned, std::uint64_t> buckets;
+    for (const auto& [v, c] : lengths) {
+        n += c;
+        sum += v * c;
+        max = v;
+        unsigned p = 0;
+        while (p < 63 && (v >> (p + 1)) != 0) ++p;
+        buckets[v < 16 ? static_cast<unsigned>(v) : 16 + 8 * (p - 4) + static_cast<unsigned>((v >> (p - 3)) & 7)] += c;
+    }
+    if (h.total() != n || h.sum != sum || h.max != max) {
+        why << what << " lengths: " << h.total() << " / sum " << h.sum << " / max " << h.max << ", expected " << n
+            << " / sum " << sum << " / max " << max;
+        return why.str();
+    }
+    for (unsigned b = 0; b < LengthHistogram::kBuckets; ++b) {
+        auto it = buckets.find(b);
+        std::uint64_t want = it == buckets.end() ? 0 : it->second;
+        if (h.counts[b] != want) {
+            why << what << " length bucket " << b << " holds " << h.counts[b] << ", expected " << want;
+            return why.str();
+        }
+    }
+    for (double q : {0.5, 0.9, 0.99}) {
+        std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(n))));
+        std::uint64_t exact = 0, seen = 0;
+        for (const auto& [v, c] : lengths) {
+            exact = v;
+            if ((seen += c) >= rank) break;
+        }
+        std::uint64_t got = h.percentile(q);
+        if (n > 0 && (exact < 16 ? got != exact : got < exact || got > exact + exact / 8 || got > max)) {
+            why << what << " length p" << q * 100 << " is " << got << ", exact " << exact;
+            return why.str();
+        }
+    }
+    return why.str();
+}
+
+// How the totals of `st` differ from the golden ones, or "" if they agree.
+static std::string verify_totals(const Stats& st, const Golden& g, std::uint64_t size) {
+    std::ostringstream why;
+    if (st.bytes != size) why << "bytes " << st.bytes << ", expected " << size;
+    else if (st.lines != g.lines) why << "lines " << st.lines << ", expected " << g.lines;
+    else if (st.words != g.words) why << "words " << st.words << ", expected " << g.words;
+    if (!why.str().empty()) return why.str();
+    std::string lengths = verify_lengths("line", st.lengths.line, g.line_lengths);
+    return lengths.empty() ? verify_lengths("word", st.lengths.word, g.word_lengths) : lengths;
+}
+
+static std::string verify_exact(const Stats& st, const TopList& top, const Golden& g, std::uint64_t size,
+                                std::size_t k) {
+    std::string why = verify_totals(st, g, size);
+    if (!why.empty()) return why;
+    std::ostringstream out;
+    const TopList want = golden_top(g, k);
+    if (distinct_words(st) != g.counts.size()) {
+        out << "distinct " << distinct_words(st) << ", expected " << g.counts.size();
+    } else if (top.size() != want.size()) {
+        out << "top-K has " << top.size() << " entries, expected " << want.size();
+    } else {
+        for (std::size_t i = 0; i < top.size(); ++i) {
+            if (top[i] == want[i]) continue;
+            out << "rank " << i + 1 << " is " << shown(top[i].first) << " " << top[i].second << ", expected "
+                << shown(want[i].first) << " " << want[i].second;
+            break;
+        }
+    }
+    return out.str();
+}
+
+// Every monitored count must bound the true count from above, and from below after
+// subtracting its error; every word counted more often than the smallest counter must
+// be monitored.
+static std::string verify_approx(const Stats& st, const Golden& g, std::uint64_t size) {
+    std::string why = verify_totals(st, g, size);
+    if (!why.empty()) return why;
+    std::ostringstream out;
+    std::unordered_map<std::string_view, std::uint64_t> monitored;
+    for (const SpaceSaving::Counter& c : st.sketch->counters()) {
+        auto it = g.counts.find(c.word);
+        std::uint64_t truth = it == g.counts.end() ? 0 : it->second;
+        if (truth > c.count || c.count - c.error > truth) {
+            out << shown(c.word) << " counted " << c.count << " (error " << c.error << "), true count " << truth;
+            return out.str();
+        }
+        monitored.emplace(c.word, c.count);
+    }
+    for (const auto& [w, n] : g.counts) {
+        if (n > st.sketch->min_count() && monitored.count(w) == 0) {
+            out << shown(w) << " (count " << n << ") is not monitored";
+            break;
+        }
+    }
+    return out.str();
+}
+
+// Ways to run analyze_file that must all produce the golden results.
+struct VerifyEngine
+{
+    const char* name;
+    void (*setup)(Config&);
+};
+
+static const VerifyEngine kVerifyEngines[] = {
+    {"scalar", [](Config& c) { c.simd = false; }},
+    {"simd", [](Config&) {}},
+    {"pread", [](Config& c) { c.io = IoEngine::Pread; }},
+#if defined(FILE_STATS_WITH_URING) && defined(__linux__)
+    {"uring", [](Config& c) { c.io = IoEngine::Uring; }},
+#endif
+    {"threads", [](Config& c) { c.threads = 4; }},
+    {"sharded", [](Config& c) {
+         c.threads = 4;
+         c.table = TableBackend::Sharded;
+     }},
+    {"numa", [](Config& c) {
+         c.threads = 4;
+         c.numa = true;
+     }},
+    {"presized", [](Config& c) { c.estimate_unique = true; }},
+#if defined(FILE_STATS_WITH_CUDA)
+    {"gpu", [](Config& c) { c.gpu = true; }},
+#endif
+};
+
+#if !defined(_WIN32)
+// Analyze `bytes` as they arrive through a pipe, so InputFile cannot map them and the
+// run goes through read_some() like a redirected stdin does.
+static Stats analyze_piped(const Config& conf, std::string_view bytes) {
+    int fds[2];
+    if (::pipe(fds) != 0) throw std::runtime_error(std::string("Cannot create pipe: ") + std::strerror(errno));
+    std::signal(SIGPIPE, SIG_IGN);   // The read end may close before everything is written
+    std::thread writer([&bytes, fd = fds[1]] {
+        for (std::size_t done = 0; done < bytes.size();) {
+            ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += static_cast<std::size_t>(n);
+        }
+        ::close(fd);
+    });
+    try {
+        Stats st = analyze_file(conf, "/dev/fd/" + std::to_string(fds[0]));
+        ::close(fds[0]);
+        writer.join();
+        return st;
+    } catch (...) {
+        ::close(fds[0]);
+        writer.join();
+        throw;
+    }
+}
+#endif
+
+struct VerifyFailure
+{
+    std::string corpus;
+    std::string engine;
+    std::string reason;
+};
+
+// Check every engine, a piped read and --approx-top on the synthetic corpus and on edge cases for
+// the chunk splitters, the line joins and the kernels' block tails. The text cases are
+// built from 6 MB of synthetic text, so that --threads splits them. The corpora are
+// written to `path` in turn; `checks` receives the number of runs.
+static std::vector<VerifyFailure> run_verify(const BenchConfig& bc, const std::string& synthetic,
+                                             const std::string& path, std::size_t& checks) {
+    BenchConfig small = bc;
+    small.size = 6 * kMinChunkSize;
+    const std::string base = generate_corpus(small);
+    std::string crlf, giant;
+    for (char c : base) {
+        if (c == '\n') crlf.push_back('\r');
+        crlf.push_back(c);
+    }
+    giant = base;   // Three lines of about 2.5 MB
+    for (std::size_t i = 0, keep = 5 * kMinChunkSize / 2; i < giant.size(); ++i) {
+        if (giant[i] != '\n' || i + 1 == giant.size()) continue;
+        if (i >= keep) keep += 5 * kMinChunkSize / 2;
+        else giant[i] = ' ';
+    }
+    const std::string one_word(3 * kMinChunkSize, 'x');
+    std::string binary(6 * kMinChunkSize, '\0');
+    std::mt19937_64 rng(bc.seed);
+    for (char& c : binary) c = static_cast<char>(rng());
+    const std::pair<const char*, std::string_view> corpora[] = {
+        {"synthetic", synthetic},
+        {"crlf", crlf},
+        {"no-final-newline", std::string_view(base).substr(0, base.size() - 1)},
+        {"giant-lines", giant},
+        {"one-word", one_word},
+        {"binary", binary},
+        {"empty", std::string_view()},
+    };
+
+    const std::size_t k = std::max<std::size_t>(bc.topN, 1);
+    std::vector<VerifyFailure> failures;
+    checks = 0;
+    auto check = [&](const char* corpus, const char* engine, auto&& run) {
+        ++checks;
+        std::string why;
+        try {
+            why = run();
+        } catch (const std::exception& ex) {
+            why = std::string("error: ") + ex.what();
+        }
+        if (!why.empty()) failures.push_back({corpus, engine, why});
+    };
+    for (const auto& [name, bytes] : corpora) {
+        {
+            std::ofstream f(path, std::ios::binary | std::ios::trunc);
+            if (!f.write(bytes.data(), static_cast<std::streamsize>(bytes.size()))) {
+                throw std::runtime_error("Cannot write corpus file: " + path);
+            }
+        }
+        const Golden g = golden_counts(bytes);
+        for (const VerifyEngine& e : kVerifyEngines) {
+            check(name, e.name, [&] {
+                Config conf;
+                conf.topN = k;
+                e.setup(conf);
+                Stats st = analyze_file(conf, path);
+                return verify_exact(st, top_k(st, k, conf.threads), g, bytes.size(), k);
+            });
+        }
+#if !defined(_WIN32)
+        check(name, "stream", [&] {
+            Config conf;
+            conf.topN = k;
+            Stats st = analyze_piped(conf, bytes);
+            return verify_exact(st, top_k(st, k, conf.threads), g, bytes.size(), k);
+        });
+#endif
+        check(name, "approx", [&] {
+            Config conf;
+            conf.topN = k;
+            conf.approx = true;
+            conf.memory_budget = 256 * SpaceSaving::kBytesPerCounter;   // Small enough to evict
+            return verify_approx(analyze_file(conf, path), g, bytes.size());
+        });
+    }
+    std::remove(path.c_str());
+    return failures;
+}
+
+// Run every pipeline stage in isolation on a synthetic corpus and report throughput.
+[[maybe_unused]] static int run_bench(int argc, char** argv) {
+    BenchConfig bc;
+    if (!parse_bench_args(argc, argv, bc)) {
+        print_bench_help(argv[0]);
+        return 1;
+    }
+
+    try {
+        // Load the baseline up front so a bad file fails before the long runs.
+        BenchBaseline baseline;
+        std::string baseline_note;
+        if (!bc.baseline.empty() && !bc.record_path.empty()) {
+            baseline_note = "not compared while recording";
+        } else if (!bc.baseline.empty()) {
+            baseline = read_bench_baseline(bc.baseline);
+            if (baseline.corpus != bench_corpus_key(bc)) baseline_note = "recorded for another corpus";
+            else if (baseline.kernel != scan_kernel().name) baseline_note = "recorded with the " + baseline.kernel + " kernel";
+        }
+
+        const std::string corpus = generate_corpus(bc);
+        const std::string path = bc.save_path.empty() ? "file_stats_bench.tmp" : bc.save_path;
+        {
+            std::ofstream f(path, std::ios::binary);
+            if (!f.write(corpus.data(), static_cast<std::streamsize>(corpus.size()))) {
+                throw std::runtime_error("Cannot write corpus file: " + path);
+            }
+        }
+
+        // Correctness first; the stages are timed either way.
+        std::size_t checks = 0;
+        std::vector<VerifyFailure> failures;
+        if (bc.verify) failures = run_verify(bc, corpus, path + ".verify", checks);
+
+        Config conf;
+        std::vector<BenchResult> results;
+
+        // I/O: stream the corpus file through the read() path (page cache, no tokenizing).
+        std::uint64_t io_bytes = 0;
+        double t = time_best(bc.repeat, [&] {
+            InputFile in(path);
+            std::vector<char> buf(kReadBufferSize);
+            io_bytes = 0;
+            while (std::size_t n = in.read_some(buf.data(), buf.size())) io_bytes += n;
+        });
+        results.push_back({"io", t, io_bytes, 0});
+
+        // Tokenize: boundary scan only (counts-only kernel).
+        Stats counted;
+        conf.count_only = true;
+        t = time_best(bc.repeat, [&] {
+            counted = Stats();
+            Tokenizer tok(conf, counted);
+            tok.feed(corpus.data(), corpus.size());
+            tok.finish();
+        });
+        results.push_back({"tokenize", t, corpus.size(), counted.words});
+
+        // Hash insert: pre-split tokens inserted into a fresh table.
+        std::vector<std::string_view> tokens;
+        tokens.reserve(counted.words);
+        for (std::size_t i = 0, n = corpus.size(); i < n;) {
+            while (i < n && !is_word_char(static_cast<unsigned char>(corpus[i]))) ++i;
+            std::size_t b = i;
+            while (i < n && is_word_char(static_cast<unsigned char>(corpus[i]))) ++i;
+            if (i > b) tokens.emplace_back(corpus.data() + b, i - b);
+        }
+        t = time_best(bc.repeat, [&] {
+            WordTable table;
+            for (std::string_view w : tokens) ++table[w];
+        });
+        results.push_back({"hash_insert", t, 0, tokens.size()});
+
+        // Full analysis: tokenize + case folding + table insert, as analyze_file does.
+        Stats st;
+        conf.count_only = false;
+        t = time_best(bc.repeat, [&] {
+            st = Stats();
+            Tokenizer tok(conf, st);
+            tok.feed(corpus.data(), corpus.size());
+            tok.finish();
+        });
+        results.push_back({"analyze", t, corpus.size(), st.words});
+
+        TopList top;
+        t = time_best(bc.repeat, [&] { top = top_k(st.freq, bc.topN); });
+        results.push_back({"top_k", t, 0, st.freq.size()});
+
+        conf.json_path = path + ".json";
+        t = time_best(bc.repeat, [&] { write_json(conf, st, top, {}); });
+        results.push_back({"json", t, 0, 0});
+
+        std::remove(conf.json_path.c_str());
+        if (bc.save_path.empty()) std::remove(path.c_str());
+
+        auto mbps = [](const BenchResult& r) { return r.bytes ? r.bytes / r.seconds / 1e6 : 0.0; };
+        auto nspt = [](const BenchResult& r) { return r.tokens ? r.seconds * 1e9 / r.tokens : 0.0; };
+        struct LimitResult
+        {
+            const BenchConfig::Limit* limit;
+            double measured;
+            bool ok;
+        };
+        std::vector<LimitResult> limits;
+        bool missed = !failures.empty();
+        for (const BenchConfig::Limit& l : bc.limits) {
+            for (const BenchResult& r : results) {
+                if (l.stage != r.stage) continue;
+                double m = l.per_token ? nspt(r) : mbps(r);
+                limits.push_back({&l, m, l.per_token ? m <= l.value : m >= l.value});
+                missed |= !limits.back().ok;
+            }
+        }
+        // Stages without MB/s or ns/token (json) are too short to hold to a baseline.
+        struct BaselineResult
+        {
+            const char* stage;
+            double seconds;
+            double baseline;
+            bool ok;
+        };
+        std::vector<BaselineResult> compared;
+        if (!baseline.corpus.empty() && baseline_note.empty()) {
+            for (const BenchResult& r : results) {
+                if (!r.bytes && !r.tokens) continue;
+                for (const auto& [stage, seconds] : baseline.seconds) {
+                    if (stage != r.stage) continue;
+                    compared.push_back({r.stage, r.seconds, seconds, r.seconds <= seconds * (1 + bc.tolerance)});
+                    missed |= !compared.back().ok;
+                }
+            }
+        }
+        if (!bc.record_path.empty()) write_bench_baseline(bc.record_path, bc, results);
+        if (bc.json) {
+            std::cout << "{\"tool\": \"file-stats-bench\", \"timestamp\": \"" << iso8601_utc_now() << "\""
+                      << ", \"kernel\": \"" << scan_kernel().name << "\""
+                      << ", \"corpus\": {\"bytes\": " << corpus.size() << ", \"vocab\": " << bc.vocab
+                      << ", \"zipf\": " << bc.zipf << ", \"line_len\": " << bc.line_len
+                      << ", \"word_len\": " << bc.word_len << ", \"seed\": " << bc.seed
+                      << ", \"tokens\": " << st.words << ", \"distinct\": " << st.freq.size() << "}"
+                      << ", \"stages\": [";
+            for (std::size_t i = 0; i < results.size(); ++i) {
+                const BenchResult& r = results[i];
+                std::cout << (i ? ", " : "") << "{\"stage\": \"" << r.stage << "\", \"seconds\": " << r.seconds
+                          << ", \"mb_per_s\": " << mbps(r) << ", \"ns_per_token\": " << nspt(r) << "}";
+            }
+            std::cout << "]";
+            if (bc.verify) {
+                std::cout << ", \"verify\": {\"checks\": " << checks << ", \"failures\": [";
+                for (std::size_t i = 0; i < failures.size(); ++i) {
+                    std::cout << (i ? ", " : "") << "{\"corpus\": \"" << failures[i].corpus << "\", \"engine\": \""
+                              << failures[i].engine << "\", \"reason\": \"" << failures[i].reason
+                              << "\"}";
+                }
+                std::cout << "]}";
+            }
+            if (!limits.empty()) {
+                std::cout << ", \"limits\": [";
+                for (std::size_t i = 0; i < limits.size(); ++i) {
+                    const LimitResult& l = limits[i];
+                    std::cout << (i ? ", " : "") << "{\"stage\": \"" << l.limit->stage << "\", \""
+                              << (l.limit->per_token ? "max_ns_per_token" : "min_mb_per_s")
+                              << "\": " << l.limit->value << ", \"measured\": " << l.measured
+                              << ", \"ok\": " << (l.ok ? "true" : "false") << "}";
+                }
+                std::cout << "]";
+            }
+            if (!bc.baseline.empty()) {
+                std::cout << ", \"baseline\": {\"path\": \"" << bc.baseline << "\", \"tolerance\": " << bc.tolerance;
+                if (!baseline_note.empty()) std::cout << ", \"skipped\": \"" << baseline_note << "\"";
+                std::cout << ", \"stages\": [";
+                for (std::size_t i = 0; i < compared.size(); ++i) {
+                    const BaselineResult& b = compared[i];
+                    std::cout << (i ? ", " : "") << "{\"stage\": \"" << b.stage << "\", \"seconds\": " << b.seconds
+                              << ", \"baseline\": " << b.baseline << ", \"ok\": " << (b.ok ? "true" : "false") << "}";
+                }
+                std::cout << "]}";
+            }
+            std::cout << "}\n";
+        } else {
+            std::cout << "Corpus: " << corpus.size() << " bytes, " << st.words << " tokens, " << st.freq.size()
+                      << " distinct (vocab " << bc.vocab << ", zipf " << bc.zipf << ")\n"
+                      << "Kernel: " << scan_kernel().name << "\n"
+                      << "  stage              seconds       MB/s   ns/token\n";
+            for (const BenchResult& r : results) {
+                std::cout << "  " << std::left << std::setw(14) << r.stage << std::right << std::fixed
+                          << std::setprecision(6) << std::setw(12) << r.seconds << std::setprecision(1)
+                          << std::setw(11) << mbps(r) << std::setprecision(2) << std::setw(11) << nspt(r) << "\n";
+            }
+            if (bc.verify) {
+                if (failures.empty()) {
+                    std::cout << "Verify: all " << checks << " checks passed\n";
+                } else {
+                    std::cout << "Verify: " << failures.size() << " of " << checks << " checks FAILED\n";
+                    for (const VerifyFailure& f : failures) {
+                        std::cout << "  " << f.corpus << " / " << f.engine << ": " << f.reason << "\n";
+                    }
+                }
+            }
+            for (const LimitResult& l : limits) {
+                std::cout << "Limit:  " << l.limit->stage << (l.limit->per_token ? " <= " : " >= ")
+                          << std::defaultfloat << l.limit->value << (l.limit->per_token ? " ns/token" : " MB/s")
+                          << ", measured " << std::fixed << std::setprecision(2) << l.measured << (l.ok ? "\n" : " FAILED\n");
+            }
+            if (!bc.baseline.empty()) {
+                std::cout << "Baseline: " << bc.baseline << ", tolerance " << std::defaultfloat << bc.tolerance * 100 << "%";
+                if (!baseline_note.empty()) std::cout << ", " << baseline_note << "; skipped";
+                std::cout << "\n";
+            }
+            for (const BaselineResult& b : compared) {
+                std::cout << "  " << std::left << std::setw(14) << b.stage << std::right << std::fixed << std::setprecision(6)
+                          << std::setw(12) << b.seconds << " vs " << b.baseline << std::showpos << std::setprecision(1)
+                          << std::setw(8) << (b.seconds / b.baseline - 1) * 100 << "%" << std::noshowpos
+                          << (b.ok ? "\n" : " FAILED\n");
+            }
+            if (!bc.record_path.empty()) std::cout << "Recorded baseline: " << bc.record_path << "\n";
+        }
+        return missed ? 1 : 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 2;
+    }
+}
+
+// Library builds (-DFILE_STATS_NO_MAIN, see file_stats.h) leave out main(); the tool's
+// entry points above are marked [[maybe_unused]] for them.
+#if !defined(FILE_STATS_NO_MAIN)
+int main(int argc, char** argv) {
+    std::ios::sync_with_stdio(false); // Faster I/O for large files
+    std::setlocale(LC_ALL, "");       // Optional: enable system C-locale (safe under Windows)
+
+    if (argc >= 2 && std::string(argv[1]) == "bench") return run_bench(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "merge") return run_merge(argc, argv);
+#if !defined(_WIN32)
+    if (argc >= 2 && std::string(argv[1]) == "worker") return run_worker(argc, argv);
+#endif
+
+    Config conf;
+    if (!parse_args(argc, argv, conf)) {
+        print_help(argv[0]);
+        return 1;                      // Bad usage → show help and exit non-zero
+    }
+
+    try {
+        g_huge_pages = conf.huge_pages;
+        conf.rules = make_rules(conf);
+        std::unique_ptr<Profile> prof;
+        if (conf.profile) {
+            prof = std::make_unique<Profile>();
+            prof->counters.start();
+        }
+#if !defined(_WIN32)
+        if (!conf.workers.empty()) return run_coordinator(conf, prof.get());
+#endif
+        if (is_batch(conf)) return run_batch(conf, prof.get());
+#if !defined(_WIN32)
+        if (conf.follow) return run_follow(conf);
+#endif
+
+        std::string state_note;
+        Stats st = conf.state_path.empty() ? analyze_file(conf, prof.get())
+                                           : analyze_incremental(conf, conf.input_path, state_note, prof.get());
+        StageTimer timer(prof.get());
+        TopList top;
+        std::vector<std::uint64_t> top_error;   // Approximate mode only
+        if (st.sketch) {
+            for (const SpaceSaving::Counter* c : st.sketch->top(conf.topN)) {
+                top.emplace_back(c->word, c->count);
+                top_error.push_back(c->error);
+            }
+        } else if (!conf.count_only) {
+            top = top_k(st, conf.topN, conf.threads);
+        }
+        NgramList ngram_top;
+        if (st.ngrams) ngram_top = top_ngrams(*st.ngrams, conf.topN);
+        timer.lap("top_k");
+
+        // Human-readable report.
+        std::cout << "File:   " << display_name(conf.input_path) << "\n";
+        print_counts(st);
+        if (!state_note.empty()) std::cout << "State:  " << state_note << "\n";
+        print_top(conf, top, top_error);
+        if (st.ngrams) print_top_ngrams(conf, ngram_top);
+
+        if (!conf.snapshot_path.empty()) {
+            write_snapshot(conf.snapshot_path, st, conf.case_sensitive);
+            timer.lap("snapshot");
+            std::cout << "\nSnapshot written to: " << conf.snapshot_path << "\n";
+        }
+
+        timer.lap("report");
+
+        // Optional JSON export. Its own timing can only appear in the text profile.
+        if (!conf.json_path.empty()) {
+            if (prof) prof->counters.stop();
+            write_json(conf, st, top, top_error, prof.get(), ngram_top);
+            timer.lap("json");
+            std::cout << "\nJSON written to: " << conf.json_path << "\n";
+        }
+        if (prof) {
+            if (conf.json_path.empty()) prof->counters.stop();
+            print_profile(*prof, st, conf.simd ? scan_kernel().name : "scalar");
+        }
+
+        return 0; // Success
+    } catch (const std::exception& ex) {
+        // Any I/O or processing error is reported here.
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 2;
+    }
+}
+#endif // FILE_STATS_NO_MAIN
@@ -0,0 +1,68 @@
+// file_stats library API: the tokenizer and word table of the file_stats tool, for
+// programs that analyze many documents in-process instead of running the binary.
+// Build file_stats.cpp with -DFILE_STATS_NO_MAIN to leave out the command-line tool.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace file_stats
+{
+
+// Counting options; the defaults match the command-line tool.
+struct Options
+{
+    bool case_sensitive = false; // Count "Word" and "word" separately
+    bool utf8 = false;           // Unicode letters/digits are word chars (see --utf8)
+    bool count_only = false;     // Only count lines/words/bytes; no frequency table
+    bool simd = true;            // Use the vectorized scanner
+};
+
+using WordCount = std::pair<std::string_view, std::uint64_t>;
+
+// Incremental analyzer for one document at a time:
+//   feed() the bytes in any number of pieces, finish(), read the results, reset().
+// reset() keeps the word table's capacity and key storage, so once an Analyzer has
+// seen its largest document, further documents are analyzed without allocating.
+// Not thread-safe; use one Analyzer per thread.
+class Analyzer
+{
+public:
+    explicit Analyzer(const Options& options = Options());
+    ~Analyzer();
+    Analyzer(Analyzer&&) noexcept;
+    Analyzer& operator=(Analyzer&&) noexcept;
+
+    // Scan the next bytes of the document. Words and lines may span calls.
+    void feed(const char* data, std::size_t size);
+    void feed(std::string_view bytes) { feed(bytes.data(), bytes.size()); }
+
+    // End the document: count the trailing word and an unterminated last line.
+    void finish();
+
+    // Forget the document, keeping allocated capacity for the next one.
+    void reset();
+
+    std::uint64_t lines() const;
+    std::uint64_t words() const;
+    std::uint64_t bytes() const;
+    std::size_t distinct() const;
+
+    // The k most frequent words, highest count first (ties by word), written to `out`
+    // (whose capacity is reused). The views stay valid until reset() or destruction.
+    void top(std::size_t k, std::vector<WordCount>& out) const;
+
+    // Visit every (word, count) pair, in unspecified order.
+    void for_each(const std::function<void(std::string_view, std::uint64_t)>& fn) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace file_stats
@@ -0,0 +1,653 @@
+// CUDA backend for --gpu (see file_stats_cuda.h). Build it with nvcc and link it into a
+// file_stats built with -DFILE_STATS_WITH_CUDA (see README):
+//   nvcc -std=c++17 -O2 -arch=sm_70 -c file_stats_cuda.cu -o file_stats_cuda.o
+//
+// The input goes to the device in chunks that end after a separator byte, through two
+// pinned staging buffers, so staging and copying the next chunk overlap the kernels of
+// the current one. For each chunk, the word starts, word ends and newlines are compacted
+// into position lists (cub::DeviceSelect), the word and line lengths are binned, and every
+// word is inserted into one device-wide open-addressing table whose keys live in a device
+// arena. A line cut by a chunk end is joined on the host, which sees both sides. After the
+// last chunk, a radix sort of the counts gives the k-th largest one, and only the words
+// counted at least that often are copied back.
+//
+// Needs compute capability 7.0 or later: a thread may wait for a key that another thread
+// of its own warp is still writing, which relies on independent thread scheduling.
+#include "file_stats_cuda.h"
+
+#include <cub/cub.cuh>
+#include <cuda_runtime.h>
+#include <thrust/iterator/counting_iterator.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace file_stats::cuda
+{
+namespace
+{
+
+constexpr std::size_t kMaxWords = kChunkBytes / 2 + 1;       // Words in a chunk, at most
+constexpr unsigned kThreads = 256;                           // Threads per block
+constexpr unsigned kMaxBlocks = 1024;                        // Larger inputs loop over the grid
+constexpr std::size_t kMinSlots = std::size_t(1) << 16;
+
+void check(cudaError_t rc, const char* what) {
+    if (rc != cudaSuccess) throw std::runtime_error(std::string("--gpu: ") + what + ": " + cudaGetErrorString(rc));
+}
+
+unsigned blocks_for(std::size_t n) {
+    return static_cast<unsigned>(std::clamp<std::size_t>((n + kThreads - 1) / kThreads, 1, kMaxBlocks));
+}
+
+// Owning device allocation of `n` elements; the contents start undefined.
+template <typename T>
+class DeviceArray
+{
+public:
+    DeviceArray() = default;
+    explicit DeviceArray(std::size_t n) : n_(n) {
+        check(cudaMalloc(reinterpret_cast<void**>(&p_), std::max<std::size_t>(n, 1) * sizeof(T)), "cudaMalloc");
+    }
+    ~DeviceArray() {
+        if (p_) cudaFree(p_);
+    }
+    DeviceArray(DeviceArray&& o) noexcept : p_(std::exchange(o.p_, nullptr)), n_(std::exchange(o.n_, 0)) {}
+    DeviceArray& operator=(DeviceArray&& o) noexcept {
+        std::swap(p_, o.p_);
+        std::swap(n_, o.n_);
+        return *this;
+    }
+
+    T* get() const { return p_; }
+    std::size_t size() const { return n_; }
+
+private:
+    T* p_ = nullptr;
+    std::size_t n_ = 0;
+};
+
+// Page-locked host memory, which cudaMemcpyAsync can copy from without blocking.
+class PinnedBuffer
+{
+public:
+    explicit PinnedBuffer(std::size_t n) {
+        check(cudaHostAlloc(reinterpret_cast<void**>(&p_), std::max<std::size_t>(n, 1), cudaHostAllocDefault),
+              "cudaHostAlloc");
+    }
+    ~PinnedBuffer() { cudaFreeHost(p_); }
+    PinnedBuffer(const PinnedBuffer&) = delete;
+    PinnedBuffer& operator=(const PinnedBuffer&) = delete;
+
+    char* get() const { return p_; }
+
+private:
+    char* p_ = nullptr;
+};
+
+struct Stream
+{
+    cudaStream_t s{};
+    Stream() { check(cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking), "cudaStreamCreate"); }
+    ~Stream() { cudaStreamDestroy(s); }
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+};
+
+struct Event
+{
+    cudaEvent_t e{};
+    Event() { check(cudaEventCreateWithFlags(&e, cudaEventDisableTiming), "cudaEventCreate"); }
+    ~Event() { cudaEventDestroy(e); }
+    Event(const Event&) = delete;
+    Event& operator=(const Event&) = delete;
+};
+
+__constant__ unsigned char c_word[256];    // 1 for word bytes
+__constant__ unsigned char c_store[256];   // Each byte as it is stored in a key
+
+// Table slot. A slot is claimed by setting `tag`; the claiming thread then copies the key
+// into the arena and publishes it by setting `len1`.
+struct Slot
+{
+    unsigned long long tag;      // Hash of the key, never 0 (0 = empty)
+    unsigned long long count;
+    unsigned long long offset;   // Key bytes in the arena
+    unsigned int len1;           // Key length + 1 once the key is written, 0 before
+    unsigned int pad;
+};
+
+struct DeviceHistogram
+{
+    unsigned long long counts[kLengthBuckets];
+    unsigned long long sum;
+    unsigned long long max;
+};
+static_assert(sizeof(DeviceHistogram) == sizeof(Histogram), "histograms are copied as they are");
+
+// Device-side totals, read back by the host between kernels.
+struct Counters
+{
+    int starts;                  // Positions selected from the current chunk
+    int ends;
+    int newlines;
+    unsigned int overflow;       // The table reached its load limit; some words are pending
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long distinct;
+    unsigned long long arena_used;
+    unsigned long long selected; // Output size of the collect kernels
+};
+
+// Bucket of LengthHistogram::bucket() in file_stats.cpp.
+__host__ __device__ unsigned length_bucket(unsigned long long len) {
+    unsigned long long v = len | (1ull << kLengthSubBits);
+#if defined(__CUDA_ARCH__)
+    unsigned lg = 63 - __clzll(static_cast<long long>(v));
+#else
+    unsigned lg = 0;
+    while (v >>= 1) ++lg;
+#endif
+    unsigned shift = lg - kLengthSubBits;
+    return (shift << kLengthSubBits) + static_cast<unsigned>(len >> shift);
+}
+
+void add_length(Histogram& h, std::uint64_t len) {
+    ++h.counts[length_bucket(len)];
+    h.sum += len;
+    h.max = std::max(h.max, len);
+}
+
+void merge_into(Histogram& into, const Histogram& from) {
+    for (unsigned b = 0; b < kLengthBuckets; ++b) into.counts[b] += from.counts[b];
+    into.sum += from.sum;
+    into.max = std::max(into.max, from.max);
+}
+
+// Selection predicates over the byte positions of a chunk.
+struct WordStart
+{
+    const unsigned char* p;
+    __device__ bool operator()(unsigned i) const { return c_word[p[i]] && (i == 0 || !c_word[p[i - 1]]); }
+};
+
+struct WordEnd
+{
+    const unsigned char* p;
+    unsigned n;
+    __device__ bool operator()(unsigned i) const { return c_word[p[i]] && (i + 1 == n || !c_word[p[i + 1]]); }
+};
+
+struct Newline
+{
+    const unsigned char* p;
+    __device__ bool operator()(unsigned i) const { return p[i] == '\n'; }
+};
+
+// A block bins its lengths in shared memory first, then adds the non-empty buckets to
+// the global histogram.
+__device__ void block_clear(DeviceHistogram& h) {
+    for (unsigned b = threadIdx.x; b < kLengthBuckets; b += blockDim.x) h.counts[b] = 0;
+    if (threadIdx.x == 0) h.sum = h.max = 0;
+    __syncthreads();
+}
+
+__device__ void block_flush(DeviceHistogram& h, unsigned long long sum, unsigned long long longest,
+                            DeviceHistogram* out) {
+    atomicAdd(&h.sum, sum);
+    atomicMax(&h.max, longest);
+    __syncthreads();
+    for (unsigned b = threadIdx.x; b < kLengthBuckets; b += blockDim.x) {
+        if (h.counts[b]) atomicAdd(&out->counts[b], h.counts[b]);
+    }
+    if (threadIdx.x == 0) {
+        atomicAdd(&out->sum, h.sum);
+        atomicMax(&out->max, h.max);
+    }
+}
+
+// Count the words of the chunk that pass the length limits and bin their lengths; the
+// words to insert are flagged in `pending`.
+__global__ void measure_words(const unsigned* starts, const unsigned* ends, unsigned nwords, unsigned min_len,
+                              unsigned max_len, bool lengths, unsigned char* pending, Counters* ctr,
+                              DeviceHistogram* out) {
+    __shared__ DeviceHistogram h;
+    if (lengths) block_clear(h);   // `lengths` is the same for the whole grid
+    unsigned long long words = 0, sum = 0, longest = 0;
+    for (unsigned k = blockIdx.x * blockDim.x + threadIdx.x; k < nwords; k += gridDim.x * blockDim.x) {
+        unsigned len = ends[k] - starts[k] + 1;
+        bool counted = len >= min_len && len <= max_len;
+        pending[k] = counted;
+        if (!counted) continue;
+        ++words;
+        if (lengths) {
+            atomicAdd(&h.counts[length_bucket(len)], 1ull);
+            sum += len;
+            longest = len > longest ? len : longest;
+        }
+    }
+    if (words) atomicAdd(&ctr->words, words);
+    if (lengths) block_flush(h, sum, longest, out);
+}
+
+// Bin the lengths of the lines between consecutive newlines of the chunk. The line that
+// ends at the first newline may have started in an earlier chunk; the host measures it.
+__global__ void measure_lines(const unsigned* newlines, const int* count, bool lengths, Counters* ctr,
+                              DeviceHistogram* out) {
+    const unsigned n = static_cast<unsigned>(*count);
+    if (blockIdx.x == 0 && threadIdx.x == 0) atomicAdd(&ctr->lines, static_cast<unsigned long long>(n));
+    if (!lengths) return;
+    __shared__ DeviceHistogram h;
+    block_clear(h);
+    unsigned long long sum = 0, longest = 0;
+    for (unsigned k = 1 + blockIdx.x * blockDim.x + threadIdx.x; k < n; k += gridDim.x * blockDim.x) {
+        unsigned long long len = newlines[k] - newlines[k - 1] - 1;
+        atomicAdd(&h.counts[length_bucket(len)], 1ull);
+        sum += len;
+        longest = len > longest ? len : longest;
+    }
+    block_flush(h, sum, longest, out);
+}
+
+// FNV-1a over the stored bytes, then a 64-bit finalizer.
+__device__ unsigned long long hash_word(const unsigned char* p, unsigned len) {
+    unsigned long long h = 0xcbf29ce484222325ull;
+    for (unsigned i = 0; i < len; ++i) h = (h ^ c_store[p[i]]) * 0x100000001b3ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+__device__ bool same_key(const volatile unsigned char* key, const unsigned char* p, unsigned len) {
+    for (unsigned i = 0; i < len; ++i) {
+        if (key[i] != c_store[p[i]]) return false;
+    }
+    return true;
+}
+
+// Count every pending word of the chunk in the table. A word that would take the table
+// past `limit` keys stays pending and sets `overflow`; the host grows the table and runs
+// this again for the words still pending.
+__global__ void insert_words(const unsigned char* chunk, const unsigned* starts, const unsigned* ends,
+                             unsigned nwords, unsigned char* pending, Slot* slots, unsigned long long mask,
+                             unsigned long long limit, unsigned char* arena, Counters* ctr) {
+    for (unsigned k = blockIdx.x * blockDim.x + threadIdx.x; k < nwords; k += gridDim.x * blockDim.x) {
+        if (!pending[k]) continue;
+        const unsigned char* w = chunk + starts[k];
+        const unsigned len = ends[k] - starts[k] + 1;
+        const unsigned long long tag = hash_word(w, len);
+        for (unsigned long long i = tag & mask;; i = (i + 1) & mask) {
+            Slot& s = slots[i];
+            unsigned long long t = *reinterpret_cast<volatile unsigned long long*>(&s.tag);
+            if (t == 0) {
+                if (atomicAdd(&ctr->distinct, 1ull) >= limit) {
+                    atomicAdd(&ctr->distinct, ~0ull);
+                    atomicExch(&ctr->overflow, 1u);
+                    break;
+                }
+                t = atomicCAS(&s.tag, 0ull, tag);
+                if (t == 0) {
+                    unsigned long long off = atomicAdd(&ctr->arena_used, static_cast<unsigned long long>(len));
+                    for (unsigned j = 0; j < len; ++j) arena[off + j] = c_store[w[j]];
+                    s.offset = off;
+                    __threadfence();
+                    atomicExch(&s.len1, len + 1);
+                    atomicAdd(&s.count, 1ull);
+                    pending[k] = 0;
+                    break;
+                }
+                atomicAdd(&ctr->distinct, ~0ull);   // Another word took the slot; `t` is its tag
+            }
+            if (t == tag) {
+                unsigned len1;
+                while ((len1 = *reinterpret_cast<volatile unsigned*>(&s.len1)) == 0) {
+                }
+                __threadfence();
+                unsigned long long off = *reinterpret_cast<volatile unsigned long long*>(&s.offset);
+                if (len1 == len + 1 && same_key(arena + off, w, len)) {
+                    atomicAdd(&s.count, 1ull);
+                    pending[k] = 0;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Move every slot of `from` into the empty table `to`. Keys are not compared: each slot
+// already holds a distinct key.
+__global__ void rehash(const Slot* from, unsigned long long n, Slot* to, unsigned long long mask) {
+    for (unsigned long long i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += gridDim.x * blockDim.x) {
+        const Slot s = from[i];
+        if (s.tag == 0) continue;
+        for (unsigned long long j = s.tag & mask;; j = (j + 1) & mask) {
+            if (atomicCAS(&to[j].tag, 0ull, s.tag) == 0) {
+                to[j].count = s.count;
+                to[j].offset = s.offset;
+                to[j].len1 = s.len1;
+                break;
+            }
+        }
+    }
+}
+
+__global__ void collect_counts(const Slot* slots, unsigned long long n, unsigned long long* out,
+                               unsigned long long* used) {
+    for (unsigned long long i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += gridDim.x * blockDim.x) {
+        if (slots[i].tag) out[atomicAdd(used, 1ull)] = slots[i].count;
+    }
+}
+
+__global__ void collect_candidates(const Slot* slots, unsigned long long n, unsigned long long threshold, Slot* out,
+                                   unsigned long long* used) {
+    for (unsigned long long i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += gridDim.x * blockDim.x) {
+        if (slots[i].tag && slots[i].count >= threshold) out[atomicAdd(used, 1ull)] = slots[i];
+    }
+}
+
+// Copy the key of candidate c to packed[pos[c]].
+__global__ void pack_keys(const Slot* cand, unsigned long long n, const unsigned char* arena,
+                          const unsigned long long* pos, unsigned char* packed) {
+    for (unsigned long long c = blockIdx.x * blockDim.x + threadIdx.x; c < n; c += gridDim.x * blockDim.x) {
+        const unsigned len = cand[c].len1 - 1;
+        for (unsigned j = 0; j < len; ++j) packed[pos[c] + j] = arena[cand[c].offset + j];
+    }
+}
+
+std::string device_name() {
+    int dev = 0;
+    check(cudaGetDevice(&dev), "no CUDA device");
+    cudaDeviceProp prop{};
+    check(cudaGetDeviceProperties(&prop, dev), "cudaGetDeviceProperties");
+    std::string name = std::string(prop.name) + " (sm_" + std::to_string(prop.major) + std::to_string(prop.minor) + ")";
+    if (prop.major < 7) throw std::runtime_error("--gpu needs compute capability 7.0 or later; found " + name);
+    return name;
+}
+
+// Device state of one analyze() call.
+class Engine
+{
+public:
+    Engine(const Rules& rules, std::size_t expected)
+        : rules_(rules), staging_(2 * kChunkBytes), host_ctr_(sizeof(Counters)), chunk_(2 * kChunkBytes),
+          positions_(kChunkBytes + 2), pending_(kMaxWords), ctr_(1), hist_(2) {
+        unsigned char word[256];
+        for (unsigned c = 0; c < 256; ++c) word[c] = rules.word[c];
+        check(cudaMemcpyToSymbol(c_word, word, sizeof(word)), "cudaMemcpyToSymbol");
+        check(cudaMemcpyToSymbol(c_store, rules.store, sizeof(rules.store)), "cudaMemcpyToSymbol");
+        check(cudaMemset(ctr_.get(), 0, sizeof(Counters)), "cudaMemset");
+        check(cudaMemset(hist_.get(), 0, 2 * sizeof(DeviceHistogram)), "cudaMemset");
+
+        std::size_t select = 0, bytes = 0;
+        thrust::counting_iterator<unsigned> index(0);
+        const int n = static_cast<int>(kChunkBytes);
+        check(cub::DeviceSelect::If(nullptr, bytes, index, positions_.get(), &ctr_.get()->starts, n, WordStart{nullptr}),
+              "cub::DeviceSelect");
+        select = std::max(select, bytes);
+        check(cub::DeviceSelect::If(nullptr, bytes, index, positions_.get(), &ctr_.get()->ends, n, WordEnd{nullptr, 0}),
+              "cub::DeviceSelect");
+        select = std::max(select, bytes);
+        check(cub::DeviceSelect::If(nullptr, bytes, index, positions_.get(), &ctr_.get()->newlines, n, Newline{nullptr}),
+              "cub::DeviceSelect");
+        temp_ = DeviceArray<unsigned char>(std::max(select, bytes));
+
+        if (!rules.count_only) {
+            std::size_t slots = kMinSlots;
+            while (slots < 2 * expected) slots *= 2;
+            slots_ = DeviceArray<Slot>(slots);
+            check(cudaMemset(slots_.get(), 0, slots * sizeof(Slot)), "cudaMemset");
+            arena_ = DeviceArray<unsigned char>(std::max(kChunkBytes, expected * 8));
+        }
+        // The streams do not wait for the default stream, where the memsets above ran.
+        check(cudaDeviceSynchronize(), "cudaDeviceSynchronize");
+    }
+
+    Result run(const char* data, std::size_t size, std::size_t k) {
+        Result r;
+        std::vector<std::pair<std::size_t, std::size_t>> chunks;
+        for (std::size_t pos = 0; pos < size;) {
+            std::size_t end = chunk_end(data, size, pos, rules_);
+            if (end == pos) throw std::runtime_error("--gpu: a word is longer than the 64 MB device chunk");
+            chunks.emplace_back(pos, end);
+            pos = end;
+        }
+        if (!chunks.empty()) stage(0, data + chunks[0].first, chunks[0].second - chunks[0].first);
+
+        Histogram edge_lines;        // Lines cut by a chunk end, joined here
+        std::uint64_t carry = 0;     // Bytes of the line still open after the last chunk
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+            const unsigned b = i & 1;
+            const char* p = data + chunks[i].first;
+            const std::size_t n = chunks[i].second - chunks[i].first;
+            unsigned char* dev = chunk_.get() + b * kChunkBytes;
+
+            check(cudaStreamWaitEvent(compute_.s, copied_[b].e, 0), "cudaStreamWaitEvent");
+            scan_words(dev, n);
+            if (i + 1 < chunks.size()) {
+                stage(b ^ 1, data + chunks[i + 1].first, chunks[i + 1].second - chunks[i + 1].first);
+            }
+            const Counters c = read_counters();
+            if (c.starts != c.ends) throw std::runtime_error("--gpu: word starts and ends do not pair up");
+            count_words(dev, static_cast<unsigned>(c.starts), c.arena_used, n);
+            scan_lines(dev, n);
+            check(cudaEventRecord(computed_[b].e, compute_.s), "cudaEventRecord");
+
+            // The kernels run while the host joins the line cut by this chunk's start.
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', n));
+            if (!nl) {
+                carry += n;
+            } else {
+                if (!rules_.count_only) add_length(edge_lines, carry + static_cast<std::uint64_t>(nl - p));
+                std::size_t last = n;
+                while (p[last - 1] != '\n') --last;
+                carry = n - last;
+            }
+        }
+
+        const Counters c = read_counters();
+        r.lines = c.lines;
+        r.words = c.words;
+        if (size > 0 && data[size - 1] != '\n') {
+            ++r.lines;
+            if (!rules_.count_only) add_length(edge_lines, carry);
+        }
+        if (!rules_.count_only) {
+            Histogram dev[2];
+            download(dev, hist_.get(), sizeof(dev));
+            r.line_lengths = dev[0];
+            merge_into(r.line_lengths, edge_lines);
+            r.word_lengths = dev[1];
+            r.distinct = c.distinct;
+            collect(k, c.distinct, r);
+        }
+        r.chunks = chunks.size();
+        r.bytes_in = bytes_in_;
+        r.table_growths = growths_;
+        return r;
+    }
+
+private:
+    // Copy `n` bytes into staging buffer `b` and start their transfer to device buffer `b`.
+    void stage(unsigned b, const char* src, std::size_t n) {
+        check(cudaEventSynchronize(copied_[b].e), "cudaEventSynchronize");   // Staging buffer free
+        std::memcpy(staging_.get() + b * kChunkBytes, src, n);
+        check(cudaStreamWaitEvent(copy_.s, computed_[b].e, 0), "cudaStreamWaitEvent");   // Device buffer free
+        check(cudaMemcpyAsync(chunk_.get() + b * kChunkBytes, staging_.get() + b * kChunkBytes, n,
+                              cudaMemcpyHostToDevice, copy_.s),
+              "cudaMemcpyAsync");
+        check(cudaEventRecord(copied_[b].e, copy_.s), "cudaEventRecord");
+        bytes_in_ += n;
+    }
+
+    // Synchronous copies, ordered after the work queued on the compute stream.
+    void download(void* to, const void* from, std::size_t bytes) {
+        check(cudaMemcpyAsync(to, from, bytes, cudaMemcpyDeviceToHost, compute_.s), "cudaMemcpyAsync");
+        check(cudaStreamSynchronize(compute_.s), "cudaStreamSynchronize");
+    }
+
+    void upload(void* to, const void* from, std::size_t bytes) {
+        check(cudaMemcpyAsync(to, from, bytes, cudaMemcpyHostToDevice, compute_.s), "cudaMemcpyAsync");
+        check(cudaStreamSynchronize(compute_.s), "cudaStreamSynchronize");
+    }
+
+    Counters read_counters() {
+        download(host_ctr_.get(), ctr_.get(), sizeof(Counters));
+        Counters c;
+        std::memcpy(&c, host_ctr_.get(), sizeof(c));
+        return c;
+    }
+
+    // Word starts go to the first half of `positions_`, word ends to the second.
+    void scan_words(const unsigned char* dev, std::size_t n) {
+        thrust::counting_iterator<unsigned> index(0);
+        std::size_t bytes = temp_.size();
+        check(cub::DeviceSelect::If(temp_.get(), bytes, index, positions_.get(), &ctr_.get()->starts,
+                                    static_cast<int>(n), WordStart{dev}, compute_.s),
+              "cub::DeviceSelect");
+        bytes = temp_.size();
+        check(cub::DeviceSelect::If(temp_.get(), bytes, index, positions_.get() + kMaxWords, &ctr_.get()->ends,
+                                    static_cast<int>(n), WordEnd{dev, static_cast<unsigned>(n)}, compute_.s),
+              "cub::DeviceSelect");
+    }
+
+    void count_words(const unsigned char* dev, unsigned nwords, unsigned long long arena_used, std::size_t n) {
+        if (nwords == 0) return;
+        const unsigned* starts = positions_.get();
+        const unsigned* ends = positions_.get() + kMaxWords;
+        measure_words<<<blocks_for(nwords), kThreads, 0, compute_.s>>>(starts, ends, nwords, rules_.min_len,
+                                                                       rules_.max_len, !rules_.count_only,
+                                                                       pending_.get(), ctr_.get(), hist_.get() + 1);
+        check(cudaGetLastError(), "measure_words");
+        if (rules_.count_only) return;
+
+        reserve_arena(arena_used, n);   // The chunk's keys take at most `n` bytes
+        for (;;) {
+            check(cudaMemsetAsync(&ctr_.get()->overflow, 0, sizeof(unsigned), compute_.s), "cudaMemsetAsync");
+            insert_words<<<blocks_for(nwords), kThreads, 0, compute_.s>>>(
+                dev, starts, ends, nwords, pending_.get(), slots_.get(), slots_.size() - 1, slots_.size() / 2,
+                arena_.get(), ctr_.get());
+            check(cudaGetLastError(), "insert_words");
+            if (!read_counters().overflow) break;
+            grow_table();
+        }
+    }
+
+    void scan_lines(const unsigned char* dev, std::size_t n) {
+        thrust::counting_iterator<unsigned> index(0);
+        std::size_t bytes = temp_.size();
+        check(cub::DeviceSelect::If(temp_.get(), bytes, index, positions_.get(), &ctr_.get()->newlines,
+                                    static_cast<int>(n), Newline{dev}, compute_.s),
+              "cub::DeviceSelect");
+        measure_lines<<<blocks_for(n), kThreads, 0, compute_.s>>>(positions_.get(), &ctr_.get()->newlines,
+                                                                  !rules_.count_only, ctr_.get(), hist_.get());
+        check(cudaGetLastError(), "measure_lines");
+    }
+
+    void reserve_arena(unsigned long long used, std::size_t more) {
+        if (used + more <= arena_.size()) return;
+        DeviceArray<unsigned char> bigger(std::max<std::size_t>(2 * arena_.size(), used + more));
+        check(cudaMemcpyAsync(bigger.get(), arena_.get(), used, cudaMemcpyDeviceToDevice, compute_.s), "cudaMemcpyAsync");
+        check(cudaStreamSynchronize(compute_.s), "cudaStreamSynchronize");
+        arena_ = std::move(bigger);
+    }
+
+    void grow_table() {
+        DeviceArray<Slot> bigger(2 * slots_.size());
+        check(cudaMemsetAsync(bigger.get(), 0, bigger.size() * sizeof(Slot), compute_.s), "cudaMemsetAsync");
+        rehash<<<blocks_for(slots_.size()), kThreads, 0, compute_.s>>>(slots_.get(), slots_.size(), bigger.get(),
+                                                                      bigger.size() - 1);
+        check(cudaGetLastError(), "rehash");
+        check(cudaStreamSynchronize(compute_.s), "cudaStreamSynchronize");
+        slots_ = std::move(bigger);
+        ++growths_;
+    }
+
+    // Copy back the words counted at least as often as the k-th most frequent one.
+    void collect(std::size_t k, unsigned long long distinct, Result& r) {
+        if (k == 0 || distinct == 0) return;
+        if (distinct > static_cast<unsigned long long>(INT_MAX)) throw std::runtime_error("--gpu: too many distinct words");
+        const int n = static_cast<int>(distinct);
+        unsigned long long* used = &ctr_.get()->selected;
+
+        DeviceArray<unsigned long long> counts(distinct), sorted(distinct);
+        check(cudaMemsetAsync(used, 0, sizeof(*used), compute_.s), "cudaMemsetAsync");
+        collect_counts<<<blocks_for(slots_.size()), kThreads, 0, compute_.s>>>(slots_.get(), slots_.size(),
+                                                                              counts.get(), used);
+        check(cudaGetLastError(), "collect_counts");
+        std::size_t bytes = 0;
+        check(cub::DeviceRadixSort::SortKeysDescending(nullptr, bytes, counts.get(), sorted.get(), n), "cub::DeviceRadixSort");
+        if (bytes > temp_.size()) temp_ = DeviceArray<unsigned char>(bytes);
+        bytes = temp_.size();
+        check(cub::DeviceRadixSort::SortKeysDescending(temp_.get(), bytes, counts.get(), sorted.get(), n, 0,
+                                                       sizeof(unsigned long long) * 8, compute_.s),
+              "cub::DeviceRadixSort");
+        unsigned long long threshold = 0;
+        const std::size_t kth = std::min<std::size_t>(k, distinct) - 1;
+        download(&threshold, sorted.get() + kth, sizeof(threshold));
+
+        DeviceArray<Slot> cand(distinct);
+        check(cudaMemsetAsync(used, 0, sizeof(*used), compute_.s), "cudaMemsetAsync");
+        collect_candidates<<<blocks_for(slots_.size()), kThreads, 0, compute_.s>>>(slots_.get(), slots_.size(),
+                                                                                  threshold, cand.get(), used);
+        check(cudaGetLastError(), "collect_candidates");
+        const std::size_t found = static_cast<std::size_t>(read_counters().selected);
+        std::vector<Slot> slots(found);
+        download(slots.data(), cand.get(), found * sizeof(Slot));
+
+        std::vector<unsigned long long> pos(found);
+        unsigned long long total = 0;
+        for (std::size_t c = 0; c < found; ++c) {
+            pos[c] = total;
+            total += slots[c].len1 - 1;
+        }
+        DeviceArray<unsigned long long> dpos(found);
+        DeviceArray<unsigned char> packed(total);
+        upload(dpos.get(), pos.data(), found * sizeof(pos[0]));
+        pack_keys<<<blocks_for(found), kThreads, 0, compute_.s>>>(cand.get(), found, arena_.get(), dpos.get(),
+                                                                 packed.get());
+        check(cudaGetLastError(), "pack_keys");
+        std::string keys(total, '\0');
+        download(keys.data(), packed.get(), total);
+
+        r.candidates.reserve(found);
+        for (std::size_t c = 0; c < found; ++c) r.candidates.emplace_back(keys.substr(pos[c], slots[c].len1 - 1), slots[c].count);
+    }
+
+    const Rules& rules_;
+    PinnedBuffer staging_;                 // Two chunks: one being copied, one being filled
+    PinnedBuffer host_ctr_;                // Counters as last read back
+    DeviceArray<unsigned char> chunk_;     // Two chunks: one being analyzed, one arriving
+    DeviceArray<unsigned> positions_;      // Word starts and ends, then newlines, of a chunk
+    DeviceArray<unsigned char> pending_;   // Words of the chunk not yet in the table
+    DeviceArray<Counters> ctr_;
+    DeviceArray<DeviceHistogram> hist_;    // Line lengths, word lengths
+    DeviceArray<unsigned char> temp_;      // CUB scratch space
+    DeviceArray<Slot> slots_;              // Power-of-two table, at most half full
+    DeviceArray<unsigned char> arena_;     // Key bytes
+    Stream compute_;
+    Stream copy_;
+    Event copied_[2];                      // Staging buffer b has been copied to the device
+    Event computed_[2];                    // The kernels are done with device buffer b
+    std::uint64_t bytes_in_ = 0;
+    std::uint64_t growths_ = 0;
+};
+
+} // namespace
+
+Result analyze(const char* data, std::size_t size, const Rules& rules, std::size_t k, std::size_t expected) {
+    std::string name = device_name();
+    Engine engine(rules, expected);
+    Result r = engine.run(data, size, k);
+    r.device = std::move(name);
+    return r;
+}
+
+} // namespace file_stats::cuda
@@ -0,0 +1,84 @@
+// Device side of --gpu: tokenizing and counting on a CUDA device. Implemented in
+// file_stats_cuda.cu and linked in only when file_stats.cpp is built with
+// -DFILE_STATS_WITH_CUDA; the interface uses plain C++ types, so the rest of the tool
+// never includes a CUDA header.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace file_stats::cuda
+{
+
+// Bucket layout of LengthHistogram in file_stats.cpp, which checks that they agree.
+constexpr unsigned kLengthSubBits = 3;
+constexpr unsigned kLengthBuckets = (64 - kLengthSubBits + 1) << kLengthSubBits;
+
+struct Histogram
+{
+    std::uint64_t counts[kLengthBuckets] = {};
+    std::uint64_t sum = 0;
+    std::uint64_t max = 0;
+};
+
+// How bytes become words. Words are runs of `word` bytes, stored as `store` maps them;
+// words outside [min_len, max_len] are not counted.
+struct Rules
+{
+    bool word[256] = {};
+    unsigned char store[256] = {};
+    bool count_only = false;        // Lines and words only: no table, no length histograms
+    std::uint32_t min_len = 0;
+    std::uint32_t max_len = UINT32_MAX;
+};
+
+// Largest chunk copied to the device. Chunks end between words, so longer words
+// cannot be counted there.
+constexpr std::size_t kChunkBytes = std::size_t(64) << 20;
+
+// End of the chunk starting at `pos`: at most kChunkBytes on, just after a non-word
+// byte, so that no word spans two chunks. `pos` itself if a word fills the whole
+// kChunkBytes.
+inline std::size_t chunk_end(const char* data, std::size_t size, std::size_t pos, const Rules& rules) {
+    if (size - pos <= kChunkBytes) return size;
+    std::size_t end = pos + kChunkBytes;
+    while (end > pos && rules.word[static_cast<unsigned char>(data[end - 1])]) --end;
+    return end;
+}
+
+// True if analyze() can take the input: no word is as long as a chunk. Otherwise the
+// host tokenizes it, so that results still match a CPU run.
+inline bool fits(const char* data, std::size_t size, const Rules& rules) {
+    for (std::size_t pos = 0, end; pos < size; pos = end) {
+        end = chunk_end(data, size, pos, rules);
+        if (end == pos) return false;
+    }
+    return true;
+}
+
+struct Result
+{
+    std::uint64_t lines = 0;
+    std::uint64_t words = 0;
+    Histogram line_lengths;
+    Histogram word_lengths;
+    std::uint64_t distinct = 0;     // Words in the device table
+    // Every word counted at least as often as the k-th most frequent one, with its exact
+    // count; the top k (ties broken by word) are among them.
+    std::vector<std::pair<std::string, std::uint64_t>> candidates;
+    // What it took.
+    std::string device;             // Name and compute capability
+    std::uint64_t chunks = 0;
+    std::uint64_t bytes_in = 0;     // Copied to the device
+    std::uint64_t table_growths = 0;
+};
+
+// Analyze the `size` bytes at `data` (e.g. a mapping) on the current CUDA device.
+// `expected` (0 if unknown) pre-sizes the device table. The input must fit (see fits()).
+// Throws std::runtime_error if no device is usable or a CUDA call fails.
+Result analyze(const char* data, std::size_t size, const Rules& rules, std::size_t k, std::size_t expected);
+
+} // namespace file_stats::cuda